@@ -5,9 +5,12 @@ set(ROPF_SRCDIR ${ROPF_DIR}/src)
 
 set(ROPF_SOURCES
     ${ROPF_SRCDIR}/BinAutopsy.cpp
+    ${ROPF_SRCDIR}/ChainInterpreter.cpp
+    ${ROPF_SRCDIR}/ChainProfiler.cpp
     ${ROPF_SRCDIR}/Debug.cpp
     ${ROPF_SRCDIR}/LivenessAnalysis.cpp
     ${ROPF_SRCDIR}/MathUtil.cpp
+    ${ROPF_SRCDIR}/OpaqueBenchmark.cpp
     ${ROPF_SRCDIR}/OpaqueConstruct.cpp
     ${ROPF_SRCDIR}/ROPEngine.cpp
     ${ROPF_SRCDIR}/ROPfuscatorConfig.cpp
@@ -33,3 +36,4 @@ endif()
 include_directories(${ROPF_DIR}/thirdparty/fmt/include)
 include_directories(${ROPF_DIR}/thirdparty/tinytoml/include)
 add_subdirectory(${ROPF_DIR}/thirdparty)
+add_subdirectory(${ROPF_DIR}/tools/chain-fuzz)
@@ -0,0 +1,37 @@
+/* ROPfuscator source-level annotations.
+ *
+ * Functions and code regions can select an obfuscation preset, either
+ * built-in ("off", "light", "heavy") or defined in the [presets.<name>]
+ * sections of the configuration file. Annotations take precedence over the
+ * [functions.*] sections.
+ *
+ *   ROPFUSCATOR_FUNCTION("heavy")
+ *   void encrypt(...) { ... }
+ *
+ *   ROPFUSCATOR_REGION("light");
+ *   for (i = 0; i < n; i++) { ... }
+ *   ROPFUSCATOR_REGION_END();
+ *
+ * A region extends from its marker to the next marker (or to the end of the
+ * function), following the order of the code in the compiled function.
+ * Regions should not cross function boundaries: after inlining, the markers
+ * are inlined too.
+ */
+
+#ifndef ROPFUSCATOR_H
+#define ROPFUSCATOR_H
+
+/* keep in sync with ANNOTATION_PREFIX (src/ROPfuscatorConfig.h) */
+#define ROPFUSCATOR_ANNOTATION_PREFIX "ropfuscator:"
+
+#define ROPFUSCATOR_FUNCTION(preset)                                           \
+  __attribute__((annotate(ROPFUSCATOR_ANNOTATION_PREFIX preset)))
+
+/* the marker is an assembly comment, removed by ROPfuscator */
+#define ROPFUSCATOR_REGION(preset)                                             \
+  __asm__ __volatile__("# " ROPFUSCATOR_ANNOTATION_PREFIX preset)
+
+#define ROPFUSCATOR_REGION_END()                                               \
+  __asm__ __volatile__("# " ROPFUSCATOR_ANNOTATION_PREFIX "end")
+
+#endif
@@ -0,0 +1,387 @@
+#!/usr/bin/env python3
+# Searches the obfuscation parameters which give the strongest obfuscation
+# within a run-time overhead target, e.g., "at most 5x slower".
+#
+# The target is rebuilt with generated configuration files (the build command
+# gets the configuration path through the {config} placeholder) and the
+# benchmark command is timed. The overhead is measured against a build with
+# obfuscation disabled.
+#
+# Each function group (--group NAME=REGEX, plus the default group) has its own
+# [functions.*] section. The search is a coordinate descent: starting from ROP
+# transformation only, one parameter of one group is raised by one level at a
+# time, and the move is kept if the overhead target is still met. Moves are
+# tried in order of estimated obfuscation gain per cost: costs are static
+# estimates of the opaque constructs (optionally replaced by the cycles per
+# call measured by tests/bench/opaque-bench.py), weighted by the execution
+# count of the chains of each group (optionally taken from a chain profile,
+# see chain_profile_output). Since raising a parameter never makes the program
+# faster, a rejected move is not tried again.
+#
+# usage: autotune.py --build CMD --run CMD --target RATIO
+#                    [--base-config FILE] [--group NAME=REGEX ...]
+#                    [--repeat N] [--metric REGEX] [--profile FILE]
+#                    [--opaque-bench FILE] [--output FILE]
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+# parameter levels, from the weakest to the strongest obfuscation:
+# (name, [(values, gain, cost)], requires opaque predicates)
+# values are the configuration options set at that level, cost is the
+# estimated overhead (cycles per chain element) at that level.
+PARAMETERS = [
+    ("opaque_predicates", [
+        ({"opaque_predicates_enabled": False}, 0, 0),
+        ({"opaque_predicates_enabled": True}, 4, 2),
+    ], False),
+    ("opaque_predicates_algorithm", [
+        ({"opaque_predicates_algorithm": "mov"}, 0, 0),
+        ({"opaque_predicates_algorithm": "multcomp"}, 2, 4),
+        ({"opaque_predicates_algorithm": "r3sat32"}, 3, 40),
+    ], True),
+    ("opaque_predicates_input_algorithm", [
+        ({"opaque_predicates_input_algorithm": "const"}, 0, 0),
+        ({"opaque_predicates_input_algorithm": "addreg"}, 1, 1),
+        ({"opaque_predicates_input_algorithm": "rdtsc"}, 2, 20),
+    ], True),
+    ("contextual_opaque_predicates", [
+        ({"contextual_opaque_predicates_enabled": False}, 0, 0),
+        ({"contextual_opaque_predicates_enabled": True}, 1, 1),
+    ], True),
+    ("opaque_saved_stack_values", [
+        ({"opaque_saved_stack_values_enabled": False}, 0, 0),
+        ({"opaque_saved_stack_values_enabled": True}, 1, 1),
+    ], True),
+    ("opaque_gadget_addresses", [
+        ({"opaque_gadget_addresses_enabled": False,
+          "gadget_addresses_obfuscation_percentage": 0}, 0, 0),
+        ({"opaque_gadget_addresses_enabled": True,
+          "gadget_addresses_obfuscation_percentage": 25}, 2, 2),
+        ({"opaque_gadget_addresses_enabled": True,
+          "gadget_addresses_obfuscation_percentage": 50}, 3, 4),
+        ({"opaque_gadget_addresses_enabled": True,
+          "gadget_addresses_obfuscation_percentage": 100}, 4, 8),
+    ], True),
+    ("opaque_immediate_operands", [
+        ({"opaque_immediate_operands_enabled": False,
+          "opaque_immediate_operands_percentage": 0}, 0, 0),
+        ({"opaque_immediate_operands_enabled": True,
+          "opaque_immediate_operands_percentage": 50}, 1, 1),
+        ({"opaque_immediate_operands_enabled": True,
+          "opaque_immediate_operands_percentage": 100}, 2, 2),
+    ], True),
+    ("opaque_branch_targets", [
+        ({"opaque_branch_targets_enabled": False,
+          "opaque_branch_targets_percentage": 0}, 0, 0),
+        ({"opaque_branch_targets_enabled": True,
+          "opaque_branch_targets_percentage": 50}, 1, 1),
+        ({"opaque_branch_targets_enabled": True,
+          "opaque_branch_targets_percentage": 100}, 2, 2),
+    ], True),
+    ("opaque_stegano", [
+        ({"opaque_stegano_enabled": False,
+          "opaque_stegano_percentage": 0}, 0, 0),
+        ({"opaque_stegano_enabled": True,
+          "opaque_stegano_percentage": 10}, 1, 1),
+        ({"opaque_stegano_enabled": True,
+          "opaque_stegano_percentage": 50}, 2, 3),
+    ], True),
+]
+
+# parameters whose cost depends on the opaque constant algorithm
+OPAQUE_CONSTANT_USERS = ["opaque_predicates", "opaque_gadget_addresses",
+                         "opaque_immediate_operands", "opaque_branch_targets"]
+
+
+def toml_value(value) -> str:
+    if isinstance(value, bool):
+        return "true" if value else "false"
+    if isinstance(value, str):
+        return f'"{value}"'
+    return str(value)
+
+
+def general_section(base_config: str) -> list:
+    """returns the option lines of the [general] section of base_config"""
+    lines = []
+
+    if base_config:
+        in_general = False
+        with open(base_config) as f:
+            for line in f:
+                header = re.match(r"^\s*\[(.*)\]\s*$", line)
+                if header:
+                    in_general = header.group(1).strip() == "general"
+                elif in_general and line.strip() and \
+                        not re.match(r"^\s*obfuscation_enabled\s*=", line):
+                    lines.append(line.rstrip())
+
+    return lines
+
+
+def write_config(path: str, general: list, groups: list, state: dict,
+                 enabled: bool = True):
+    """writes the configuration of the given state ({group: [level]})"""
+    with open(path, "w") as f:
+        f.write("[general]\n")
+        f.write(f"obfuscation_enabled = {toml_value(enabled)}\n")
+        for line in general:
+            f.write(line + "\n")
+
+        for name, regex in groups:
+            f.write(f"\n[functions.{name}]\n")
+            if regex is not None:
+                f.write(f"name = {toml_value(regex)}\n")
+            for (_, levels, _), level in zip(PARAMETERS, state[name]):
+                for key, value in levels[level][0].items():
+                    f.write(f"{key} = {toml_value(value)}\n")
+
+
+def measure(args, config: str) -> float:
+    """builds the target with the configuration and returns the benchmark
+    metric (the lowest of the runs)"""
+    env = dict(os.environ, ROPF_CONFIG=config)
+    subprocess.run(args.build.replace("{config}", config), shell=True,
+                   check=True, env=env, stdout=subprocess.DEVNULL)
+    best = None
+
+    for _ in range(args.repeat):
+        start = time.monotonic()
+        result = subprocess.run(args.run, shell=True, env=env,
+                                capture_output=True, text=True)
+        elapsed = time.monotonic() - start
+
+        if result.returncode != 0:
+            raise RuntimeError(f"benchmark failed ({result.returncode}):\n"
+                               f"{result.stderr}")
+        if args.metric:
+            match = re.search(args.metric, result.stdout)
+            if not match:
+                raise RuntimeError("metric not found in benchmark output")
+            elapsed = float(match.group(1))
+
+        best = elapsed if best is None else min(best, elapsed)
+
+    return best
+
+
+def sort_groups(groups: list) -> list:
+    """returns the groups in the order the pass matches them: the [functions.*]
+    sections are kept in a std::map keyed by their regex, hence a function
+    belongs to the group with the lowest matching regex, whatever the order of
+    the --group options"""
+    regexes = [regex for _, regex in groups]
+    for regex in regexes:
+        if regexes.count(regex) > 1:
+            raise ValueError(f"several groups have the regex {regex!r}")
+    # str comparison is the byte order of std::string for UTF-8 regexes
+    return sorted(groups, key=lambda group: group[1])
+
+
+def group_weights(groups: list, profile: str) -> dict:
+    """returns the share of chain executions of each group"""
+    if not profile:
+        return {name: 1.0 / len(groups) for name, _ in groups}
+
+    counts = {name: 0 for name, _ in groups}
+    with open(profile) as f:
+        for line in f:
+            fields = line.rstrip("\n").split("\t")
+            if len(fields) != 2:
+                continue
+            function = re.sub(r"_chain_\d+$", "", fields[0])
+            # same rule as the pass: the first matching group in the order
+            # of its regex (see sort_groups), otherwise the default one
+            group = next((name for name, regex in groups
+                          if regex is not None and
+                          re.fullmatch(regex, function)), "default")
+            counts[group] += int(fields[1])
+
+    total = sum(counts.values())
+    if total == 0:
+        return {name: 1.0 / len(groups) for name, _ in groups}
+    # groups which never run still get a small weight, to break ties
+    return {name: max(count / total, 1e-3) for name, count in counts.items()}
+
+
+def load_opaque_bench(path: str):
+    """updates the static costs with the run-time cycles per call measured
+    by opaque-bench.py (the "cycles" column; the other columns are static
+    sizes)"""
+    cycles = {}
+    with open(path) as f:
+        lines = f.readlines()
+    if not lines:
+        return
+    header = [field.strip() for field in lines[0].split("\t")]
+    if "cycles" not in header:
+        print(f"[-] {path}: no cycles column", file=sys.stderr)
+        return
+    column = header.index("cycles")
+
+    for line in lines[1:]:
+        fields = [field.strip() for field in line.split("\t")]
+        if len(fields) > column and fields[0].startswith("const/"):
+            _, algorithm, input_algorithm = fields[0].split("/")
+            cycles[(algorithm, input_algorithm)] = float(fields[column])
+
+    if not cycles:
+        return
+    base = min(cycles.values())
+
+    for name, levels, _ in PARAMETERS:
+        for i, (values, gain, _) in enumerate(levels):
+            if name == "opaque_predicates_algorithm":
+                algorithm = values["opaque_predicates_algorithm"]
+                costs = [c for (a, _), c in cycles.items() if a == algorithm]
+            elif name == "opaque_predicates_input_algorithm":
+                input_algorithm = values["opaque_predicates_input_algorithm"]
+                costs = [c for (_, b), c in cycles.items()
+                         if b == input_algorithm]
+            else:
+                continue
+            if costs:
+                levels[i] = (values, gain, min(costs) - base)
+
+
+def move_cost(state: list, index: int) -> float:
+    """estimated cost of raising parameter index by one level"""
+    name, levels, _ = PARAMETERS[index]
+    level = state[index]
+    cost = levels[level + 1][2] - levels[level][2]
+
+    # raising the opaque constant algorithm makes every user more expensive
+    if name in ("opaque_predicates_algorithm",
+                "opaque_predicates_input_algorithm"):
+        users = sum(1 for i, (n, _, _) in enumerate(PARAMETERS)
+                    if n in OPAQUE_CONSTANT_USERS and state[i] > 0)
+        cost *= max(users, 1)
+
+    return max(cost, 0.1)
+
+
+def candidate_moves(state: dict, weights: dict, rejected: set) -> list:
+    """returns the possible moves (group, index), best gain/cost first"""
+    moves = []
+
+    for group, levels in state.items():
+        opaque = levels[0] > 0
+        for index, (_, parameter_levels, needs_opaque) in \
+                enumerate(PARAMETERS):
+            if levels[index] + 1 >= len(parameter_levels):
+                continue
+            if needs_opaque and not opaque:
+                continue
+            if (group, index, levels[index] + 1) in rejected:
+                continue
+
+            gain = parameter_levels[levels[index] + 1][1] - \
+                parameter_levels[levels[index]][1]
+            cost = move_cost(levels, index) * weights[group]
+            moves.append((gain / cost, group, index))
+
+    moves.sort(key=lambda move: -move[0])
+    return [(group, index) for _, group, index in moves]
+
+
+def describe(group: str, state: dict, index: int) -> str:
+    name, levels, _ = PARAMETERS[index]
+    values = ", ".join(f"{key} = {toml_value(value)}"
+                       for key, value in levels[state[group][index]][0].items())
+    return f"[functions.{group}] {values}"
+
+
+def strength(state: dict) -> int:
+    return sum(PARAMETERS[i][1][level][1]
+               for levels in state.values() for i, level in enumerate(levels))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--build", required=True,
+                        help="build command, {config} is replaced by the "
+                        "configuration path (also in $ROPF_CONFIG)")
+    parser.add_argument("--run", required=True, help="benchmark command")
+    parser.add_argument("--target", type=float, required=True,
+                        help="maximum slowdown w.r.t. the non-obfuscated "
+                        "build (e.g., 5 for 5x)")
+    parser.add_argument("--base-config",
+                        help="configuration whose [general] section is used")
+    parser.add_argument("--group", action="append", default=[],
+                        metavar="NAME=REGEX",
+                        help="function group tuned separately")
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="benchmark runs per configuration")
+    parser.add_argument("--metric",
+                        help="regex extracting the metric (group 1) from the "
+                        "benchmark output, instead of the wall-clock time")
+    parser.add_argument("--profile",
+                        help="chain profile (chain_profile_output) weighting "
+                        "the cost of each group")
+    parser.add_argument("--opaque-bench",
+                        help="output of tests/bench/opaque-bench.py, used as "
+                        "static cost estimates")
+    parser.add_argument("--output", default="ropfuscator-tuned.conf")
+    args = parser.parse_args()
+
+    groups = sort_groups([(name, regex) for name, regex in
+                          (group.split("=", 1) for group in args.group)])
+    groups.append(("default", None))
+
+    if args.opaque_bench:
+        load_opaque_bench(args.opaque_bench)
+
+    general = general_section(args.base_config)
+    weights = group_weights(groups, args.profile)
+    state = {name: [0] * len(PARAMETERS) for name, _ in groups}
+    rejected = set()
+
+    with tempfile.TemporaryDirectory() as tmpdir:
+        config = os.path.join(tmpdir, "ropfuscator.conf")
+
+        write_config(config, general, groups, state, enabled=False)
+        baseline = measure(args, config)
+        print(f"[*] baseline: {baseline:.4f}")
+
+        write_config(config, general, groups, state)
+        overhead = measure(args, config) / baseline
+        print(f"[*] ROP transformation only: {overhead:.2f}x")
+
+        if overhead > args.target:
+            print("[-] the target cannot be met, even with ROP "
+                  "transformation only", file=sys.stderr)
+            return 1
+
+        moves = candidate_moves(state, weights, rejected)
+        while moves:
+            group, index = moves[0]
+            state[group][index] += 1
+
+            write_config(config, general, groups, state)
+            measured = measure(args, config) / baseline
+            step = describe(group, state, index)
+
+            if measured <= args.target:
+                overhead = measured
+                print(f"[+] {step}: {measured:.2f}x")
+            else:
+                print(f"[-] {step}: {measured:.2f}x (rejected)")
+                rejected.add((group, index, state[group][index]))
+                state[group][index] -= 1
+
+            moves = candidate_moves(state, weights, rejected)
+
+    write_config(args.output, general, groups, state)
+    print(f"[*] {args.output}: overhead {overhead:.2f}x, "
+          f"strength {strength(state)}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -6,12 +6,12 @@
 #include "BinAutopsy.h"
 #include "ChainElem.h"
 #include "Debug.h"
-#include "MathUtil.h"
 #include "ROPEngine.h"
 #include "llvm/CodeGen/MachineModuleInfo.h"
 #include "llvm/MC/MCCodeEmitter.h"
 #include "llvm/MC/MCContext.h"
 #include "llvm/MC/MCDisassembler/MCDisassembler.h"
+#include "llvm/Object/Archive.h"
 #include "llvm/Object/ELF.h"
 #include "llvm/Support/SHA1.h"
 #include "llvm/Support/TargetRegistry.h"
@@ -25,62 +25,188 @@
 #define FMT_HEADER_ONLY
 #include <fmt/format.h>
 #include <fstream>
+#include <future>
+#include <list>
+#include <mutex>
 #include <sstream>
 #include <string.h>
 
 using namespace llvm;
 using llvm::object::ELF32LE;
-using llvm::object::ELF32LEFile;
+using llvm::object::ELF64LE;
+using llvm::object::ELFFile;
 
 namespace ropf {
 
+// ELFParser - parser of ELF shared libraries. The actual parser is
+// instantiated according to the ELF class of the file, or to its archive
+// header for static archives (see create()).
 class ELFParser {
 public:
-  ELFParser(const std::string &path)
-      : path(path), dynsym(0), verdef(0), versym(0) {
-    std::ifstream f(path, std::ios::binary);
+  // DynamicFunction - function symbol exported in the dynamic symbol table
+  struct DynamicFunction {
+    std::string name;
+    std::string version;
+    uint64_t    address;
+  };
 
-    if (!f.good()) {
-      dbg_fmt("Given file {} does not exist or is invalid", path);
-      exit(1);
+  virtual ~ELFParser() = default;
+
+  // create - reads the file and returns its parser (see parse()).
+  static std::unique_ptr<ELFParser> create(const std::string &path);
+
+  // read - returns the content of the file
+  static std::vector<char> read(const std::string &path);
+
+  // parse - returns the ELF32LE / ELF64LE parser of the content of the file,
+  // or the parser of static archives.
+  static std::unique_ptr<ELFParser> parse(const std::string &path,
+                                          std::vector<char> &&buf);
+
+  // hashHex - hex digest of the SHA1 of data
+  static std::string hashHex(llvm::ArrayRef<uint8_t> data) {
+    llvm::SHA1 sha1;
+    sha1.update(data);
+    return toHex(sha1.final());
+  }
+
+  const uint8_t *base() const {
+    return reinterpret_cast<const uint8_t *>(&buf[0]);
+  }
+  size_t size() const { return buf.size(); }
+
+  virtual bool is64Bit() const { return buf[ELF_EI_CLASS] == ELF_CLASS64; }
+
+  // isStaticArchive - true if the code is extracted from the objects of a
+  // static archive (see ArchiveParser)
+  virtual bool isStaticArchive() const { return false; }
+
+  // isFixedRange - true if the bytes in [begin, end) are not modified by the
+  // static linker, and can be part of a gadget
+  virtual bool isFixedRange(uint64_t begin, uint64_t end) const {
+    return true;
+  }
+
+  // getCodeSegments - loadable and executable segments
+  virtual std::vector<Section> getCodeSegments() const = 0;
+
+  // getCodeSections - sections containing executable code
+  virtual std::vector<Section> getCodeSections() const = 0;
+
+  // getDynamicFunctions - global or weak functions defined in .dynsym, in
+  // symbol table order (global functions of the members, for static archives)
+  virtual std::vector<DynamicFunction> getDynamicFunctions() const = 0;
+
+  std::string getPath() const { return path; }
+
+  std::string getSHA1HashRaw() const {
+    if (sha1hash.empty()) {
+      llvm::SHA1 sha1;
+      sha1.update(
+          llvm::ArrayRef<uint8_t>((const uint8_t *)&buf[0], buf.size()));
+      sha1hash = sha1.final();
     }
+    return sha1hash;
+  }
 
-    // dbg_fmt("Analysing {}\n", path);
+  std::string getSHA1HashHex() const { return toHex(getSHA1HashRaw()); }
 
-    f.seekg(0, std::ios::end);
+protected:
+  // ELF constants
 
-    size_t size = f.tellg();
+  // EI_CLASS: index of the file class in e_ident
+  static const int ELF_EI_CLASS          = 4;
+  // ELFCLASS32: 32-bit objects
+  static const int ELF_CLASS32           = 1;
+  // ELFCLASS64: 64-bit objects
+  static const int ELF_CLASS64           = 2;
+  // ET_REL: relocatable object file
+  static const int ELF_ET_REL            = 1;
+  // SHT_PROGBITS: code section loaded into memory
+  static const int ELF_SHT_PROGBITS      = 1;
+  // SHT_SYMTAB: static symbol table
+  static const int ELF_SHT_SYMTAB        = 2;
+  // SHT_RELA: relocation entries with addends
+  static const int ELF_SHT_RELA          = 4;
+  // SHT_REL: relocation entries without addends
+  static const int ELF_SHT_REL           = 9;
+  // SHT_DYNSYM: dynamic symbol table
+  static const int ELF_SHT_DYNSYM        = 11;
+  // SHT_GNU_verdef: symbol version definition
+  static const int ELF_SHT_GNU_verdef    = 0x6ffffffd;
+  // SHT_GNU_versym: symbol version information
+  static const int ELF_SHT_GNU_versym    = 0x6fffffff;
+  // SHF_EXECINSTR: executable flag of section
+  static const int ELF_SHF_EXECINSTR     = 0x4;
+  // SHF_GROUP: section member of a group (e.g., COMDAT)
+  static const int ELF_SHF_GROUP         = 0x200;
+  // PT_LOAD: code segment loaded into memory
+  static const int ELF_PT_LOAD           = 1;
+  // PF_X: executable flag of segment
+  static const int ELF_PF_X              = 0x01;
+  // symbol type: function
+  static const int ELF_STT_FUNC          = 2;
+  // symbol binding: global
+  static const int ELF_STB_GLOBAL        = 1;
+  // symbol binding: weak
+  static const int ELF_STB_WEAK          = 2;
+  // version table index: local
+  static const int ELF_VER_NDX_LOCAL     = 0;
+  // version table index: global
+  static const int ELF_VER_NDX_GLOBAL    = 1;
+  // version table index: max value + 1
+  static const int ELF_VER_NDX_LORESERVE = 0xff00;
 
-    f.seekg(0, std::ios::beg);
-    buf.resize(size);
-    f.read(&buf[0], size);
-    f.close();
+  std::string         path;
+  std::vector<char>   buf;
+  mutable std::string sha1hash;
 
-    auto elf_opt = ELF32LEFile::create(StringRef(&buf[0], size));
+  ELFParser(const std::string &path, std::vector<char> &&buf)
+      : path(path), buf(std::move(buf)) {}
+
+private:
+  static std::string toHex(llvm::StringRef hash) {
+    std::string s;
+    s.reserve(hash.size() * 2);
+    for (unsigned char c : hash) {
+      s += fmt::format("{:02x}", c);
+    }
+    return s;
+  }
+};
+
+// ELFParserImpl - parser of a specific ELF class (ELF32LE or ELF64LE).
+template <class ELFT> class ELFParserImpl : public ELFParser {
+public:
+  using Phdr = typename ELFT::Phdr;
+  using Shdr = typename ELFT::Shdr;
+  using Sym  = typename ELFT::Sym;
+
+  ELFParserImpl(const std::string &path, std::vector<char> &&buf)
+      : ELFParser(path, std::move(buf)), dynsym(0), verdef(0), versym(0) {
+    auto elf_opt = ELFFile<ELFT>::create(StringRef(&this->buf[0], size()));
 
     if (!elf_opt) {
       dbg_fmt("ELF file error: {}: {}\n", path, elf_opt.takeError());
       exit(1);
     }
 
-    this->elf.reset(new ELF32LEFile(*elf_opt));
+    this->elf.reset(new ELFFile<ELFT>(*elf_opt));
 
     parseSections();
     parseVerdefs();
   }
 
-  const uint8_t *base() const { return elf->base(); }
-  size_t         size() const { return elf->getBufSize(); }
-
-  std::vector<ELF32LE::Phdr> getCodeSegments() const {
-    std::vector<ELF32LE::Phdr> rv;
+  std::vector<Section> getCodeSegments() const override {
+    std::vector<Section> rv;
 
     if (auto segments = elf->program_headers()) {
       // iterate through segments
       for (auto &seg : *segments) {
         // check if it is loadable segment and executable
         if (seg.p_type == ELF_PT_LOAD && (seg.p_flags & ELF_PF_X)) {
-          rv.push_back(seg);
+          rv.push_back(
+              Section("<unnamed-segment>", seg.p_offset, seg.p_filesz));
         }
       }
     }
@@ -88,51 +214,92 @@ public:
     return rv;
   }
 
-  std::vector<ELF32LE::Shdr> getCodeSections() const {
-    std::vector<ELF32LE::Shdr> rv;
+  std::vector<Section> getCodeSections() const override {
+    std::vector<Section> rv;
     if (auto sections = elf->sections()) {
       for (auto &section : *sections) {
         if (section.sh_type == ELF_SHT_PROGBITS &&
             (section.sh_flags & ELF_SHF_EXECINSTR)) {
-          rv.push_back(section);
+          rv.push_back(Section(getSectionName(section),
+                               section.sh_addr,
+                               section.sh_size));
         }
       }
     }
     return rv;
   }
 
-  std::string getSectionName(const ELF32LE::Shdr &section) const {
-    if (auto sectname_opt = elf->getSectionName(&section)) {
-      return sectname_opt->str();
+  std::vector<DynamicFunction> getDynamicFunctions() const override {
+    std::vector<DynamicFunction> rv;
+    ArrayRef<Sym>                symbols;
+
+    if (auto symbols_opt = elf->symbols(dynsym)) {
+      symbols = *symbols_opt;
     }
 
-    return "<unnamed>";
-  }
+    for (size_t i = 0; i < symbols.size(); i++) {
+      const Sym &sym = symbols[i];
 
-  ArrayRef<ELF32LE::Sym> getDynamicSymbols() const {
-    auto symbols = elf->symbols(dynsym);
+      if (!isGlobalOrWeakFunction(sym) || !sym.isDefined()) {
+        continue;
+      }
+
+      auto name_opt = sym.getName(dynstrtab);
 
-    if (symbols) {
-      return *symbols;
+      if (!name_opt) {
+        consumeError(name_opt.takeError());
+        continue;
+      }
+
+      rv.push_back(DynamicFunction{name_opt->str(),
+                                   getSymbolVersion(i),
+                                   sym.getValue()});
     }
 
-    return ArrayRef<ELF32LE::Sym>();
+    return rv;
   }
 
-  Expected<StringRef> getSymbolName(const ELF32LE::Sym &sym) const {
-    return sym.getName(dynstrtab);
+private:
+  struct Verdef {
+    uint16_t vd_version;
+    uint16_t vd_flags;
+    uint16_t vd_ndx;
+    uint16_t vd_cnt;
+    uint32_t vd_hash;
+    uint32_t vd_aux;
+    uint32_t vd_next;
+  };
+  struct Verdef_aux {
+    uint32_t vda_name;
+    uint32_t vda_next;
+  };
+
+  std::unique_ptr<ELFFile<ELFT>> elf;
+  const Shdr                    *dynsym;
+  const Shdr                    *verdef;
+  const Shdr                    *versym;
+  StringRef                      dynstrtab;
+  std::vector<std::string>       verdefs;
+
+  std::string getSectionName(const Shdr &section) const {
+    if (auto sectname_opt = elf->getSectionName(&section)) {
+      return sectname_opt->str();
+    }
+
+    return "<unnamed>";
   }
 
-  bool isGlobalOrWeakFunction(const ELF32LE::Sym &sym) const {
+  bool isGlobalOrWeakFunction(const Sym &sym) const {
     return sym.getType() == ELF_STT_FUNC &&
            (sym.getBinding() == ELF_STB_GLOBAL ||
             sym.getBinding() == ELF_STB_WEAK);
   }
 
   std::string getSymbolVersion(int symindex) const {
-    auto versyms = elf->getSectionContentsAsArray<uint16_t>(versym);
+    auto versyms = elf->template getSectionContentsAsArray<uint16_t>(versym);
 
     if (!versyms) {
+      consumeError(versyms.takeError());
       return "";
     }
 
@@ -152,82 +319,6 @@ public:
     return verdefs[value];
   }
 
-  std::string getPath() const { return path; }
-
-  std::string getSHA1HashRaw() const {
-    if (sha1hash.empty()) {
-      llvm::SHA1 sha1;
-      sha1.update(
-          llvm::ArrayRef<uint8_t>((const uint8_t *)&buf[0], buf.size()));
-      sha1hash = sha1.final();
-    }
-    return sha1hash;
-  }
-
-  std::string getSHA1HashHex() const {
-    std::string hash = getSHA1HashRaw();
-    std::string s;
-    s.reserve(hash.length() * 2);
-    for (unsigned char c : getSHA1HashRaw()) {
-      s += fmt::format("{:02x}", c);
-    }
-    return s;
-  }
-
-private:
-  struct Verdef {
-    uint16_t vd_version;
-    uint16_t vd_flags;
-    uint16_t vd_ndx;
-    uint16_t vd_cnt;
-    uint32_t vd_hash;
-    uint32_t vd_aux;
-    uint32_t vd_next;
-  };
-  struct Verdef_aux {
-    uint32_t vda_name;
-    uint32_t vda_next;
-  };
-
-  // ELF constants
-
-  // SHT_PROGBITS: code section loaded into memory
-  static const int ELF_SHT_PROGBITS      = 1;
-  // SHT_DYNSYM: dynamic symbol table
-  static const int ELF_SHT_DYNSYM        = 11;
-  // SHT_GNU_verdef: symbol version definition
-  static const int ELF_SHT_GNU_verdef    = 0x6ffffffd;
-  // SHT_GNU_versym: symbol version information
-  static const int ELF_SHT_GNU_versym    = 0x6fffffff;
-  // SHF_EXECINSTR: executable flag of section
-  static const int ELF_SHF_EXECINSTR     = 0x4;
-  // PT_LOAD: code segment loaded into memory
-  static const int ELF_PT_LOAD           = 1;
-  // PF_X: executable flag of segment
-  static const int ELF_PF_X              = 0x01;
-  // symbol type: function
-  static const int ELF_STT_FUNC          = 2;
-  // symbol binding: global
-  static const int ELF_STB_GLOBAL        = 1;
-  // symbol binding: weak
-  static const int ELF_STB_WEAK          = 2;
-  // version table index: local
-  static const int ELF_VER_NDX_LOCAL     = 0;
-  // version table index: global
-  static const int ELF_VER_NDX_GLOBAL    = 1;
-  // version table index: max value + 1
-  static const int ELF_VER_NDX_LORESERVE = 0xff00;
-
-  std::string                  path;
-  std::unique_ptr<ELF32LEFile> elf;
-  std::vector<char>            buf;
-  mutable std::string          sha1hash;
-  const ELF32LE::Shdr         *dynsym;
-  const ELF32LE::Shdr         *verdef;
-  const ELF32LE::Shdr         *versym;
-  StringRef                    dynstrtab;
-  std::vector<std::string>     verdefs;
-
   void parseSections() {
     // identify dynsym, verdef, versym sections
     if (auto sections = elf->sections()) {
@@ -299,63 +390,513 @@ private:
   }
 };
 
-BinaryAutopsy::BinaryAutopsy(const GlobalConfig  &config,
-                             const Module        &module,
-                             const TargetMachine &target,
-                             MCContext           &context)
-    : module(module), target(target), context(context), config(config),
-      elf(new ELFParser(config.libraryPath)) {
-  std::string sha1 = elf->getSHA1HashHex();
-  dbg_fmt("[*] Extracting gadgets from: {} SHA1={}\n", elf->getPath(), sha1);
-  if (!config.librarySHA1.empty() && config.librarySHA1 != sha1) {
-    dbg_fmt("[!] Error: library SHA1 mismatch: expected={}, actual={}\n",
-            config.librarySHA1,
-            sha1);
+// ArchiveParser - parser of static archives (e.g. libc.a). The code sections
+// of the ELF relocatable objects of the archive are concatenated in a
+// synthetic image, in which the gadgets are searched. Since the static linker
+// places each section independently, a gadget is referenced through a global
+// function defined in its section, and only the sections defining one are
+// returned.
+class ArchiveParser : public ELFParser {
+public:
+  // ARCHIVE_MAGIC - header of (non-thin) static archives
+  static constexpr const char *ARCHIVE_MAGIC = "!<arch>\n";
+  // ELF_MAGIC - header of ELF files
+  static constexpr const char *ELF_MAGIC     = "\177ELF";
+
+  ArchiveParser(const std::string &path, std::vector<char> &&archive)
+      : ELFParser(path, std::vector<char>()), elfClass(0) {
+    // the analysis is identified by the archive, not by the synthetic image
+    llvm::SHA1 sha1;
+    sha1.update(
+        ArrayRef<uint8_t>((const uint8_t *)&archive[0], archive.size()));
+    sha1hash = sha1.final();
+
+    auto archive_opt = object::Archive::create(
+        MemoryBufferRef(StringRef(&archive[0], archive.size()), path));
+
+    if (!archive_opt) {
+      dbg_fmt("Archive file error: {}: {}\n", path, archive_opt.takeError());
+      exit(1);
+    }
+
+    Error err = Error::success();
+    for (auto &child : (*archive_opt)->children(err)) {
+      auto name_opt = child.getName();
+      auto data_opt = child.getBuffer();
+
+      if (!name_opt || !data_opt) {
+        consumeError(name_opt.takeError());
+        consumeError(data_opt.takeError());
+        continue;
+      }
+
+      // skip the members which are not ELF objects
+      StringRef data = *data_opt;
+      if (data.size() <= ELF_EI_CLASS || !data.startswith(ELF_MAGIC)) {
+        continue;
+      }
+
+      // the ELF class of the archive is the one of its first object
+      char memberClass = data[ELF_EI_CLASS];
+      if (elfClass == 0 &&
+          (memberClass == ELF_CLASS32 || memberClass == ELF_CLASS64)) {
+        elfClass = memberClass;
+      }
+
+      if (elfClass == 0 || memberClass != elfClass) {
+        continue;
+      }
+
+      if (elfClass == ELF_CLASS32) {
+        addMember<ELF32LE>(name_opt->str(), data);
+      } else {
+        addMember<ELF64LE>(name_opt->str(), data);
+      }
+    }
+
+    if (err) {
+      dbg_fmt("Archive file error: {}: {}\n", path, err);
+      exit(1);
+    }
+
+    if (sections.empty()) {
+      dbg_fmt("Archive file error: {}: no code section defining a global "
+              "function\n",
+              path);
+      exit(1);
+    }
+  }
+
+  bool is64Bit() const override { return elfClass == ELF_CLASS64; }
+
+  bool isStaticArchive() const override { return true; }
+
+  bool isFixedRange(uint64_t begin, uint64_t end) const override {
+    // the section following the one containing begin
+    auto next = std::upper_bound(
+        sections.begin(),
+        sections.end(),
+        begin,
+        [](uint64_t addr, const Section &s) { return addr < s.Address; });
+
+    if (next == sections.begin()) {
+      return false;
+    }
+
+    const Section &section = *(next - 1);
+    if (end > section.Address + section.Length) {
+      return false;
+    }
+
+    for (uint64_t i = begin; i < end; i++) {
+      if (relocated[i]) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // relocatable objects have no segments
+  std::vector<Section> getCodeSegments() const override { return sections; }
+
+  std::vector<Section> getCodeSections() const override { return sections; }
+
+  std::vector<DynamicFunction> getDynamicFunctions() const override {
+    std::vector<DynamicFunction> rv;
+
+    // the member defining a name twice in the archive depends on the link
+    for (auto &function : functions) {
+      if (definitions.at(function.name) == 1) {
+        rv.push_back(function);
+      }
+    }
+
+    return rv;
+  }
+
+private:
+  // SECTION_ALIGN - alignment of the sections in the image
+  static const int SECTION_ALIGN = 16;
+
+  int                          elfClass;
+  std::vector<Section>         sections;
+  // relocated - bytes of the image patched by the static linker
+  std::vector<bool>            relocated;
+  std::vector<DynamicFunction> functions;
+  // definitions - number of members defining each function
+  std::map<std::string, int>   definitions;
+
+  // addMember - appends the code sections of the object to the image, with
+  // its global functions.
+  template <class ELFT>
+  void addMember(const std::string &member, StringRef data) {
+    using Shdr = typename ELFT::Shdr;
+
+    auto elf_opt = ELFFile<ELFT>::create(data);
+
+    if (!elf_opt) {
+      consumeError(elf_opt.takeError());
+      return;
+    }
+
+    const ELFFile<ELFT> &elf = *elf_opt;
+
+    if (elf.getHeader()->e_type != ELF_ET_REL) {
+      return;
+    }
+
+    auto sections_opt = elf.sections();
+
+    if (!sections_opt) {
+      consumeError(sections_opt.takeError());
+      return;
+    }
+
+    auto shdrs = *sections_opt;
+
+    // address in the image of the code sections, by section index
+    std::map<size_t, uint64_t> bases;
+
+    for (size_t i = 0; i < shdrs.size(); i++) {
+      const Shdr &shdr = shdrs[i];
+
+      // sections of a group (e.g., COMDAT) may be replaced by the copy of
+      // another object
+      if (shdr.sh_type != ELF_SHT_PROGBITS ||
+          !(shdr.sh_flags & ELF_SHF_EXECINSTR) ||
+          (shdr.sh_flags & ELF_SHF_GROUP)) {
+        continue;
+      }
+
+      auto contents_opt = elf.getSectionContents(&shdr);
+
+      if (!contents_opt) {
+        consumeError(contents_opt.takeError());
+        continue;
+      }
+
+      uint64_t base = alignTo(buf.size(), SECTION_ALIGN);
+      buf.resize(base);
+      buf.insert(buf.end(), contents_opt->begin(), contents_opt->end());
+      bases.emplace(i, base);
+    }
+
+    relocated.resize(buf.size(), false);
+
+    // each relocated field is assumed to be as wide as a pointer, which covers
+    // the relocation types of the code
+    uint64_t fieldSize = elfClass == ELF_CLASS64 ? 8 : 4;
+    auto     markRelocated = [&](uint64_t offset) {
+      uint64_t end = std::min<uint64_t>(offset + fieldSize, relocated.size());
+      for (uint64_t i = offset; i < end; i++) {
+        relocated[i] = true;
+      }
+    };
+
+    std::set<size_t> anchored;
+
+    for (const Shdr &shdr : shdrs) {
+      if (shdr.sh_type == ELF_SHT_REL || shdr.sh_type == ELF_SHT_RELA) {
+        auto base = bases.find(shdr.sh_info);
+
+        if (base == bases.end()) {
+          continue;
+        }
+
+        if (shdr.sh_type == ELF_SHT_REL) {
+          if (auto rels = elf.rels(&shdr)) {
+            for (auto &rel : *rels) {
+              markRelocated(base->second + rel.r_offset);
+            }
+          } else {
+            consumeError(rels.takeError());
+          }
+        } else {
+          if (auto relas = elf.relas(&shdr)) {
+            for (auto &rela : *relas) {
+              markRelocated(base->second + rela.r_offset);
+            }
+          } else {
+            consumeError(relas.takeError());
+          }
+        }
+      } else if (shdr.sh_type == ELF_SHT_SYMTAB) {
+        auto symbols_opt = elf.symbols(&shdr);
+        auto strtab_opt  = elf.getStringTableForSymtab(shdr);
+
+        if (!symbols_opt || !strtab_opt) {
+          consumeError(symbols_opt.takeError());
+          consumeError(strtab_opt.takeError());
+          continue;
+        }
+
+        for (auto &sym : *symbols_opt) {
+          auto base = bases.find(sym.st_shndx);
+
+          // local symbols cannot be referenced by other objects, and weak
+          // definitions may be overridden
+          if (sym.getType() != ELF_STT_FUNC ||
+              sym.getBinding() != ELF_STB_GLOBAL || base == bases.end()) {
+            continue;
+          }
+
+          auto name_opt = sym.getName(*strtab_opt);
+
+          if (!name_opt) {
+            consumeError(name_opt.takeError());
+            continue;
+          }
+
+          functions.push_back(DynamicFunction{name_opt->str(),
+                                              "",
+                                              base->second + sym.st_value});
+          definitions[name_opt->str()]++;
+          anchored.insert(sym.st_shndx);
+        }
+      }
+    }
+
+    for (auto &base : bases) {
+      if (anchored.count(base.first)) {
+        const Shdr &shdr = shdrs[base.first];
+        std::string name = "<unnamed>";
+
+        if (auto sectname_opt = elf.getSectionName(&shdr)) {
+          name = sectname_opt->str();
+        } else {
+          consumeError(sectname_opt.takeError());
+        }
+
+        sections.push_back(
+            Section(member + ":" + name, base.second, shdr.sh_size));
+      }
+    }
+  }
+};
+
+std::unique_ptr<ELFParser> ELFParser::create(const std::string &path) {
+  return parse(path, read(path));
+}
+
+std::vector<char> ELFParser::read(const std::string &path) {
+  std::ifstream f(path, std::ios::binary);
+
+  if (!f.good()) {
+    dbg_fmt("Given file {} does not exist or is invalid", path);
     exit(1);
   }
+
+  // dbg_fmt("Analysing {}\n", path);
+
+  f.seekg(0, std::ios::end);
+
+  size_t size = f.tellg();
+
+  f.seekg(0, std::ios::beg);
+
+  std::vector<char> buf(size);
+
+  f.read(&buf[0], size);
+  f.close();
+
+  return buf;
+}
+
+std::unique_ptr<ELFParser> ELFParser::parse(const std::string &path,
+                                            std::vector<char> &&buf) {
+  size_t size      = buf.size();
+  size_t magicSize = strlen(ArchiveParser::ARCHIVE_MAGIC);
+  if (size >= magicSize &&
+      memcmp(&buf[0], ArchiveParser::ARCHIVE_MAGIC, magicSize) == 0) {
+    return std::unique_ptr<ELFParser>(
+        new ArchiveParser(path, std::move(buf)));
+  }
+
+  if (size <= ELF_EI_CLASS) {
+    dbg_fmt("ELF file error: {}: file too small\n", path);
+    exit(1);
+  }
+
+  switch (buf[ELF_EI_CLASS]) {
+  case ELF_CLASS32:
+    return std::unique_ptr<ELFParser>(
+        new ELFParserImpl<ELF32LE>(path, std::move(buf)));
+  case ELF_CLASS64:
+    return std::unique_ptr<ELFParser>(
+        new ELFParserImpl<ELF64LE>(path, std::move(buf)));
+  default:
+    dbg_fmt("ELF file error: {}: invalid ELF class\n", path);
+    exit(1);
+  }
+}
+
+BinaryAutopsy::BinaryAutopsy(const GlobalConfig        &config,
+                             std::unique_ptr<ELFParser> elf,
+                             const TargetMachine       &target,
+                             MCContext                 &context)
+    : config(config),
+      is64Bit(target.getTargetTriple().getArch() == Triple::x86_64),
+      staticArchive(elf->isStaticArchive()),
+      elf(std::move(elf)) {
+  // linked libraries are only needed to filter the symbols: they are parsed
+  // in the background, while gadgets are extracted from the library
+  std::vector<std::future<std::unique_ptr<ELFParser>>> pendingLibs;
   for (const std::string &libPath : config.linkedLibraries) {
-    otherLibs.emplace_back(new ELFParser(libPath));
+    pendingLibs.push_back(
+        std::async(std::launch::async, &ELFParser::create, libPath));
   }
-  isModuleSymbolAnalysed = false;
 
-  dissect(elf.get());
+  dbg_fmt("[*] Extracting gadgets from: {} SHA1={}\n",
+          this->elf->getPath(),
+          this->elf->getSHA1HashHex());
+
+  dissect(this->elf.get(), target, context);
+
+  for (auto &lib : pendingLibs) {
+    otherLibs.push_back(lib.get());
+  }
   analyseUsedSymbols();
 }
 
 BinaryAutopsy::~BinaryAutopsy() {}
 
-void BinaryAutopsy::dissect(ELFParser *elf) {
+void BinaryAutopsy::dissect(ELFParser           *elf,
+                            const TargetMachine &target,
+                            MCContext           &context) {
   dumpSections(elf, Sections);
   dumpSegments(elf, Segments);
   dumpDynamicSymbols(elf, Symbols, true);
 
   std::vector<std::shared_ptr<Microgadget>> gadgets;
-  dumpGadgets(elf, gadgets);
+  dumpGadgets(elf, target, context, gadgets);
   for (auto gadget : gadgets) {
     addGadget(gadget);
   }
+  // gadgets terminated by a plain ret come first, so that they are preferred
+  for (auto &kv : GadgetPrimitives) {
+    std::stable_sort(kv.second.begin(),
+                     kv.second.end(),
+                     [](const std::shared_ptr<Microgadget> &a,
+                        const std::shared_ptr<Microgadget> &b) {
+                       return a->retSlots < b->retSlots;
+                     });
+  }
   buildXchgGraph();
 }
 
-BinaryAutopsy *BinaryAutopsy::instance = 0;
+bool BinaryAutopsy::Key::operator==(const Key &other) const {
+  return sha1 == other.sha1 && is64Bit == other.is64Bit &&
+         linkedLibraries == other.linkedLibraries &&
+         searchSegmentForGadget == other.searchSegmentForGadget &&
+         avoidMultiversionSymbol == other.avoidMultiversionSymbol;
+}
+
+namespace {
 
-BinaryAutopsy *BinaryAutopsy::getInstance(const GlobalConfig    &config,
-                                          llvm::MachineFunction &MF) {
-  if (instance == nullptr) {
-    instance = new BinaryAutopsy(config,
-                                 *MF.getFunction().getParent(),
-                                 MF.getTarget(),
-                                 MF.getContext());
+// Registry - analyses built by this process, from the most recently used to
+// the least recently used one. An analysis is referenced by the modules using
+// it, besides the registry.
+struct Registry {
+  std::mutex mutex;
+  std::list<std::pair<BinaryAutopsy::Key,
+                      std::shared_ptr<const BinaryAutopsy>>>
+      entries;
+
+  static Registry &get() {
+    static Registry registry;
+    return registry;
   }
 
-  return instance;
+  // prune - deletes the least recently used analyses which are not referenced
+  // by any module, keeping at most maxUnused of them
+  void prune(int maxUnused) {
+    int unused = 0;
+
+    for (auto it = entries.begin(); it != entries.end();) {
+      if (it->second.use_count() == 1 && ++unused > maxUnused) {
+        it = entries.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+};
+
+} // namespace
+
+std::shared_ptr<const BinaryAutopsy>
+BinaryAutopsy::acquire(const GlobalConfig &config, MachineFunction &MF) {
+  // the cached analyses are looked up by the hash of the file: the library
+  // (or each member of a static archive) is parsed only on a miss
+  std::vector<char> buf = ELFParser::read(config.libraryPath);
+  Key               key;
+
+  key.sha1                    = ELFParser::hashHex(
+      llvm::ArrayRef<uint8_t>((const uint8_t *)&buf[0], buf.size()));
+  key.is64Bit                 = MF.getSubtarget<X86Subtarget>().is64Bit();
+  key.linkedLibraries         = config.linkedLibraries;
+  key.searchSegmentForGadget  = config.searchSegmentForGadget;
+  key.avoidMultiversionSymbol = config.avoidMultiversionSymbol;
+
+  if (!config.librarySHA1.empty() && config.librarySHA1 != key.sha1) {
+    dbg_fmt("[!] Error: library SHA1 mismatch: expected={}, actual={}\n",
+            config.librarySHA1,
+            key.sha1);
+    exit(1);
+  }
+
+  Registry                   &registry = Registry::get();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+
+  for (auto it = registry.entries.begin(); it != registry.entries.end();
+       ++it) {
+    if (it->first == key) {
+      dbg_fmt("[*] Reusing the gadgets of: {} SHA1={}\n",
+              config.libraryPath,
+              key.sha1);
+      registry.entries.splice(registry.entries.begin(), registry.entries, it);
+      return it->second;
+    }
+  }
+
+  std::unique_ptr<ELFParser> elf =
+      ELFParser::parse(config.libraryPath, std::move(buf));
+  // gadgets are decoded (and chains are built) for the target architecture.
+  // A cached analysis was checked when it was built, as is64Bit is in the key.
+  if (elf->is64Bit() != key.is64Bit) {
+    dbg_fmt("[!] Error: library {} is not a {}-bit ELF file\n",
+            elf->getPath(),
+            key.is64Bit ? 64 : 32);
+    exit(1);
+  }
+
+  // the lock is held while the library is analysed: the modules waiting for
+  // the same analysis do not build it twice
+  std::shared_ptr<const BinaryAutopsy> analysis(
+      new BinaryAutopsy(config,
+                        std::move(elf),
+                        MF.getTarget(),
+                        MF.getContext()));
+  registry.entries.emplace_front(key, analysis);
+  registry.prune(config.analysisCacheSize);
+
+  return analysis;
+}
+
+void BinaryAutopsy::release(std::shared_ptr<const BinaryAutopsy> &analysis,
+                            const GlobalConfig                   &config) {
+  Registry                   &registry = Registry::get();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+
+  analysis.reset();
+  registry.prune(config.analysisCacheSize);
 }
 
 void BinaryAutopsy::dumpSegments(const ELFParser      *elf,
                                  std::vector<Section> &segments) const {
   for (auto &seg : elf->getCodeSegments()) {
-    segments.push_back(
-        Section("<unnamed-segment>", seg.p_offset, seg.p_filesz));
+    segments.push_back(seg);
   }
 }
 
@@ -365,12 +906,10 @@ void BinaryAutopsy::dumpSections(const ELFParser      *elf,
                   dbg_fmt("[SECTIONS]\tLooking for CODE sections... \n"));
   // Iterates through only the sections that contain executable code
   for (auto &section : elf->getCodeSections()) {
-    std::string sectname = elf->getSectionName(section);
-
-    sections.push_back(Section(sectname, section.sh_addr, section.sh_size));
+    sections.push_back(section);
 
     DEBUG_WITH_TYPE(SECTIONS,
-                    dbg_fmt("[SECTIONS]\tFound section {}\n", sectname));
+                    dbg_fmt("[SECTIONS]\tFound section {}\n", section.Label));
   }
 }
 
@@ -378,43 +917,28 @@ void BinaryAutopsy::dumpDynamicSymbols(const ELFParser     *elf,
                                        std::vector<Symbol> &Symbols,
                                        bool                 safeOnly) const {
   // dbg_fmt("[*] Scanning for symbols... \n");
-  auto                  symbols = elf->getDynamicSymbols();
   std::set<std::string> symbolNames;
 
-  // Scan for all the symbols
-  for (size_t i = 0; i < symbols.size(); i++) {
-    const ELF32LE::Sym &sym = symbols[i];
-
-    // Consider only function symbols with global scope
-    if (elf->isGlobalOrWeakFunction(sym) && sym.isDefined()) {
-      auto name_opt = elf->getSymbolName(sym);
-
-      if (!name_opt) {
-        continue;
+  // Scan for all the function symbols with global scope
+  for (auto &function : elf->getDynamicFunctions()) {
+    const std::string &symbolName = function.name;
+
+    // we cannot use multiple versions of the same symbol,
+    // so we detect duplicate.
+    // (the version string is kept to avoid symbol aliasing)
+    if (symbolNames.find(symbolName) == symbolNames.end()) {
+      symbolNames.insert(symbolName);
+      Symbol sym(symbolName, function.version, function.address);
+      if (!safeOnly || isSafeSymbol(sym)) {
+        Symbols.emplace_back(sym);
       }
-
-      std::string symbolName = name_opt->str();
-      uint64_t    addr       = sym.getValue();
-
-      // Get version string to avoid symbol aliasing
-      std::string versionString = elf->getSymbolVersion(i);
-
-      // we cannot use multiple versions of the same symbol,
-      // so we detect duplicate.
-      if (symbolNames.find(symbolName) == symbolNames.end()) {
-        symbolNames.insert(symbolName);
-        Symbol sym(symbolName, versionString, addr);
-        if (!safeOnly || isSafeSymbol(sym)) {
-          Symbols.emplace_back(sym);
-        }
-      } else {
-        // multi-versioned symbol
-        if (safeOnly && config.avoidMultiversionSymbol) {
-          for (auto it = Symbols.begin(); it != Symbols.end(); ++it) {
-            if (it->Label == symbolName) {
-              Symbols.erase(it);
-              break;
-            }
+    } else {
+      // multi-versioned symbol
+      if (safeOnly && config.avoidMultiversionSymbol) {
+        for (auto it = Symbols.begin(); it != Symbols.end(); ++it) {
+          if (it->Label == symbolName) {
+            Symbols.erase(it);
+            break;
           }
         }
       }
@@ -439,17 +963,8 @@ bool BinaryAutopsy::isSafeSymbol(const Symbol &symbol) const {
 }
 
 void BinaryAutopsy::analyseUsedSymbols() {
-  isModuleSymbolAnalysed = true;
   std::set<std::string> names;
 
-  for (const auto &f : module.getFunctionList()) {
-    names.insert(f.getName().str());
-  }
-
-  for (const auto &g : module.getGlobalList()) {
-    names.insert(g.getName().str());
-  }
-
   for (auto &lib : otherLibs) {
     std::vector<Symbol> symbols;
     dumpDynamicSymbols(lib.get(), symbols, false);
@@ -467,10 +982,32 @@ void BinaryAutopsy::analyseUsedSymbols() {
   }
 }
 
-const Symbol *BinaryAutopsy::getRandomSymbol() const {
-  uint32_t index = math::Random::range32(0, Symbols.size() - 1);
+std::vector<const Symbol *>
+BinaryAutopsy::getModuleSymbols(const Module &module) const {
+  std::set<std::string>       names;
+  std::vector<const Symbol *> result;
+
+  // when the archive is linked statically, the names only declared by the
+  // module resolve to the definitions of the archive
+  for (const auto &f : module.getFunctionList()) {
+    if (!staticArchive || !f.isDeclaration()) {
+      names.insert(f.getName().str());
+    }
+  }
+
+  for (const auto &g : module.getGlobalList()) {
+    if (!staticArchive || !g.isDeclaration()) {
+      names.insert(g.getName().str());
+    }
+  }
+
+  for (const Symbol &sym : Symbols) {
+    if (names.find(sym.Label) == names.end()) {
+      result.push_back(&sym);
+    }
+  }
 
-  return &Symbols[index];
+  return result;
 }
 
 extern "C" void LLVMInitializeX86Disassembler();
@@ -547,6 +1084,8 @@ public:
 
 void BinaryAutopsy::dumpGadgets(
     const ELFParser                           *elf,
+    const TargetMachine                       &target,
+    MCContext                                 &context,
     std::vector<std::shared_ptr<Microgadget>> &gadgets) const {
   DisassemblerHelper disasm(target, context, *elf);
 
@@ -555,79 +1094,84 @@ void BinaryAutopsy::dumpGadgets(
 
   const uint8_t *buf = elf->base();
 
+  // opcodes of RET, RET imm16 and JMP REG in the target mode
+  unsigned int retOpcode    = is64Bit ? X86::RETQ : X86::RETL;
+  unsigned int retImmOpcode = is64Bit ? X86::RETIQ : X86::RETIL;
+  unsigned int jmpOpcode    = is64Bit ? X86::JMP64r : X86::JMP32r;
+  unsigned int wordSize     = is64Bit ? 8 : 4;
+
   for (auto &s : (config.searchSegmentForGadget ? Segments : Sections)) {
     int cnt = 0;
 
-    // Scan for RET instructions
-    for (uint64_t i = s.Address; i < (uint64_t)(s.Address + s.Length); i++) {
+    // Scan for RET and RET imm16 instructions
+    uint64_t end = s.Address + s.Length;
+    for (uint64_t i = s.Address; i < end; i++) {
+      int            retSize;
+      unsigned short retSlots = 0;
+
       if (buf[i] == (uint8_t)0xc3) { // ret
-        size_t         offset  = i + 1;
-        const uint8_t *cur_pos = buf + offset;
+        retSize = 1;
+      } else if (buf[i] == (uint8_t)0xc2 && i + 2 < end) { // ret imm16
+        unsigned int imm = buf[i + 1] | (buf[i + 2] << 8);
+        // the released bytes must be whole stack slots
+        if (imm == 0 || imm % wordSize || imm / wordSize > MAX_RET_SLOTS) {
+          continue;
+        }
+        retSize  = 3;
+        retSlots = imm / wordSize;
+      } else {
+        continue;
+      }
 
-        // Iteratively try to decode starting from MAXDEPTH to 1
-        // bytes before the actual RET
-        for (int depth = MAXDEPTH; depth > 0; depth--) {
+      size_t         offset  = i + retSize;
+      const uint8_t *cur_pos = buf + offset;
 
-          // ignore repeat prefix
-          uint8_t firstbyte = *(cur_pos - depth);
-          if (firstbyte == 0xf2 || firstbyte == 0xf3) {
-            continue;
-          }
+      // Iteratively try to decode starting from MAXDEPTH to 1
+      // bytes before the actual RET (imm16 not counted)
+      for (int depth = MAXDEPTH + retSize - 1; depth >= retSize; depth--) {
 
-          uint64_t addr = offset - depth;
-
-          MCInst instructions[2];
-          size_t count = 2;
-          size_t size  = depth;
-          disasm.disassemble(addr, size, instructions, count);
-
-          // Valid gadgets must have two instructions, and the
-          // last one must be a RET
-          if (count == 2 && instructions[1].getOpcode() == X86::RETL &&
-              // exclude PREFIX RET
-              instructions[0].getOpcode() != X86::DATA16_PREFIX &&
-              instructions[0].getOpcode() != X86::LOCK_PREFIX &&
-              instructions[0].getOpcode() != X86::REP_PREFIX &&
-              instructions[0].getOpcode() != X86::REPNE_PREFIX) {
-            // Each gadget is identified with its mnemonic
-            // and operators (ugly but straightforward :P)
-            std::string asm_instr = disasm.formatInstr(instructions[0]);
-
-            auto it = gadgetMap.find(asm_instr);
-            if (it != gadgetMap.end()) {
-              it->second->addresses.push_back(addr);
-            } else {
-              std::shared_ptr<Microgadget> gadget(
-                  new Microgadget(instructions, count, addr, asm_instr));
-              gadgets.push_back(gadget);
-              gadgetMap.emplace(asm_instr, gadget);
-
-              cnt++;
-            }
-          }
+        // ignore repeat prefix
+        uint8_t firstbyte = *(cur_pos - depth);
+        if (firstbyte == 0xf2 || firstbyte == 0xf3) {
+          continue;
         }
-      }
-    }
 
-    // scan for indirect jmp instructions
-    for (uint64_t addr = s.Address; addr < (uint64_t)(s.Address + s.Length) - 1;
-         addr++) {
+        uint64_t addr = offset - depth;
 
-      if (buf[addr] == 0xff && buf[addr + 1] >= 0xe0 && buf[addr + 1] < 0xe8) {
-        MCInst inst;
-        size_t count = 1;
-        size_t size  = 2;
-        disasm.disassemble(addr, size, &inst, count);
-        // Valid gadgets must have just one instruction of JMP register
-        if (count == 1 && inst.getOpcode() == X86::JMP32r) {
-          std::string asm_instr = disasm.formatInstr(inst);
+        // the gadget bytes must be left untouched by the static linker
+        if (!elf->isFixedRange(addr, offset)) {
+          continue;
+        }
+
+        MCInst instructions[2];
+        size_t count = 2;
+        size_t size  = depth;
+        disasm.disassemble(addr, size, instructions, count);
+
+        // Valid gadgets must have two instructions, and the
+        // last one must be a RET
+        if (count == 2 &&
+            instructions[1].getOpcode() ==
+                (retSlots ? retImmOpcode : retOpcode) &&
+            // exclude PREFIX RET
+            instructions[0].getOpcode() != X86::DATA16_PREFIX &&
+            instructions[0].getOpcode() != X86::LOCK_PREFIX &&
+            instructions[0].getOpcode() != X86::REP_PREFIX &&
+            instructions[0].getOpcode() != X86::REPNE_PREFIX) {
+          // Each gadget is identified with its mnemonic
+          // and operators (ugly but straightforward :P)
+          std::string asm_instr = disasm.formatInstr(instructions[0]);
+          if (retSlots) {
+            asm_instr += fmt::format("; ret {}", retSlots * wordSize);
+          }
 
           auto it = gadgetMap.find(asm_instr);
           if (it != gadgetMap.end()) {
             it->second->addresses.push_back(addr);
           } else {
             std::shared_ptr<Microgadget> gadget(
-                new Microgadget(&inst, 1, addr, asm_instr));
+                new Microgadget(instructions, count, addr, asm_instr));
+            gadget->retSlots = retSlots;
             gadgets.push_back(gadget);
             gadgetMap.emplace(asm_instr, gadget);
 
@@ -636,26 +1180,74 @@ void BinaryAutopsy::dumpGadgets(
         }
       }
     }
+
+    // scan for indirect jmp instructions
+    auto addJmpGadget = [&](uint64_t addr, size_t size) {
+      if (!elf->isFixedRange(addr, addr + size)) {
+        return;
+      }
+
+      MCInst inst;
+      size_t count = 1;
+      disasm.disassemble(addr, size, &inst, count);
+      // Valid gadgets must have just one instruction of JMP register
+      if (count == 1 && inst.getOpcode() == jmpOpcode) {
+        std::string asm_instr = disasm.formatInstr(inst);
+
+        auto it = gadgetMap.find(asm_instr);
+        if (it != gadgetMap.end()) {
+          it->second->addresses.push_back(addr);
+        } else {
+          std::shared_ptr<Microgadget> gadget(
+              new Microgadget(&inst, 1, addr, asm_instr));
+          gadgets.push_back(gadget);
+          gadgetMap.emplace(asm_instr, gadget);
+
+          cnt++;
+        }
+      }
+    };
+
+    for (uint64_t addr = s.Address; addr < (uint64_t)(s.Address + s.Length) - 1;
+         addr++) {
+
+      if (buf[addr] == 0xff && buf[addr + 1] >= 0xe0 && buf[addr + 1] < 0xe8) {
+        addJmpGadget(addr, 2);
+
+        // on x86-64, jmp r8-r15 have a REX.B prefix
+        if (is64Bit && addr > s.Address && buf[addr - 1] == 0x41) {
+          addJmpGadget(addr - 1, 3);
+        }
+      }
+    }
     // dbg_fmt("{} found!\n", cnt);
   }
 }
 
-const Microgadget *BinaryAutopsy::findGadget(GadgetType   type,
-                                             unsigned int reg1,
-                                             unsigned int reg2) const {
+const Microgadget *BinaryAutopsy::findGadget(
+    GadgetType                           type,
+    unsigned int                         reg1,
+    unsigned int                         reg2,
+    const std::set<const Microgadget *> *excluded) const {
   auto it = GadgetPrimitives.find(GadgetType::XCHG);
 
   if (it == GadgetPrimitives.end() || it->second.empty()) {
     return nullptr;
   }
 
+  const Microgadget *found = nullptr;
   for (auto &g : it->second) {
     if (g->reg1 == reg1 && g->reg2 == reg2) {
-      return g.get();
+      if (!excluded || !excluded->count(g.get())) {
+        return g.get();
+      }
+      if (!found) {
+        found = g.get();
+      }
     }
   }
 
-  return nullptr;
+  return found;
 }
 
 void BinaryAutopsy::buildXchgGraph() {
@@ -696,7 +1288,8 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
   // stack pointer using just microgadgets.
   for (unsigned int i = 0; i < inst.getNumOperands(); i++) {
     const auto &operand = inst.getOperand(i);
-    if (operand.isReg() && operand.getReg() == X86::ESP) {
+    if (operand.isReg() &&
+        (operand.getReg() == X86::ESP || operand.getReg() == X86::RSP)) {
       espUsed = true;
     }
   }
@@ -704,10 +1297,41 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
     return;
   }
 
+  // with "ret imm16", xchg gadgets would no longer cancel each other, and
+  // jumps would leave the released slots to the jump target
+  if (gadget->retSlots) {
+    switch (inst.getOpcode()) {
+    case X86::XCHG32ar:
+    case X86::XCHG64ar:
+    case X86::XCHG32rr:
+    case X86::XCHG64rr:
+    case X86::PUSH32r:
+    case X86::PUSH32rmr:
+    case X86::JMP32r:
+    case X86::PUSH64r:
+    case X86::PUSH64rmr:
+    case X86::JMP64r: return;
+    default: break;
+    }
+  }
+
+  // on x86-64, 32-bit operations zero the upper half of the destination:
+  // only gadgets operating on 64-bit registers are usable.
+  if (is64Bit) {
+    for (unsigned int i = 0; i < inst.getNumOperands(); i++) {
+      const auto &operand = inst.getOperand(i);
+      if (operand.isReg() && X86::GR32RegClass.contains(operand.getReg())) {
+        return;
+      }
+    }
+  }
+
   switch (inst.getOpcode()) {
   // pop REG: init
   case X86::POP32r:
-  case X86::POP32rmr: {
+  case X86::POP32rmr:
+  case X86::POP64r:
+  case X86::POP64rmr: {
     gadget->reg1 = inst.getOperand(0).getReg();
     gadget->reg2 = X86::NoRegister;
     gadget->Type = GadgetType::MOV;
@@ -715,7 +1339,8 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
     break;
   }
   // add REG1, REG2: add
-  case X86::ADD32rr: {
+  case X86::ADD32rr:
+  case X86::ADD64rr: {
     gadget->reg1 = inst.getOperand(1).getReg();
     gadget->reg2 = inst.getOperand(2).getReg();
     if (gadget->reg1 != gadget->reg2) {
@@ -728,7 +1353,8 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
     break;
   }
   // sub REG1, REG2: sub
-  case X86::SUB32rr: {
+  case X86::SUB32rr:
+  case X86::SUB64rr: {
     gadget->reg1 = inst.getOperand(1).getReg();
     gadget->reg2 = inst.getOperand(2).getReg();
     if (gadget->reg1 != gadget->reg2) {
@@ -741,7 +1367,8 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
     break;
   }
   // and REG1, REG2: and
-  case X86::AND32rr: {
+  case X86::AND32rr:
+  case X86::AND64rr: {
     gadget->reg1 = inst.getOperand(1).getReg();
     gadget->reg2 = inst.getOperand(2).getReg();
     if (gadget->reg1 != gadget->reg2) {
@@ -754,7 +1381,8 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
     break;
   }
   // xor REG1, REG2: xor_1, xor_2
-  case X86::XOR32rr: {
+  case X86::XOR32rr:
+  case X86::XOR64rr: {
     gadget->reg1 = inst.getOperand(1).getReg();
     gadget->reg2 = inst.getOperand(2).getReg();
     if (gadget->reg1 != gadget->reg2) {
@@ -766,8 +1394,35 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
     }
     break;
   }
+  // imul REG1, REG2: imul
+  case X86::IMUL32rr:
+  case X86::IMUL64rr: {
+    gadget->reg1 = inst.getOperand(1).getReg();
+    gadget->reg2 = inst.getOperand(2).getReg();
+    if (gadget->reg1 != gadget->reg2) {
+      gadget->Type = GadgetType::IMUL;
+      GadgetPrimitives[GadgetType::IMUL].push_back(gadget);
+    }
+    break;
+  }
+  // mul REG2: mul (eax = eax * REG2, clobbers edx)
+  // "mul edx" is skipped: the factor would be clobbered, and restored from
+  // edx by the exchanges moving it there
+  case X86::MUL32r:
+  case X86::MUL64r: {
+    bool     is64 = inst.getOpcode() == X86::MUL64r;
+    unsigned high = is64 ? X86::RDX : X86::EDX;
+    gadget->reg1  = is64 ? X86::RAX : X86::EAX;
+    gadget->reg2  = inst.getOperand(0).getReg();
+    if (gadget->reg1 != gadget->reg2 && gadget->reg2 != high) {
+      gadget->Type = GadgetType::MUL;
+      GadgetPrimitives[GadgetType::MUL].push_back(gadget);
+    }
+    break;
+  }
   // mov REG1, REG2: copy
-  case X86::MOV32rr: {
+  case X86::MOV32rr:
+  case X86::MOV64rr: {
     gadget->reg1 = inst.getOperand(0).getReg();
     gadget->reg2 = inst.getOperand(1).getReg();
     if (gadget->reg1 != gadget->reg2) {
@@ -777,7 +1432,8 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
     break;
   }
   // mov REG, MEM: load
-  case X86::MOV32rm: {
+  case X86::MOV32rm:
+  case X86::MOV64rm: {
     // mov reg0, reg5:[reg1 + imm_scale2 * reg3 + imm_disp4]
     bool hasScaleReg = inst.getOperand(3).isReg() &&
                        inst.getOperand(3).getReg() != X86::NoRegister;
@@ -800,7 +1456,8 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
     break;
   }
   // mov MEM, REG: store
-  case X86::MOV32mr: {
+  case X86::MOV32mr:
+  case X86::MOV64mr: {
     // mov reg4:[reg0 + imm_scale1 * reg2 + imm_disp3], reg5
     bool hasScaleReg = inst.getOperand(2).isReg() &&
                        inst.getOperand(2).getReg() != X86::NoRegister;
@@ -821,8 +1478,9 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
     break;
   }
   // xchg eax, REG2: xchg
-  case X86::XCHG32ar: {
-    gadget->reg1 = X86::EAX;
+  case X86::XCHG32ar:
+  case X86::XCHG64ar: {
+    gadget->reg1 = inst.getOpcode() == X86::XCHG64ar ? X86::RAX : X86::EAX;
     gadget->reg2 = inst.getOperand(1).getReg();
     if (gadget->reg1 != gadget->reg2) {
       gadget->Type = GadgetType::XCHG;
@@ -831,7 +1489,8 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
     break;
   }
   // xchg REG1, REG2: xchg
-  case X86::XCHG32rr: {
+  case X86::XCHG32rr:
+  case X86::XCHG64rr: {
     gadget->reg1 = inst.getOperand(0).getReg();
     gadget->reg2 = inst.getOperand(1).getReg();
     if (gadget->reg1 != gadget->reg2) {
@@ -841,7 +1500,8 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
     break;
   }
 #if LLVM_VERSION_MAJOR >= 9
-  case X86::CMOV32rr: {
+  case X86::CMOV32rr:
+  case X86::CMOV64rr: {
     gadget->reg1       = inst.getOperand(1).getReg();
     gadget->reg2       = inst.getOperand(2).getReg();
     X86::CondCode cond = (X86::CondCode)inst.getOperand(3).getImm();
@@ -859,7 +1519,8 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
   }
 #else
   // cmove REG1, REG2: cmove
-  case X86::CMOVE32rr: {
+  case X86::CMOVE32rr:
+  case X86::CMOVE64rr: {
     gadget->reg1 = inst.getOperand(1).getReg();
     gadget->reg2 = inst.getOperand(2).getReg();
     if (gadget->reg1 != gadget->reg2) {
@@ -869,7 +1530,8 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
     break;
   }
   // cmovb REG1, REG2: cmovb
-  case X86::CMOVB32rr: {
+  case X86::CMOVB32rr:
+  case X86::CMOVB64rr: {
     gadget->reg1 = inst.getOperand(1).getReg();
     gadget->reg2 = inst.getOperand(2).getReg();
     if (gadget->reg1 != gadget->reg2) {
@@ -883,7 +1545,10 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
   // jmp REG1: jmp
   case X86::PUSH32r:
   case X86::PUSH32rmr:
-  case X86::JMP32r: {
+  case X86::JMP32r:
+  case X86::PUSH64r:
+  case X86::PUSH64rmr:
+  case X86::JMP64r: {
     gadget->reg1 = inst.getOperand(0).getReg();
     gadget->reg2 = X86::NoRegister;
     gadget->Type = GadgetType::JMP;
@@ -897,6 +1562,9 @@ void BinaryAutopsy::addGadget(std::shared_ptr<Microgadget> gadget) {
   }
 }
 
+// XchgState and XchgGraph are indexed by register number
+static_assert(X86::NUM_TARGET_REGS <= N_REGS, "N_REGS is too small");
+
 bool BinaryAutopsy::areExchangeable(unsigned int a, unsigned int b) const {
   int  pred[N_REGS], dist[N_REGS];
   bool visited[N_REGS];
@@ -904,10 +1572,13 @@ bool BinaryAutopsy::areExchangeable(unsigned int a, unsigned int b) const {
   return xgraph.checkPath(a, b, pred, dist, visited);
 }
 
-ROPChain BinaryAutopsy::findGadgetPrimitive(XchgState   &state,
-                                            GadgetType   type,
-                                            unsigned int reg1,
-                                            unsigned int reg2) const {
+ROPChain BinaryAutopsy::findGadgetPrimitive(
+    XchgState                           &state,
+    GadgetType                           type,
+    unsigned int                         reg1,
+    unsigned int                         reg2,
+    bool                                 allowRetSlots,
+    const std::set<const Microgadget *> *excluded) const {
   // Note: everytime we need to operate on reg1 and reg2, we need to check
   // which is the actual register that holds that operand.
   ROPChain           result;
@@ -922,7 +1593,12 @@ ROPChain BinaryAutopsy::findGadgetPrimitive(XchgState   &state,
   const auto &gadgets = it_gadgets->second;
 
   // Attempt #1: find a primitive gadget having the same operands
+  // (preferably with a plain ret, since gadgets are sorted by retSlots)
   for (auto &gadget : gadgets) {
+    if ((!allowRetSlots && gadget->retSlots) ||
+        (excluded && excluded->count(gadget.get()))) {
+      continue;
+    }
     if (gadget->reg1 == getEffectiveReg(state, reg1) &&
         (reg1 == X86::NoRegister ||
          gadget->reg2 == getEffectiveReg(state, reg2))) {
@@ -946,6 +1622,10 @@ ROPChain BinaryAutopsy::findGadgetPrimitive(XchgState   &state,
   // generated.
 
   for (auto &gadget : gadgets) {
+    if ((!allowRetSlots && gadget->retSlots) ||
+        (excluded && excluded->count(gadget.get()))) {
+      continue;
+    }
 
     // check if given op0 and op1 are respectively exchangeable with
     // op0 and op1 of the gadget
@@ -962,14 +1642,18 @@ ROPChain BinaryAutopsy::findGadgetPrimitive(XchgState   &state,
              gadget->reg1 == gadget->reg2)) {
           DEBUG_WITH_TYPE(XCHG_CHAIN, dbg_fmt("\t\tavoiding double xchg\n"));
         } else {
-          auto xchgChain1 =
-              exchangeRegs(state, getEffectiveReg(state, reg2), gadget->reg2);
+          auto xchgChain1 = exchangeRegs(state,
+                                         getEffectiveReg(state, reg2),
+                                         gadget->reg2,
+                                         excluded);
           result.append(xchgChain1);
         }
       }
 
-      auto xchgChain0 =
-          exchangeRegs(state, getEffectiveReg(state, reg1), gadget->reg1);
+      auto xchgChain0 = exchangeRegs(state,
+                                     getEffectiveReg(state, reg1),
+                                     gadget->reg1,
+                                     excluded);
       result.append(xchgChain0);
 
       result.emplace_back(ChainElem::fromGadget(gadget.get()));
@@ -980,15 +1664,20 @@ ROPChain BinaryAutopsy::findGadgetPrimitive(XchgState   &state,
   return result;
 }
 
-ROPChain BinaryAutopsy::buildXchgChain(XchgPath const &path) const {
+ROPChain BinaryAutopsy::buildXchgChain(
+    XchgPath const                       &path,
+    const std::set<const Microgadget *> *excluded) const {
   ROPChain result;
 
   for (auto &edge : path) {
     // in XCHG instructions the operands order doesn't matter
-    const auto *found = findGadget(GadgetType::XCHG, edge.first, edge.second);
+    const auto *found =
+        findGadget(GadgetType::XCHG, edge.first, edge.second, excluded);
+    const auto *swapped =
+        findGadget(GadgetType::XCHG, edge.second, edge.first, excluded);
 
-    if (!found) {
-      found = findGadget(GadgetType::XCHG, edge.second, edge.first);
+    if (!found || (excluded && excluded->count(found) && swapped)) {
+      found = swapped;
     }
 
     result.emplace_back(ChainElem::fromGadget(found));
@@ -997,22 +1686,26 @@ ROPChain BinaryAutopsy::buildXchgChain(XchgPath const &path) const {
   return result;
 }
 
-ROPChain BinaryAutopsy::exchangeRegs(XchgState   &state,
-                                     unsigned int reg1,
-                                     unsigned int reg2) const {
+ROPChain BinaryAutopsy::exchangeRegs(
+    XchgState                           &state,
+    unsigned int                         reg1,
+    unsigned int                         reg2,
+    const std::set<const Microgadget *> *excluded) const {
   ROPChain result;
 
   if (reg1 != reg2) {
     XchgPath path = xgraph.getPath(state, reg1, reg2);
-    result        = buildXchgChain(path);
+    result        = buildXchgChain(path, excluded);
   }
 
   return result;
 }
 
-ROPChain BinaryAutopsy::undoXchgs(XchgState &state) const {
+ROPChain
+BinaryAutopsy::undoXchgs(XchgState                           &state,
+                         const std::set<const Microgadget *> *excluded) const {
   XchgPath path = xgraph.reorderRegisters(state);
-  return buildXchgChain(path);
+  return buildXchgChain(path, excluded);
 }
 
 unsigned int BinaryAutopsy::getEffectiveReg(const XchgState &state,
@@ -1020,9 +1713,7 @@ unsigned int BinaryAutopsy::getEffectiveReg(const XchgState &state,
   return state.searchLogicalReg(reg);
 }
 
-void BinaryAutopsy::debugPrintGadgets() const {
-  const auto *regInfo = target.getMCRegisterInfo();
-
+void BinaryAutopsy::debugPrintGadgets(const MCRegisterInfo *regInfo) const {
   for (auto &kv : GadgetPrimitives) {
     dbg_fmt("Gadgets of type {}:\n", (int)kv.first);
     for (auto &g : kv.second) {
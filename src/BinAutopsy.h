@@ -11,6 +11,11 @@
 //      - symbols from the .dynsym section
 //      - microgadgets from executable sections
 //
+// Gadgets can also be extracted from the relocatable objects of a static
+// archive (e.g. libc.a), linked into the program: they are then referenced
+// through the global functions of their sections, resolved by the static
+// linker.
+//
 // Microgadgets are a subset of what are commonly known as ROP Gadgets, with the
 // only difference that we grab only the ones composed by a single instruction
 // before the ret, e.g.:
@@ -36,6 +41,7 @@
 #include "llvm/Target/TargetMachine.h"
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -45,6 +51,10 @@ namespace ropf {
 // see BinaryAutopsy::extractGadgets()
 #define MAXDEPTH 4
 
+// Max stack slots released by a "ret imm16" gadget: the slots are padding in
+// the chain, hence only small adjustments are worth it.
+#define MAX_RET_SLOTS 4
+
 // forward declaration
 class ROPChain;
 class ELFParser;
@@ -52,30 +62,47 @@ class ELFParser;
 // BinaryAutopsy - dumps all the data needed by ROPfuscator.
 // It provides also methods to look for specific gadgets and performs
 // operand exchangeability analyses.
-// This class has been designed as singleton to simplify the interaction with
-// the ROPChain class. Indeed, we don't want to analyse the same file every time
-// that a new ROPChain is instanciated.
+// Analyses do not depend on the module, and are not modified once built: they
+// are kept in a process-wide registry, so that the modules compiled by the same
+// process (e.g., with LTO) share the analysis of the same library (see
+// acquire()).
 class BinaryAutopsy {
+public:
+  // Key - identifies an analysis: the contents of the library and the options
+  // affecting the extraction
+  struct Key {
+    std::string              sha1;
+    bool                     is64Bit;
+    std::vector<std::string> linkedLibraries;
+    bool                     searchSegmentForGadget;
+    bool                     avoidMultiversionSymbol;
+
+    bool operator==(const Key &other) const;
+  };
+
 private:
-  // Singleton
-  static BinaryAutopsy *instance;
   BinaryAutopsy(const GlobalConfig        &config,
-                const llvm::Module        &module,
+                std::unique_ptr<ELFParser> elf,
                 const llvm::TargetMachine &target,
                 llvm::MCContext           &context);
   BinaryAutopsy()                      = delete;
   BinaryAutopsy(const BinaryAutopsy &) = delete;
-  ~BinaryAutopsy();
 
-  const llvm::Module        &module;
-  const llvm::TargetMachine &target;
-  llvm::MCContext           &context;
-  const GlobalConfig        &config;
+  const GlobalConfig config;
+  // is64Bit - true if gadgets are extracted for x86-64 (from an ELF64 library)
+  const bool         is64Bit;
 
 public:
+  ~BinaryAutopsy();
+
   // XchgGraph instance
   XchgGraph xgraph;
 
+  // staticArchive - true if the library is a static archive. The linker places
+  // each section of its members independently: a gadget must be referenced
+  // through a symbol of the same section.
+  const bool staticArchive;
+
   // Symbols - results from dumpDynamicSymbols() are placed here
   std::vector<Symbol> Symbols;
 
@@ -95,11 +122,17 @@ public:
   // otherlibs - handles to other ELF libraries.
   std::vector<std::unique_ptr<ELFParser>> otherLibs;
 
-  bool isModuleSymbolAnalysed;
+  // acquire - returns the analysis of the library of the configuration for
+  // the target of MF, building it if the registry has no analysis with the
+  // same key.
+  static std::shared_ptr<const BinaryAutopsy>
+  acquire(const GlobalConfig &config, llvm::MachineFunction &MF);
 
-  // getInstance - returns an instance of this singleton class
-  static BinaryAutopsy *getInstance(const GlobalConfig    &config,
-                                    llvm::MachineFunction &MF);
+  // release - drops a reference to the analysis. The registry keeps at most
+  // config.analysisCacheSize analyses which are no longer referenced, deleting
+  // the least recently used ones.
+  static void release(std::shared_ptr<const BinaryAutopsy> &analysis,
+                      const GlobalConfig                   &config);
 
   // -----------------------------------------------------------------------------
   //  ANALYSES
@@ -107,7 +140,9 @@ public:
 
 private:
   // dissect - dumps all the data and performs every analysis.
-  void dissect(ELFParser *);
+  void dissect(ELFParser                 *elf,
+               const llvm::TargetMachine &target,
+               llvm::MCContext           &context);
 
   // dumpSections - parses the ELF header to obtain a list of
   // sections that contain executable code, from which the symbol and gadget
@@ -130,8 +165,10 @@ private:
   // dumpGadgets - extracts every microgadget (i.e., single instructions
   // before a RET) that can be found in executable sections. Each instruction is
   // decoded with LLVM disassembler engine.
-  void dumpGadgets(const ELFParser *,
-                   std::vector<std::shared_ptr<Microgadget>> &) const;
+  void dumpGadgets(const ELFParser                           *elf,
+                   const llvm::TargetMachine                 &target,
+                   llvm::MCContext                           &context,
+                   std::vector<std::shared_ptr<Microgadget>> &gadgets) const;
 
   // buildXchgGraph - creates a new instance of xgraph and feeds it with all the
   // XCHG gadgets that have been found.
@@ -140,8 +177,8 @@ private:
   // register gadget in GadgetPrimitives with some filters.
   void addGadget(std::shared_ptr<Microgadget> gadget);
 
-  // analyseUsedSymbols - traverse the module and register the symbol names
-  // with forbidden list
+  // analyseUsedSymbols - removes the symbols whose names are defined by the
+  // linked libraries too
   void analyseUsedSymbols();
 
 public:
@@ -149,23 +186,37 @@ public:
   //  HELPER METHODS
   // -----------------------------------------------------------------------------
 
-  // getRandomSymbol - returns a random symbol. This is used to reference each
-  // gadget in the ROP chain as sum of a random symbol address and the gadget
+  // getModuleSymbols - returns the symbols which can be used by the module,
+  // i.e., the ones whose names are not used (defined, for static archives) by
+  // the module. Each gadget in the
+  // ROP chain is referenced as sum of a random symbol address and the gadget
   // offset from it.
-  const Symbol *getRandomSymbol() const;
+  std::vector<const Symbol *>
+  getModuleSymbols(const llvm::Module &module) const;
 
   // findGadget - set of overloaded methods to look for a specific gadget in
-  // the set of the ones that have been previously discovered.
+  // the set of the ones that have been previously discovered. The excluded
+  // gadgets (e.g., the ones which the module cannot reference, see
+  // ROPEngine) are picked only if no other gadget matches.
   // const Microgadget *findGadget(std::string asmInstr) const;
 
-  const Microgadget *findGadget(GadgetType   type,
-                                unsigned int op0,
-                                unsigned int op1 = llvm::X86::NoRegister) const;
-
-  ROPChain findGadgetPrimitive(XchgState   &state,
-                               GadgetType   type,
-                               unsigned int reg1,
-                               unsigned int reg2 = llvm::X86::NoRegister) const;
+  const Microgadget *
+  findGadget(GadgetType                           type,
+             unsigned int                         op0,
+             unsigned int                         op1 = llvm::X86::NoRegister,
+             const std::set<const Microgadget *> *excluded = nullptr) const;
+
+  // findGadgetPrimitive - returns the chain implementing the primitive, using
+  // exchanges if needed. Gadgets terminated by "ret imm16" are used only if
+  // allowRetSlots (their slots must then be placed, see ROPChainBuilder).
+  // The excluded gadgets are never used for the primitive itself.
+  ROPChain findGadgetPrimitive(
+      XchgState                           &state,
+      GadgetType                           type,
+      unsigned int                         reg1,
+      unsigned int                         reg2 = llvm::X86::NoRegister,
+      bool                                 allowRetSlots = true,
+      const std::set<const Microgadget *> *excluded      = nullptr) const;
 
   // areExchangeable - uses XChgGraph to check whether two (or more
   // registers) can be mutually exchanged.
@@ -173,19 +224,25 @@ public:
 
   // getXchgPath - returns a vector of XCHG gadgets in order to exchange the
   // given two registers.
-  ROPChain
-  exchangeRegs(XchgState &state, unsigned int reg1, unsigned int reg2) const;
+  ROPChain exchangeRegs(
+      XchgState                           &state,
+      unsigned int                         reg1,
+      unsigned int                         reg2,
+      const std::set<const Microgadget *> *excluded = nullptr) const;
 
-  ROPChain undoXchgs(XchgState &state) const;
+  ROPChain
+  undoXchgs(XchgState                           &state,
+            const std::set<const Microgadget *> *excluded = nullptr) const;
 
   unsigned int getEffectiveReg(const XchgState &state, unsigned int reg) const;
 
-  void debugPrintGadgets() const;
+  void debugPrintGadgets(const llvm::MCRegisterInfo *regInfo) const;
 
 private:
   // Takes a path from the XchgGraph and build a ROP Chains with the right
   // Xchg microgadgets
-  ROPChain buildXchgChain(XchgPath const &path) const;
+  ROPChain buildXchgChain(XchgPath const                       &path,
+                          const std::set<const Microgadget *> *excluded) const;
 };
 
 } // namespace ropf
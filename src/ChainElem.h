@@ -18,7 +18,8 @@ struct ChainElem {
     JMP_BLOCK,
     JMP_FALLTHROUGH,
     ESP_PUSH,
-    ESP_OFFSET
+    ESP_OFFSET,
+    PADDING
   };
 
   // type - it can be a GADGET or an IMMEDIATE value. We need to specify the
@@ -90,13 +91,13 @@ struct ChainElem {
     return e;
   }
 
-  // Factory method (type: ESP_PUSH)
-  static ChainElem createStackPointerPush() {
-    static int esp_id = 0;
-    ChainElem  e;
+  // Factory method (type: ESP_PUSH). esp_id must be unique among the chains
+  // which may be merged.
+  static ChainElem createStackPointerPush(int esp_id) {
+    ChainElem e;
 
     e.type   = Type::ESP_PUSH;
-    e.esp_id = ++esp_id;
+    e.esp_id = esp_id;
 
     return e;
   }
@@ -112,6 +113,16 @@ struct ChainElem {
     return e;
   }
 
+  // Factory method (type: PADDING)
+  // Slot skipped by a "ret imm16" gadget: its value is never read.
+  static ChainElem createPadding() {
+    ChainElem e;
+
+    e.type = Type::PADDING;
+
+    return e;
+  }
+
   friend bool operator==(ChainElem const &A, ChainElem const &B) {
     if (A.type != B.type) {
       return false;
@@ -125,6 +136,7 @@ struct ChainElem {
     case Type::JMP_FALLTHROUGH: return true;
     case Type::ESP_PUSH: return A.esp_id == B.esp_id;
     case Type::ESP_OFFSET: return A.esp_id == B.esp_id && A.value == B.value;
+    case Type::PADDING: return true;
     }
     return false;
   }
@@ -151,6 +163,7 @@ struct ChainElem {
     case Type::ESP_OFFSET:
       fmt::print(os, "ESP_OFFSET\t:{}, id={}\n", value, esp_id);
       break;
+    case Type::PADDING: fmt::print(os, "PADDING\n"); break;
     }
   }
 };
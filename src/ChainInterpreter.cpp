@@ -0,0 +1,732 @@
+// ==============================================================================
+//   CHAIN INTERPRETER
+//   part of the ROPfuscator project
+// ==============================================================================
+
+#include "ChainInterpreter.h"
+#include "ChainElem.h"
+#include "Debug.h"
+#include "Microgadget.h"
+#include "ROPEngine.h"
+#include "X86.h"
+#include "X86InstrInfo.h"
+#include "X86TargetMachine.h"
+#include "llvm/CodeGen/MachineInstr.h"
+#include <algorithm>
+
+using namespace llvm;
+
+namespace ropf {
+
+namespace {
+
+// registers modelled by the abstract machine (ESP is handled separately)
+const unsigned int GENERAL_PURPOSE_REGS[] = {
+    X86::EAX,
+    X86::EBX,
+    X86::ECX,
+    X86::EDX,
+    X86::ESI,
+    X86::EDI,
+    X86::EBP,
+};
+
+// base addresses of the link-time value tokens
+const uint32_t GLOBAL_TOKEN_BASE = 0x40000000;
+const uint32_t BLOCK_TOKEN_BASE  = 0xb0000000;
+const uint32_t GADGET_TOKEN_BASE = 0xc0000000;
+
+// fixed seed, so that the interpreter does not perturb the obfuscation RNG
+const unsigned int INTERPRETER_SEED = 0x5eed;
+
+// memory that has never been written contains a value which only depends on
+// its address, so that independent executions observe the same memory
+uint32_t initialMemoryValue(uint32_t address) {
+  uint32_t x = address * 0x9e3779b9;
+  x ^= x >> 16;
+  x *= 0x85ebca6b;
+  x ^= x >> 13;
+  return x;
+}
+
+#if LLVM_VERSION_MAJOR >= 9
+// evalCondition - evaluates the conditions supported by the chains
+bool evalCondition(int64_t                        cond,
+                   const ChainInterpreter::State &state,
+                   bool                          &holds) {
+  switch (cond) {
+  case X86::COND_E: holds = state.zf; break;
+  case X86::COND_NE: holds = !state.zf; break;
+  case X86::COND_B: holds = state.cf; break;
+  case X86::COND_AE: holds = !state.cf; break;
+  default: return false;
+  }
+  return true;
+}
+#endif
+
+void setArithmeticFlags(ChainInterpreter::State &state,
+                        unsigned int             opcode,
+                        uint32_t                 a,
+                        uint32_t                 b,
+                        uint32_t                 result) {
+  state.zf = result == 0;
+
+  switch (opcode) {
+  case X86::ADD32rr:
+  case X86::ADD32ri:
+  case X86::ADD32ri8:
+  case X86::ADD32rm: state.cf = result < a; break;
+  case X86::SUB32rr:
+  case X86::SUB32ri:
+  case X86::SUB32ri8:
+  case X86::SUB32rm: state.cf = a < b; break;
+  default: state.cf = false; break;
+  }
+}
+
+uint32_t arithmetic(unsigned int opcode, uint32_t a, uint32_t b) {
+  switch (opcode) {
+  case X86::ADD32rr:
+  case X86::ADD32rr_DB:
+  case X86::ADD32ri:
+  case X86::ADD32ri8:
+  case X86::ADD32rm: return a + b;
+  case X86::SUB32rr:
+  case X86::SUB32ri:
+  case X86::SUB32ri8:
+  case X86::SUB32rm: return a - b;
+  case X86::AND32rr:
+  case X86::AND32ri:
+  case X86::AND32ri8:
+  case X86::AND32rm: return a & b;
+  case X86::XOR32rr:
+  case X86::XOR32rm: return a ^ b;
+  }
+  return 0;
+}
+
+} // namespace
+
+ChainInterpreter::ChainInterpreter(unsigned int trials)
+    : trials(trials), rng(INTERPRETER_SEED) {}
+
+uint32_t ChainInterpreter::token(const GlobalValue *global) {
+  auto it = globalTokens.find(global);
+  if (it != globalTokens.end()) {
+    return it->second;
+  }
+
+  // leave enough room for global + offset
+  uint32_t value = GLOBAL_TOKEN_BASE + 0x100000 * globalTokens.size();
+  globalTokens.emplace(global, value);
+  return value;
+}
+
+uint32_t ChainInterpreter::token(const MachineBasicBlock *MBB) {
+  auto it = blockTokens.find(MBB);
+  if (it != blockTokens.end()) {
+    return it->second;
+  }
+
+  uint32_t value = BLOCK_TOKEN_BASE + 0x10 * blockTokens.size();
+  blockTokens.emplace(MBB, value);
+  return value;
+}
+
+uint32_t ChainInterpreter::token(const Microgadget *gadget) {
+  auto it = gadgetTokens.find(gadget);
+  if (it != gadgetTokens.end()) {
+    return it->second;
+  }
+
+  uint32_t value = GADGET_TOKEN_BASE + 0x10 * gadgetTokens.size();
+  gadgetTokens.emplace(gadget, value);
+  gadgetByToken.emplace(value, gadget);
+  return value;
+}
+
+ChainInterpreter::State ChainInterpreter::randomState() {
+  State state;
+
+  for (unsigned int reg : GENERAL_PURPOSE_REGS) {
+    state.regs[reg] = rng();
+  }
+
+  // keep the stack far from the token ranges
+  state.regs[X86::ESP] = 0x7ff00000 - 4 * (rng() % 0x1000);
+  state.zf             = rng() & 1;
+  state.cf             = rng() & 1;
+
+  return state;
+}
+
+uint32_t ChainInterpreter::load(State &state, uint32_t address) const {
+  auto it = state.memory.find(address);
+  if (it != state.memory.end()) {
+    return it->second;
+  }
+
+  return initialMemoryValue(address);
+}
+
+void ChainInterpreter::store(State   &state,
+                             uint32_t address,
+                             uint32_t value) const {
+  state.memory[address] = value;
+  state.written.insert(address);
+}
+
+uint32_t ChainInterpreter::elemValue(const ChainElem &elem) {
+  switch (elem.type) {
+  case ChainElem::Type::GADGET: return token(elem.microgadget);
+  case ChainElem::Type::IMM_VALUE: return elem.value;
+  case ChainElem::Type::IMM_GLOBAL: return token(elem.global) + elem.value;
+  case ChainElem::Type::JMP_BLOCK: return token(elem.jmptarget);
+  case ChainElem::Type::JMP_FALLTHROUGH: return FALLTHROUGH_TOKEN;
+  // stack pointer related values depend on the chain layout,
+  // see executeChain()
+  case ChainElem::Type::ESP_PUSH:
+  case ChainElem::Type::ESP_OFFSET: break;
+  // skipped by "ret imm16": any value
+  case ChainElem::Type::PADDING: return 0xdeadbeef;
+  }
+
+  return 0;
+}
+
+bool ChainInterpreter::operandValue(const MachineOperand &operand,
+                                    uint32_t             &value) {
+  if (operand.isImm()) {
+    value = operand.getImm();
+    return true;
+  }
+
+  // values relative to the PIC base (@GOT, @GOTOFF, ...) are not modelled
+  if (operand.isGlobal() && (operand.getTargetFlags() == X86II::MO_NO_FLAG ||
+                             operand.getTargetFlags() == X86II::MO_PLT)) {
+    value = token(operand.getGlobal()) + operand.getOffset();
+    return true;
+  }
+
+  return false;
+}
+
+bool ChainInterpreter::effectiveAddress(const MachineInstr &MI,
+                                        unsigned int        firstOperand,
+                                        State              &state,
+                                        uint32_t           &address) {
+  // [base + scale * index + disp], segment
+  const MachineOperand &base    = MI.getOperand(firstOperand);
+  const MachineOperand &scale   = MI.getOperand(firstOperand + 1);
+  const MachineOperand &index   = MI.getOperand(firstOperand + 2);
+  const MachineOperand &disp    = MI.getOperand(firstOperand + 3);
+  const MachineOperand &segment = MI.getOperand(firstOperand + 4);
+
+  if (segment.isReg() && segment.getReg() != X86::NoRegister) {
+    return false;
+  }
+
+  if (!operandValue(disp, address)) {
+    return false;
+  }
+
+  if (base.isReg() && base.getReg() != X86::NoRegister) {
+    address += state.regs[base.getReg()];
+  }
+
+  if (index.isReg() && index.getReg() != X86::NoRegister) {
+    address += scale.getImm() * state.regs[index.getReg()];
+  }
+
+  return true;
+}
+
+bool ChainInterpreter::executeGadget(const Microgadget &gadget,
+                                     State             &state,
+                                     uint32_t          &next,
+                                     std::string       &error) {
+  const MCInst &inst = gadget.Instr[0];
+  auto         &regs = state.regs;
+  uint32_t     &esp  = regs[X86::ESP];
+  bool          jump = false;
+
+  switch (inst.getOpcode()) {
+  case X86::POP32r:
+  case X86::POP32rmr:
+    regs[gadget.reg1] = load(state, esp);
+    esp += 4;
+    break;
+  case X86::ADD32rr:
+  case X86::SUB32rr:
+  case X86::AND32rr:
+  case X86::XOR32rr: {
+    uint32_t a = regs[gadget.reg1], b = regs[gadget.reg2];
+
+    regs[gadget.reg1] = arithmetic(inst.getOpcode(), a, b);
+    setArithmeticFlags(state, inst.getOpcode(), a, b, regs[gadget.reg1]);
+    break;
+  }
+  case X86::IMUL32rr: regs[gadget.reg1] *= regs[gadget.reg2]; break;
+  case X86::MUL32r: {
+    uint64_t product = (uint64_t)regs[X86::EAX] * regs[gadget.reg2];
+
+    regs[X86::EAX] = product;
+    regs[X86::EDX] = product >> 32;
+    break;
+  }
+  case X86::MOV32rr: regs[gadget.reg1] = regs[gadget.reg2]; break;
+  case X86::MOV32rm: regs[gadget.reg1] = load(state, regs[gadget.reg2]); break;
+  case X86::MOV32mr: store(state, regs[gadget.reg1], regs[gadget.reg2]); break;
+  case X86::XCHG32ar:
+  case X86::XCHG32rr: std::swap(regs[gadget.reg1], regs[gadget.reg2]); break;
+#if LLVM_VERSION_MAJOR >= 9
+  case X86::CMOV32rr: {
+    bool cond = (X86::CondCode)inst.getOperand(3).getImm() == X86::COND_E
+                    ? state.zf
+                    : state.cf;
+    if (cond) {
+      regs[gadget.reg1] = regs[gadget.reg2];
+    }
+    break;
+  }
+#else
+  case X86::CMOVE32rr:
+    if (state.zf) {
+      regs[gadget.reg1] = regs[gadget.reg2];
+    }
+    break;
+  case X86::CMOVB32rr:
+    if (state.cf) {
+      regs[gadget.reg1] = regs[gadget.reg2];
+    }
+    break;
+#endif
+  // push REG1; ret is equivalent to jmp REG1
+  case X86::PUSH32r:
+  case X86::PUSH32rmr:
+  case X86::JMP32r:
+    next = regs[gadget.reg1];
+    jump = true;
+    break;
+  default:
+    error = fmt::format("unknown gadget semantics: {}", gadget.asmInstr);
+    return false;
+  }
+
+  if (!jump) {
+    // ret (imm16)
+    next = load(state, esp);
+    esp += 4 * (1 + gadget.retSlots);
+  }
+
+  return true;
+}
+
+ChainInterpreter::Execution
+ChainInterpreter::executeChain(const ROPChain &chain, State &state) {
+  Execution              result;
+  std::vector<ChainElem> elems(chain.begin(), chain.end());
+
+  // resume address is pushed by insertROPChain() when the chain does not jump
+  if (!chain.hasUnconditionalJump && !chain.hasConditionalJump) {
+    elems.emplace_back(ChainElem::createJmpFallthrough());
+  }
+
+  uint32_t origESP  = state.regs[X86::ESP];
+  uint32_t chainTop = origESP - 4 * elems.size();
+
+  // lay out the chain on the stack; ESP_PUSH pushes the value of ESP at the
+  // time of the push, and ESP_OFFSET is adjusted accordingly (see
+  // ROPfuscatorCore::insertROPChain()), so that their sum is origESP + offset
+  std::map<int, uint32_t> espValues;
+  for (size_t i = 0; i < elems.size(); i++) {
+    if (elems[i].type == ChainElem::Type::ESP_PUSH) {
+      espValues[elems[i].esp_id] = chainTop + 4 * (i + 1);
+    }
+  }
+
+  for (size_t i = 0; i < elems.size(); i++) {
+    const ChainElem &elem    = elems[i];
+    uint32_t         address = chainTop + 4 * i;
+
+    if (elem.type == ChainElem::Type::ESP_PUSH) {
+      state.memory[address] = espValues[elem.esp_id];
+    } else if (elem.type == ChainElem::Type::ESP_OFFSET) {
+      auto it = espValues.find(elem.esp_id);
+      if (it == espValues.end()) {
+        result.ok    = false;
+        result.error = "ESP_OFFSET without corresponding ESP_PUSH";
+        return result;
+      }
+      state.memory[address] = origESP + elem.value - it->second;
+    } else {
+      state.memory[address] = elemValue(elem);
+    }
+  }
+
+  // the chain is entered through ret
+  uint32_t &esp  = state.regs[X86::ESP];
+  uint32_t  next = load(state, chainTop);
+  esp            = chainTop + 4;
+
+  while (gadgetByToken.count(next)) {
+    if (esp > origESP) {
+      result.ok    = false;
+      result.error = "chain reads beyond its end";
+      return result;
+    }
+
+    if (++result.gadgets > MAX_GADGETS) {
+      result.ok    = false;
+      result.error = "too many gadgets executed";
+      return result;
+    }
+
+    if (!executeGadget(*gadgetByToken[next], state, next, result.error)) {
+      result.ok = false;
+      return result;
+    }
+  }
+
+  result.target = next;
+  return result;
+}
+
+ChainInterpreter::Execution
+ChainInterpreter::executeInstr(const MachineInstr &MI, State &state) {
+  Execution result;
+  auto     &regs   = state.regs;
+  unsigned  opcode = MI.getOpcode();
+  uint32_t  value, address;
+
+  result.target = FALLTHROUGH_TOKEN;
+
+  switch (opcode) {
+  case X86::ADD32ri:
+  case X86::ADD32ri8:
+  case X86::SUB32ri:
+  case X86::SUB32ri8:
+  case X86::AND32ri:
+  case X86::AND32ri8: {
+    if (!operandValue(MI.getOperand(2), value)) {
+      result.supported = false;
+      break;
+    }
+    uint32_t a = regs[MI.getOperand(1).getReg()];
+
+    regs[MI.getOperand(0).getReg()] = arithmetic(opcode, a, value);
+    setArithmeticFlags(state, opcode, a, value, arithmetic(opcode, a, value));
+    result.definesZF = result.definesCF = true;
+    break;
+  }
+  case X86::INC32r:
+  case X86::DEC32r: {
+    // CF is not affected
+    uint32_t a = regs[MI.getOperand(1).getReg()];
+
+    regs[MI.getOperand(0).getReg()] = opcode == X86::INC32r ? a + 1 : a - 1;
+    state.zf         = regs[MI.getOperand(0).getReg()] == 0;
+    result.definesZF = true;
+    break;
+  }
+  case X86::ADD32rr:
+  case X86::ADD32rr_DB:
+  case X86::SUB32rr:
+  case X86::AND32rr:
+  case X86::XOR32rr: {
+    uint32_t a = regs[MI.getOperand(1).getReg()];
+    uint32_t b = regs[MI.getOperand(2).getReg()];
+
+    regs[MI.getOperand(0).getReg()] = arithmetic(opcode, a, b);
+    setArithmeticFlags(state, opcode, a, b, arithmetic(opcode, a, b));
+    result.definesZF = result.definesCF = opcode != X86::ADD32rr_DB;
+    break;
+  }
+  case X86::ADD32rm:
+  case X86::SUB32rm:
+  case X86::AND32rm:
+  case X86::XOR32rm: {
+    if (!effectiveAddress(MI, 2, state, address)) {
+      result.supported = false;
+      break;
+    }
+    uint32_t a = regs[MI.getOperand(1).getReg()];
+    uint32_t b = load(state, address);
+
+    regs[MI.getOperand(0).getReg()] = arithmetic(opcode, a, b);
+    setArithmeticFlags(state, opcode, a, b, arithmetic(opcode, a, b));
+    result.definesZF = result.definesCF = true;
+    break;
+  }
+  case X86::IMUL32rr:
+  case X86::IMUL32rri:
+  case X86::IMUL32rri8:
+  case X86::IMUL32rm: {
+    // CF and OF are not modelled: the chains require them to be dead
+    if (opcode == X86::IMUL32rr) {
+      value = regs[MI.getOperand(2).getReg()];
+    } else if (opcode == X86::IMUL32rm) {
+      if (!effectiveAddress(MI, 2, state, address)) {
+        result.supported = false;
+        break;
+      }
+      value = load(state, address);
+    } else if (!operandValue(MI.getOperand(2), value)) {
+      result.supported = false;
+      break;
+    }
+    regs[MI.getOperand(0).getReg()] = regs[MI.getOperand(1).getReg()] * value;
+    break;
+  }
+  case X86::LEA32r:
+    if (!effectiveAddress(MI, 1, state, address)) {
+      result.supported = false;
+      break;
+    }
+    regs[MI.getOperand(0).getReg()] = address;
+    break;
+  case X86::MOV32rm:
+    if (!effectiveAddress(MI, 1, state, address)) {
+      result.supported = false;
+      break;
+    }
+    regs[MI.getOperand(0).getReg()] = load(state, address);
+    break;
+  case X86::MOV32mr:
+    if (!effectiveAddress(MI, 0, state, address)) {
+      result.supported = false;
+      break;
+    }
+    store(state, address, regs[MI.getOperand(5).getReg()]);
+    break;
+  case X86::MOV32mi:
+    if (!effectiveAddress(MI, 0, state, address) ||
+        !operandValue(MI.getOperand(5), value)) {
+      result.supported = false;
+      break;
+    }
+    store(state, address, value);
+    break;
+  case X86::MOV32rr:
+    regs[MI.getOperand(0).getReg()] = regs[MI.getOperand(1).getReg()];
+    break;
+  case X86::MOV32ri:
+    if (!operandValue(MI.getOperand(1), value)) {
+      result.supported = false;
+      break;
+    }
+    regs[MI.getOperand(0).getReg()] = value;
+    break;
+  case X86::CMP32rr:
+  case X86::CMP32ri:
+  case X86::CMP32ri8: {
+    uint32_t a = regs[MI.getOperand(0).getReg()], b;
+
+    if (opcode == X86::CMP32rr) {
+      b = regs[MI.getOperand(1).getReg()];
+    } else if (!operandValue(MI.getOperand(1), b)) {
+      result.supported = false;
+      break;
+    }
+    setArithmeticFlags(state, X86::SUB32rr, a, b, a - b);
+    result.definesZF = result.definesCF = true;
+    break;
+  }
+  case X86::CMP32mi:
+  case X86::CMP32mi8: {
+    if (!effectiveAddress(MI, 0, state, address) ||
+        !operandValue(MI.getOperand(5), value)) {
+      result.supported = false;
+      break;
+    }
+    uint32_t a = load(state, address);
+
+    setArithmeticFlags(state, X86::SUB32rr, a, value, a - value);
+    result.definesZF = result.definesCF = true;
+    break;
+  }
+  case X86::CMP32rm: {
+    if (!effectiveAddress(MI, 1, state, address)) {
+      result.supported = false;
+      break;
+    }
+    uint32_t a = regs[MI.getOperand(0).getReg()];
+    uint32_t b = load(state, address);
+
+    setArithmeticFlags(state, X86::SUB32rr, a, b, a - b);
+    result.definesZF = result.definesCF = true;
+    break;
+  }
+  case X86::JMP_1:
+    if (!MI.getOperand(0).isMBB()) {
+      result.supported = false;
+      break;
+    }
+    result.target = token(MI.getOperand(0).getMBB());
+    break;
+#if LLVM_VERSION_MAJOR >= 9
+  case X86::JCC_1: {
+    bool taken;
+
+    if (!evalCondition(MI.getOperand(1).getImm(), state, taken)) {
+      result.supported = false;
+      return result;
+    }
+#else
+  case X86::JE_1:
+  case X86::JNE_1:
+  case X86::JB_1:
+  case X86::JAE_1: {
+    bool taken;
+
+    switch (opcode) {
+    case X86::JE_1: taken = state.zf; break;
+    case X86::JNE_1: taken = !state.zf; break;
+    case X86::JB_1: taken = state.cf; break;
+    default: taken = !state.cf; break;
+    }
+#endif
+    if (!MI.getOperand(0).isMBB()) {
+      result.supported = false;
+      break;
+    }
+    if (taken) {
+      result.target = token(MI.getOperand(0).getMBB());
+    }
+    break;
+  }
+#if LLVM_VERSION_MAJOR >= 9
+  case X86::CMOV32rr: {
+    bool holds;
+
+    if (!evalCondition(MI.getOperand(3).getImm(), state, holds)) {
+      result.supported = false;
+      break;
+    }
+    if (holds) {
+      regs[MI.getOperand(0).getReg()] = regs[MI.getOperand(2).getReg()];
+    }
+    break;
+  }
+  case X86::SETCCr: {
+    unsigned int reg = getX86SubSuperRegisterOrZero(MI.getOperand(0).getReg(),
+                                                    32);
+    bool         holds;
+
+    if (reg == X86::NoRegister ||
+        getX86SubSuperRegister(reg, 8) != MI.getOperand(0).getReg() ||
+        !evalCondition(MI.getOperand(1).getImm(), state, holds)) {
+      result.supported = false;
+      break;
+    }
+    regs[reg] = (regs[reg] & ~0xffu) | (holds ? 1 : 0);
+    break;
+  }
+#endif
+  case X86::CALLpcrel32:
+  case X86::CALL32r:
+  case X86::CALL32m: {
+    if (opcode == X86::CALL32r) {
+      value = regs[MI.getOperand(0).getReg()];
+    } else if (opcode == X86::CALL32m) {
+      if (!effectiveAddress(MI, 0, state, address)) {
+        result.supported = false;
+        break;
+      }
+      value = load(state, address);
+    } else if (!operandValue(MI.getOperand(0), value)) {
+      result.supported = false;
+      break;
+    }
+    regs[X86::ESP] -= 4;
+    state.memory[regs[X86::ESP]] = FALLTHROUGH_TOKEN;
+    result.target                = value;
+    break;
+  }
+  default: result.supported = false; break;
+  }
+
+  return result;
+}
+
+bool ChainInterpreter::verify(const MachineInstr              &MI,
+                              const ROPChain                  &chain,
+                              const std::vector<unsigned int> &scratchRegs,
+                              std::string                     &error) {
+  for (unsigned int trial = 0; trial < trials; trial++) {
+    State initial   = randomState();
+    State reference = initial, actual = initial;
+
+    Execution expected = executeInstr(MI, reference);
+    if (!expected.supported) {
+      skippedCount++;
+      return true;
+    }
+
+    Execution result = executeChain(chain, actual);
+    executedGadgets += result.gadgets;
+    if (!result.ok) {
+      error = result.error;
+      failedCount++;
+      return false;
+    }
+
+    std::vector<std::string> mismatches;
+
+    if (result.target != expected.target) {
+      mismatches.push_back(fmt::format("target {:#x} (expected {:#x})",
+                                       result.target,
+                                       expected.target));
+    }
+
+    for (unsigned int reg : GENERAL_PURPOSE_REGS) {
+      if (std::find(scratchRegs.begin(), scratchRegs.end(), reg) ==
+              scratchRegs.end() &&
+          actual.regs[reg] != reference.regs[reg]) {
+        mismatches.push_back(fmt::format("register {} = {:#x} (expected {:#x})",
+                                         reg,
+                                         actual.regs[reg],
+                                         reference.regs[reg]));
+      }
+    }
+
+    if (actual.regs[X86::ESP] != reference.regs[X86::ESP]) {
+      mismatches.push_back(fmt::format("esp = {:#x} (expected {:#x})",
+                                       actual.regs[X86::ESP],
+                                       reference.regs[X86::ESP]));
+    }
+
+    // flags are relevant only if they are used afterwards
+    if (!MI.registerDefIsDead(X86::EFLAGS)) {
+      if (expected.definesZF && actual.zf != reference.zf) {
+        mismatches.push_back("ZF");
+      }
+      if (expected.definesCF && actual.cf != reference.cf) {
+        mismatches.push_back("CF");
+      }
+    }
+
+    std::set<uint32_t> written = reference.written;
+    written.insert(actual.written.begin(), actual.written.end());
+    for (uint32_t address : written) {
+      if (load(actual, address) != load(reference, address)) {
+        mismatches.push_back(fmt::format("memory [{:#x}]", address));
+      }
+    }
+
+    if (!mismatches.empty()) {
+      error = mismatches[0];
+      for (size_t i = 1; i < mismatches.size(); i++) {
+        error += ", " + mismatches[i];
+      }
+      failedCount++;
+      return false;
+    }
+  }
+
+  verifiedCount++;
+  return true;
+}
+
+} // namespace ropf
@@ -0,0 +1,132 @@
+// ==============================================================================
+//   CHAIN INTERPRETER
+//   part of the ROPfuscator project
+// ==============================================================================
+// This module executes ROP chains offline, on an abstract x86-32 machine made
+// of the general purpose registers, ZF/CF flags and a sparse memory.
+// Each gadget is executed according to the semantics of its MCInst, and each
+// RET pops the next chain element, exactly as it happens at run-time.
+//
+// The same abstract machine also executes the original MachineInstr, so that
+// a chain can be verified against the instruction it replaces without
+// linking and running the obfuscated program. Since the chain layout on stack
+// is emulated as well, the number of gadgets executed at run-time is counted.
+//
+// Values which are only known at link time (global symbols, basic block
+// addresses, resume address) are represented by unique tokens.
+
+#ifndef CHAININTERPRETER_H
+#define CHAININTERPRETER_H
+
+#include <cstdint>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+// forward declaration
+namespace llvm {
+class GlobalValue;
+class MachineBasicBlock;
+class MachineInstr;
+class MachineOperand;
+} // namespace llvm
+
+namespace ropf {
+
+class ROPChain;
+struct ChainElem;
+struct Microgadget;
+
+class ChainInterpreter {
+public:
+  // abstract machine state
+  struct State {
+    std::map<unsigned int, uint32_t> regs;
+    bool                             zf, cf;
+    // memory words written during the execution
+    std::map<uint32_t, uint32_t>     memory;
+    std::set<uint32_t>               written;
+  };
+
+  // outcome of an execution
+  struct Execution {
+    // false if the execution failed (e.g., unknown gadget)
+    bool        ok;
+    // false if the instruction is not modelled (reference execution only)
+    bool        supported;
+    std::string error;
+    // address where the control flow is transferred at the end
+    uint32_t    target;
+    // flags defined by the execution (reference execution only)
+    bool        definesZF, definesCF;
+    // number of gadgets executed
+    size_t      gadgets;
+
+    Execution()
+        : ok(true), supported(true), error(), target(0), definesZF(false),
+          definesCF(false), gadgets(0) {}
+  };
+
+  // statistics, updated by verify()
+  size_t verifiedCount   = 0;
+  size_t failedCount     = 0;
+  size_t skippedCount    = 0;
+  size_t executedGadgets = 0;
+
+  explicit ChainInterpreter(unsigned int trials = 8);
+
+  // randomState - returns a state with random register and flag values.
+  State randomState();
+
+  // executeChain - executes the chain, laid out on the stack right below ESP
+  // (i.e., as emitted by ROPfuscatorCore::insertROPChain()).
+  Execution executeChain(const ROPChain &chain, State &state);
+
+  // executeInstr - executes the original instruction (reference semantics).
+  Execution executeInstr(const llvm::MachineInstr &MI, State &state);
+
+  // verify - executes both the instruction and the chain on random states,
+  // and checks that they have the same effect. Scratch registers (and dead
+  // flags) are allowed to differ. Returns false (and sets error) if a mismatch
+  // is found.
+  bool verify(const llvm::MachineInstr        &MI,
+              const ROPChain                  &chain,
+              const std::vector<unsigned int> &scratchRegs,
+              std::string                     &error);
+
+  // tokens representing link-time values
+  uint32_t fallthroughToken() const { return FALLTHROUGH_TOKEN; }
+  uint32_t token(const llvm::GlobalValue *global);
+  uint32_t token(const llvm::MachineBasicBlock *MBB);
+  uint32_t token(const Microgadget *gadget);
+
+private:
+  static const uint32_t FALLTHROUGH_TOKEN = 0xfa110000;
+  static const uint32_t MAX_GADGETS       = 100000;
+
+  unsigned int                                        trials;
+  std::mt19937                                        rng;
+  std::map<const llvm::GlobalValue *, uint32_t>       globalTokens;
+  std::map<const llvm::MachineBasicBlock *, uint32_t> blockTokens;
+  std::map<const Microgadget *, uint32_t>             gadgetTokens;
+  std::map<uint32_t, const Microgadget *>             gadgetByToken;
+
+  uint32_t load(State &state, uint32_t address) const;
+  void     store(State &state, uint32_t address, uint32_t value) const;
+  uint32_t elemValue(const ChainElem &elem);
+  bool     operandValue(const llvm::MachineOperand &operand, uint32_t &value);
+  bool     effectiveAddress(const llvm::MachineInstr &MI,
+                            unsigned int              firstOperand,
+                            State                    &state,
+                            uint32_t                 &address);
+  bool     executeGadget(const Microgadget &gadget,
+                         State             &state,
+                         uint32_t          &next,
+                         std::string       &error);
+};
+
+} // namespace ropf
+
+#endif
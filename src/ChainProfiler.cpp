@@ -0,0 +1,177 @@
+// ==============================================================================
+//   CHAIN PROFILER
+//   part of the ROPfuscator project
+// ==============================================================================
+
+#include "ChainProfiler.h"
+#include "X86AssembleHelper.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+using namespace llvm;
+
+namespace ropf {
+
+namespace {
+
+// { uint32_t count; const char *label; }
+StructType *getRecordType(LLVMContext &ctx) {
+  return StructType::get(ctx,
+                         {Type::getInt32Ty(ctx), Type::getInt8PtrTy(ctx)});
+}
+
+// __start_<section> / __stop_<section>, defined by the linker
+GlobalVariable *getSectionBoundary(Module &module, const std::string &name) {
+  if (auto *gv = module.getNamedGlobal(name)) {
+    return gv;
+  }
+
+  // weak: the section does not exist if no chain is profiled
+  auto *gv = new GlobalVariable(module,
+                                getRecordType(module.getContext()),
+                                false,
+                                GlobalValue::ExternalWeakLinkage,
+                                nullptr,
+                                name);
+  gv->setVisibility(GlobalValue::HiddenVisibility);
+  return gv;
+}
+
+} // namespace
+
+void emitChainProfileDumper(Module &module, const std::string &outputFile) {
+  LLVMContext &ctx      = module.getContext();
+  StructType  *recordTy = getRecordType(ctx);
+  Type        *i8PtrTy  = Type::getInt8PtrTy(ctx);
+  Type        *i32Ty    = Type::getInt32Ty(ctx);
+
+  if (module.getFunction(CHAIN_PROFILE_DUMP_FUNCTION)) {
+    return;
+  }
+
+  // FILE * is handled as an opaque pointer
+  auto fopenFn =
+      module.getOrInsertFunction("fopen", i8PtrTy, i8PtrTy, i8PtrTy);
+  auto fcloseFn  = module.getOrInsertFunction("fclose", i32Ty, i8PtrTy);
+  auto fprintfFn = module.getOrInsertFunction(
+      "fprintf",
+      FunctionType::get(i32Ty, {i8PtrTy, i8PtrTy}, true));
+
+  // the dumper is the same for every module: keep only one copy at link time
+  Function *dumper =
+      Function::Create(FunctionType::get(Type::getVoidTy(ctx), false),
+                       GlobalValue::LinkOnceODRLinkage,
+                       CHAIN_PROFILE_DUMP_FUNCTION,
+                       &module);
+  dumper->setVisibility(GlobalValue::HiddenVisibility);
+  dumper->setComdat(module.getOrInsertComdat(CHAIN_PROFILE_DUMP_FUNCTION));
+
+  GlobalVariable *start =
+      getSectionBoundary(module, "__start_" CHAIN_PROFILE_SECTION);
+  GlobalVariable *stop =
+      getSectionBoundary(module, "__stop_" CHAIN_PROFILE_SECTION);
+
+  BasicBlock *entryBB = BasicBlock::Create(ctx, "entry", dumper);
+  BasicBlock *loopBB  = BasicBlock::Create(ctx, "loop", dumper);
+  BasicBlock *bodyBB  = BasicBlock::Create(ctx, "body", dumper);
+  BasicBlock *closeBB = BasicBlock::Create(ctx, "close", dumper);
+  BasicBlock *retBB   = BasicBlock::Create(ctx, "ret", dumper);
+  IRBuilder<> builder(entryBB);
+
+  // FILE *f = fopen(outputFile, "a");
+  Value *file = builder.CreateCall(fopenFn,
+                                   {builder.CreateGlobalStringPtr(outputFile),
+                                    builder.CreateGlobalStringPtr("a")});
+  builder.CreateCondBr(builder.CreateIsNull(file), retBB, loopBB);
+
+  // for (record = start; record < stop; record++)
+  builder.SetInsertPoint(loopBB);
+  PHINode *record = builder.CreatePHI(recordTy->getPointerTo(), 2);
+  record->addIncoming(start, entryBB);
+  builder.CreateCondBr(builder.CreateICmpULT(record, stop), bodyBB, closeBB);
+
+  //   fprintf(f, "%s\t%u\n", record->label, record->count);
+  builder.SetInsertPoint(bodyBB);
+  Value *count =
+      builder.CreateLoad(i32Ty, builder.CreateStructGEP(recordTy, record, 0));
+  Value *label =
+      builder.CreateLoad(i8PtrTy, builder.CreateStructGEP(recordTy, record, 1));
+  builder.CreateCall(
+      fprintfFn,
+      {file, builder.CreateGlobalStringPtr("%s\t%u\n"), label, count});
+  record->addIncoming(builder.CreateConstGEP1_32(recordTy, record, 1), bodyBB);
+  builder.CreateBr(loopBB);
+
+  // fclose(f);
+  builder.SetInsertPoint(closeBB);
+  builder.CreateCall(fcloseFn, {file});
+  builder.CreateBr(retBB);
+
+  builder.SetInsertPoint(retBB);
+  builder.CreateRetVoid();
+
+  // associated with the dumper, so that the .fini_array entry is in the same
+  // COMDAT group and the counters are dumped only once
+  appendToGlobalDtors(module, dumper, 0, dumper);
+}
+
+GlobalVariable *createChainProfileRecord(Module            &module,
+                                         const std::string &chainLabel) {
+  LLVMContext &ctx      = module.getContext();
+  StructType  *recordTy = getRecordType(ctx);
+
+  Constant *labelData = ConstantDataArray::getString(ctx, chainLabel);
+  auto     *labelGV   = new GlobalVariable(module,
+                                       labelData->getType(),
+                                       true,
+                                       GlobalValue::PrivateLinkage,
+                                       labelData,
+                                       "__ropf_profile_label_" + chainLabel);
+  Constant *labelPtr =
+      ConstantExpr::getPointerCast(labelGV, Type::getInt8PtrTy(ctx));
+
+  auto *record = new GlobalVariable(
+      module,
+      recordTy,
+      false,
+      GlobalValue::PrivateLinkage,
+      ConstantStruct::get(
+          recordTy,
+          {ConstantInt::get(Type::getInt32Ty(ctx), 0), labelPtr}),
+      "__ropf_profile_" + chainLabel);
+  record->setSection(CHAIN_PROFILE_SECTION);
+  // records must be contiguous in the section
+#if LLVM_VERSION_MAJOR >= 10
+  record->setAlignment(MaybeAlign(4));
+#else
+  record->setAlignment(4);
+#endif
+
+  return record;
+}
+
+void emitChainProfileCounter(X86AssembleHelper    &as,
+                             const GlobalVariable *record,
+                             unsigned int          picBase) {
+  // the scratch register must not be the one holding the GOT address
+  unsigned int reg = picBase == X86::EAX ? X86::ECX : X86::EAX;
+  auto         counter =
+      picBase ? as.mem(picBase, record, 0, X86II::MO_GOTOFF) : as.mem(record);
+
+  // record->count++, without clobbering flags:
+  //   push eax
+  //   mov eax, [record]          (or [got + record@GOTOFF])
+  //   lea eax, [eax+1]
+  //   mov [record], eax
+  //   pop eax
+  as.push(as.reg(reg));
+  as.mov(as.reg(reg), counter);
+  as.lea(as.reg(reg), as.mem(reg, 1));
+  as.mov(counter, as.reg(reg));
+  as.pop(as.reg(reg));
+}
+
+} // namespace ropf
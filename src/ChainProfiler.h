@@ -0,0 +1,59 @@
+// ==============================================================================
+//   CHAIN PROFILER
+//   part of the ROPfuscator project
+// ==============================================================================
+// This module instruments obfuscated programs so that they count how many
+// times each ROP chain is executed.
+//
+// Each chain gets a profile record { uint32_t count; const char *label; },
+// placed in the CHAIN_PROFILE_SECTION section: the records of a module form
+// its counter array, and the linker concatenates the arrays of all the
+// modules, delimited by the __start_/__stop_ symbols of the section.
+// A counter increment, which preserves registers and flags, is emitted in
+// the code building every chain. With position-independent chains, the
+// record is addressed relative to the GOT, so that no text relocation is
+// needed.
+//
+// A destructor (shared by all the modules through a COMDAT group) appends
+// one "<chain label>\t<count>" line per chain to the profile file at exit.
+// Chain labels are the ones emitted with use_chain_label, i.e.
+// <function>_chain_<id>. Counts of several runs are appended to the same
+// file, and should be summed by the consumer.
+
+#ifndef CHAINPROFILER_H
+#define CHAINPROFILER_H
+
+#include <string>
+
+// forward declaration
+namespace llvm {
+class GlobalVariable;
+class Module;
+} // namespace llvm
+
+namespace ropf {
+
+class X86AssembleHelper;
+
+#define CHAIN_PROFILE_SECTION       "ropf_profile"
+#define CHAIN_PROFILE_DUMP_FUNCTION "__ropf_profile_dump"
+
+// emitChainProfileDumper - adds to the module the destructor writing the
+// counters to outputFile at exit.
+void emitChainProfileDumper(llvm::Module      &module,
+                            const std::string &outputFile);
+
+// createChainProfileRecord - creates the profile record of the chain.
+llvm::GlobalVariable *createChainProfileRecord(llvm::Module      &module,
+                                               const std::string &chainLabel);
+
+// emitChainProfileCounter - emits the code incrementing the counter of the
+// record. If picBase is set, it holds the GOT address and the record is
+// addressed through it (@GOTOFF); otherwise, its absolute address is used.
+void emitChainProfileCounter(X86AssembleHelper          &as,
+                             const llvm::GlobalVariable *record,
+                             unsigned int                picBase);
+
+} // namespace ropf
+
+#endif
@@ -44,11 +44,16 @@ performLivenessAnalysis(MachineBasicBlock &MBB) {
   LivePhysRegs               LiveRegs(TRI);
   LiveRegs.addLiveIns(MBB);
 
+  // scratch registers have the width of the target's GPRs
+  const TargetRegisterClass &GPRs = MF->getSubtarget<X86Subtarget>().is64Bit()
+                                        ? X86::GR64RegClass
+                                        : X86::GR32RegClass;
+
   for (auto I = MBB.begin(); I != MBB.end(); ++I) {
     MachineInstr *MI = &*I;
     regs.insert(std::make_pair(MI, emptyVect));
 
-    for (unsigned reg : X86::GR32RegClass) {
+    for (unsigned reg : GPRs) {
       if (LiveRegs.available(MRI, reg)) {
         addReg(*MI, reg, regs);
       }
@@ -7,7 +7,8 @@ namespace ropf::math {
 
 namespace {
 
-std::default_random_engine reng;
+// each thread has its own engine (see Random::ScopedSeed)
+thread_local std::default_random_engine reng;
 
 void egcd(uint64_t a, uint64_t m, uint64_t &g, uint64_t &x, uint64_t &y) {
   if (a == 0) {
@@ -16,6 +16,18 @@ public:
   static uint32_t                    rand();
   static bool                        bit();
   static std::default_random_engine &engine();
+
+  // ScopedSeed - until destroyed, the random numbers of the current thread
+  // are generated from the given seed; the engine is restored afterwards.
+  class ScopedSeed {
+    std::default_random_engine saved;
+
+  public:
+    explicit ScopedSeed(uint32_t seed) : saved(engine()) {
+      engine().seed(seed);
+    }
+    ~ScopedSeed() { engine() = saved; }
+  };
 };
 
 class PrimeNumberGenerator {
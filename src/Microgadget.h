@@ -27,8 +27,61 @@ enum class GadgetType {
   XOR_1,
   CMOVE,
   CMOVB,
+  IMUL,
+  MUL,
 };
 
+// gadgetTypeName - name of the gadget type (for diagnostics)
+inline const char *gadgetTypeName(GadgetType type) {
+  switch (type) {
+  case GadgetType::UNDEFINED:
+    return "UNDEFINED";
+  case GadgetType::MOV:
+    return "MOV";
+  case GadgetType::XCHG:
+    return "XCHG";
+  case GadgetType::COPY:
+    return "COPY";
+  case GadgetType::LOAD:
+    return "LOAD";
+  case GadgetType::LOAD_1:
+    return "LOAD_1";
+  case GadgetType::STORE:
+    return "STORE";
+  case GadgetType::JMP:
+    return "JMP";
+  case GadgetType::ADD:
+    return "ADD";
+  case GadgetType::ADD_1:
+    return "ADD_1";
+  case GadgetType::SUB:
+    return "SUB";
+  case GadgetType::SUB_1:
+    return "SUB_1";
+  case GadgetType::AND:
+    return "AND";
+  case GadgetType::AND_1:
+    return "AND_1";
+  case GadgetType::OR:
+    return "OR";
+  case GadgetType::OR_1:
+    return "OR_1";
+  case GadgetType::XOR:
+    return "XOR";
+  case GadgetType::XOR_1:
+    return "XOR_1";
+  case GadgetType::CMOVE:
+    return "CMOVE";
+  case GadgetType::CMOVB:
+    return "CMOVB";
+  case GadgetType::IMUL:
+    return "IMUL";
+  case GadgetType::MUL:
+    return "MUL";
+  }
+  return "?";
+}
+
 // Microgadget - represents a single x86 instruction that precedes a RET.
 struct Microgadget {
   // Type - gives basic semantic information about the instruction
@@ -43,6 +96,10 @@ struct Microgadget {
   // gadget address(es)
   std::vector<uint64_t> addresses;
 
+  // retSlots - stack slots released by a "ret imm16" terminator (0 for a
+  // plain ret). They follow the return address, and are skipped.
+  unsigned short retSlots;
+
   // debug
   std::string asmInstr;
 
@@ -52,7 +109,8 @@ struct Microgadget {
               uint64_t            address,
               std::string         asmInstr)
       : Type(GadgetType::UNDEFINED), reg1(0), reg2(0),
-        Instr(instr, instr + count), addresses(), asmInstr(asmInstr) {
+        Instr(instr, instr + count), addresses(), retSlots(0),
+        asmInstr(asmInstr) {
     addresses.push_back(address);
   }
 };
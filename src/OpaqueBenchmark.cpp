@@ -0,0 +1,126 @@
+// ==============================================================================
+//   OPAQUE CONSTRUCT BENCHMARK
+//   part of the ROPfuscator project
+// ==============================================================================
+
+#include "OpaqueBenchmark.h"
+#include "Debug.h"
+#include "OpaqueConstruct.h"
+#include "X86AssembleHelper.h"
+#include "llvm/CodeGen/MachineFunction.h"
+#include <memory>
+#include <set>
+#include <string>
+
+using namespace llvm;
+
+namespace ropf {
+
+namespace {
+
+// splits "a__b__c" into {"a", "b", "c"}
+std::vector<std::string> splitBenchName(const std::string &name) {
+  std::vector<std::string> fields;
+  size_t                   begin = 0, end;
+
+  while ((end = name.find("__", begin)) != std::string::npos) {
+    fields.push_back(name.substr(begin, end - begin));
+    begin = end + 2;
+  }
+  fields.push_back(name.substr(begin));
+
+  return fields;
+}
+
+std::shared_ptr<OpaqueConstruct>
+createBenchConstruct(const std::vector<std::string> &fields) {
+  if (fields.size() != 3) {
+    return nullptr;
+  }
+
+  if (fields[0] == OPAQUE_BENCH_KIND_CONSTANT) {
+    return OpaqueConstructFactory::createOpaqueConstant32(OpaqueStorage::EAX,
+                                                          OPAQUE_BENCH_VALUE,
+                                                          fields[1],
+                                                          fields[2],
+                                                          true);
+  }
+
+  if (fields[0] == OPAQUE_BENCH_KIND_BRANCH) {
+    return OpaqueConstructFactory::createBranchingOpaqueConstant32(
+        OpaqueStorage::EAX,
+        OPAQUE_BENCH_BRANCH_VALUES,
+        fields[1] + "+" + fields[2]);
+  }
+
+  return nullptr;
+}
+
+} // namespace
+
+bool emitOpaqueBenchmark(MachineFunction &MF) {
+  const std::string prefix   = OPAQUE_BENCH_FUNCTION_PREFIX;
+  std::string       funcName = MF.getName().str();
+  bool              modified = false;
+
+  if (funcName.compare(0, prefix.size(), prefix) != 0) {
+    return false;
+  }
+
+  auto fields = splitBenchName(funcName.substr(prefix.size()));
+
+  for (MachineBasicBlock &MBB : MF) {
+    if (MBB.empty() || !MBB.back().isReturn()) {
+      continue;
+    }
+
+    auto opaque = createBenchConstruct(fields);
+    if (!opaque) {
+      dbg_fmt("[-] Cannot understand opaque construct benchmark {}\n",
+              funcName);
+      return modified;
+    }
+
+    X86AssembleHelper    as(MBB, MBB.back().getIterator());
+    std::set<llvm_reg_t> savedRegs;
+    // zero-initialised: no saved values on stack, stack not mangled
+    StackState           stackState {};
+    size_t               instrCount = MBB.size();
+
+    // EAX holds the result, every other clobbered register is preserved
+    for (auto reg : opaque->getClobberedRegs()) {
+      if (reg != X86::EAX) {
+        savedRegs.insert(reg);
+      }
+    }
+
+    for (auto reg : savedRegs) {
+      if (reg == X86::EFLAGS) {
+        as.pushf();
+      } else {
+        as.push(as.reg(reg));
+      }
+    }
+
+    opaque->compile(as, stackState);
+
+    for (auto it = savedRegs.rbegin(); it != savedRegs.rend(); ++it) {
+      if (*it == X86::EFLAGS) {
+        as.popf();
+      } else {
+        as.pop(as.reg(*it));
+      }
+    }
+
+    dbg_fmt("[*] {}: {} instructions emitted ({} registers saved)\n",
+            funcName,
+            MBB.size() - instrCount,
+            savedRegs.size());
+
+    modified = true;
+  }
+
+  return modified;
+}
+
+} // namespace ropf
@@ -0,0 +1,50 @@
+// ==============================================================================
+//   OPAQUE CONSTRUCT BENCHMARK
+//   part of the ROPfuscator project
+// ==============================================================================
+// This module turns specially named functions into standalone opaque construct
+// benchmarks, so that the runtime cost of each opaque constant algorithm and
+// input generation algorithm can be measured in isolation.
+//
+// A function named
+//      ropf_opaque_bench__const__<algorithm>__<input algorithm>
+//      ropf_opaque_bench__branch__<random algorithm>__<selector algorithm>
+// gets a single opaque construct emitted right before each of its return
+// instructions. The construct leaves its value in EAX, i.e. it becomes the
+// return value of the function. Code is generated through X86AssembleHelper,
+// exactly as ROPfuscatorCore does for obfuscated programs.
+//
+// The harness calling these functions lives in tests/bench.
+
+#ifndef OPAQUEBENCHMARK_H
+#define OPAQUEBENCHMARK_H
+
+#include <cstdint>
+#include <vector>
+
+// forward declaration
+namespace llvm {
+class MachineFunction;
+} // namespace llvm
+
+namespace ropf {
+
+#define OPAQUE_BENCH_FUNCTION_PREFIX "ropf_opaque_bench__"
+#define OPAQUE_BENCH_KIND_CONSTANT   "const"
+#define OPAQUE_BENCH_KIND_BRANCH     "branch"
+
+// value returned by "const" benchmarks (keep in sync with tests/bench)
+const uint32_t OPAQUE_BENCH_VALUE = 0x5eed1e55;
+
+// values which may be returned by "branch" benchmarks
+const std::vector<uint32_t> OPAQUE_BENCH_BRANCH_VALUES = {0x5eed1e55,
+                                                          0xa112e5ee};
+
+// emitOpaqueBenchmark - if MF is a benchmark function, emits the requested
+// opaque construct before each return instruction. Returns true if MF has
+// been modified.
+bool emitOpaqueBenchmark(llvm::MachineFunction &MF);
+
+} // namespace ropf
+
+#endif
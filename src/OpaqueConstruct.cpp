@@ -713,7 +713,13 @@ public:
       clausedata.push_back(0);
     }
     auto gv_clausedata = as.createData(clausedata.data(), clausedata.size());
-    as.mov(as.reg(X86::ESI), gv_clausedata);
+    if (stack.pic_base) {
+      // lea esi, [got + clausedata@GOTOFF]
+      as.lea(as.reg(X86::ESI),
+             as.mem(stack.pic_base, gv_clausedata.global, 0, X86II::MO_GOTOFF));
+    } else {
+      as.mov(as.reg(X86::ESI), gv_clausedata);
+    }
     compileSharedCode(as, negate);
   }
 
@@ -1,12 +1,16 @@
 #include "ROPEngine.h"
 #include "BinAutopsy.h"
 #include "Debug.h"
+#include "MCTargetDesc/X86BaseInfo.h"
 #include "Microgadget.h"
 #include "Symbol.h"
 #include "X86.h"
 #include "X86InstrBuilder.h"
+#include "X86InstrInfo.h"
 #include "X86TargetMachine.h"
 #include "llvm/CodeGen/MachineFunction.h"
+#include <algorithm>
+#include <initializer_list>
 
 using std::string;
 using namespace llvm;
@@ -17,6 +21,11 @@ using Register = unsigned int;
 
 namespace ropf {
 
+// isStackPointer - true for ESP (x86) and RSP (x86-64)
+static bool isStackPointer(Register reg) {
+  return reg == X86::ESP || reg == X86::RSP;
+}
+
 class ROPChainBuilder {
   struct ReorderTag {};
 
@@ -37,10 +46,13 @@ class ROPChainBuilder {
     bool isImmediate() const { return type == GadgetType::UNDEFINED; }
   };
 
-  const BinaryAutopsy             &BA;
-  const std::vector<unsigned int> &scratchRegs;
-  std::vector<VirtualInstr>        vchain;
-  size_t                           numScratchRegs;
+  const BinaryAutopsy                 &BA;
+  // gadgets which must not be used (see ROPEngine)
+  const std::set<const Microgadget *> *excludedGadgets;
+  const std::vector<unsigned int>     &scratchRegs;
+  std::vector<VirtualInstr>            vchain;
+  size_t                               numScratchRegs;
+  MissingGadget                       &missingGadget;
 
 public:
   bool normalInstrFlag, jumpInstrFlag, conditionalJumpInstrFlag;
@@ -63,11 +75,15 @@ public:
     return *this;
   }
 
-  explicit ROPChainBuilder(const BinaryAutopsy             &BA,
-                           const std::vector<unsigned int> &scratchRegs)
-      : BA(BA), scratchRegs(scratchRegs), vchain(), numScratchRegs(0),
-        normalInstrFlag(false), jumpInstrFlag(false),
-        conditionalJumpInstrFlag(false) {}
+  explicit ROPChainBuilder(
+      const BinaryAutopsy                 &BA,
+      const std::vector<unsigned int>     &scratchRegs,
+      MissingGadget                       &missingGadget,
+      const std::set<const Microgadget *> *excludedGadgets)
+      : BA(BA), excludedGadgets(excludedGadgets), scratchRegs(scratchRegs),
+        vchain(), numScratchRegs(0),
+        missingGadget(missingGadget), normalInstrFlag(false),
+        jumpInstrFlag(false), conditionalJumpInstrFlag(false) {}
 
   ROPChainStatus build(XchgState &state, ROPChain &result) const {
     std::vector<int> regList;
@@ -101,54 +117,108 @@ private:
       return ROPChainStatus::ERR_NO_GADGETS_AVAILABLE;
     }
 
-    std::vector<ROPChain> chains;
-    XchgState             state0(state);
+    ROPChain       built;
+    XchgState      state0(state);
+    ROPChainStatus status = assemble(state0, regList, true, built);
+
+    // the slots released by "ret imm16" gadgets cannot always be placed:
+    // fall back to plain gadgets
+    if (status == ROPChainStatus::OK && !placeRetSlots(built)) {
+      built  = ROPChain();
+      state0 = state;
+      status = assemble(state0, regList, false, built);
+    }
+
+    if (status != ROPChainStatus::OK) {
+      return status;
+    }
+
+    result.append(built);
+    state = state0;
+
+    if (normalInstrFlag) {
+      result.hasNormalInstr = true;
+    }
+
+    if (jumpInstrFlag) {
+      result.hasUnconditionalJump = true;
+    }
+
+    if (conditionalJumpInstrFlag) {
+      result.hasConditionalJump = true;
+    }
+
+    return ROPChainStatus::OK;
+  }
 
+  ROPChainStatus assemble(XchgState              &state,
+                          const std::vector<int> &regList,
+                          bool                    allowRetSlots,
+                          ROPChain               &result) const {
     for (const VirtualInstr &vi : vchain) {
       if (vi.isReorder()) {
-        ROPChain chain = BA.undoXchgs(state0);
-        chains.push_back(chain);
+        result.append(BA.undoXchgs(state, excludedGadgets));
       } else if (vi.isImmediate()) {
-        if (chains.empty()) {
-          chains.emplace_back();
-        }
-
-        chains.back().emplace_back(vi.immediate);
+        result.emplace_back(vi.immediate);
       } else {
         int reg1 = vi.reg1 >= 0 ? vi.reg1 : regList[-vi.reg1 - 1];
         int reg2 = vi.reg2 >= 0 ? vi.reg2 : regList[-vi.reg2 - 1];
 
         if (!isNoop(vi.type, reg1, reg2)) {
-          ROPChain chain = BA.findGadgetPrimitive(state0, vi.type, reg1, reg2);
+          ROPChain chain = BA.findGadgetPrimitive(
+              state, vi.type, reg1, reg2, allowRetSlots, excludedGadgets);
 
           if (!chain.valid()) {
+            missingGadget.type = vi.type;
+            missingGadget.reg1 = reg1;
+            missingGadget.reg2 = reg2;
             return ROPChainStatus::ERR_NO_GADGETS_AVAILABLE;
           }
 
-          chains.push_back(chain);
+          result.append(chain);
         }
       }
     }
 
-    for (const ROPChain &chain : chains) {
-      result.append(chain);
-    }
+    return ROPChainStatus::OK;
+  }
 
-    state = state0;
+  // placeRetSlots - inserts the slots released by each "ret imm16" gadget
+  // right after its return address, i.e., the address of the next gadget.
+  // Returns false if the next gadget is not in this chain.
+  static bool placeRetSlots(ROPChain &chain) {
+    std::vector<unsigned int> slots(chain.size(), 0);
+    bool                      found = false;
 
-    if (normalInstrFlag) {
-      result.hasNormalInstr = true;
-    }
+    for (size_t i = 0; i < chain.size(); i++) {
+      const ChainElem &elem = chain.chain[i];
 
-    if (jumpInstrFlag) {
-      result.hasUnconditionalJump = true;
+      if (elem.type != ChainElem::Type::GADGET || !elem.microgadget->retSlots) {
+        continue;
+      }
+
+      // "pop REG" consumes a slot before returning
+      size_t ret = i + 1 + (elem.microgadget->Type == GadgetType::MOV ? 1 : 0);
+      if (ret >= chain.size() ||
+          chain.chain[ret].type != ChainElem::Type::GADGET) {
+        return false;
+      }
+
+      slots[ret] += elem.microgadget->retSlots;
+      found = true;
     }
 
-    if (conditionalJumpInstrFlag) {
-      result.hasConditionalJump = true;
+    if (found) {
+      std::vector<ChainElem> padded;
+
+      for (size_t i = 0; i < chain.size(); i++) {
+        padded.push_back(chain.chain[i]);
+        padded.insert(padded.end(), slots[i], ChainElem::createPadding());
+      }
+      chain.chain = std::move(padded);
     }
 
-    return ROPChainStatus::OK;
+    return true;
   }
 
   static bool isNoop(GadgetType type, int reg1, int reg2) {
@@ -163,12 +233,274 @@ private:
 namespace {
 const int SCRATCH_1 = -1;
 const int SCRATCH_2 = -2;
+
+// longest shift/add sequence replacing a multiplication by a constant
+const unsigned int MAX_MULTIPLY_GADGETS = 32;
+} // namespace
+
+// ------------------------------------------------------------------------
+// Recipes
+// ------------------------------------------------------------------------
+// The instructions lowered to a fixed sequence of gadgets are described by
+// the recipe table: each opcode has an ordered list of alternative recipes.
+// All of them are built, and the shortest chain wins (the first one on ties);
+// an alternative needing a missing gadget, or more scratch registers than the
+// available ones, is just skipped.
+
+namespace {
+
+// OperandForm - how the operands of the instruction are bound
+enum class OperandForm {
+  RR,  // op dst, src
+  RI,  // op dst, imm
+  RM,  // op dst, [base + disp]
+  RRM, // op dst, dst, [base + disp]  (two-address)
+  MI,  // op [base + disp], imm
+};
+
+enum RecipeOperand {
+  OP_NONE,
+  OP_DST,
+  OP_SRC,
+  OP_BASE, // the step is skipped if there is no base register
+  OP_IMM,  // immediates are pushed after the gadget (second operand only)
+  OP_DISP,
+  OP_ZERO,
+  OP_SCRATCH_1,
+  OP_SCRATCH_2,
+};
+
+// RecipeConstraint - operands for which the recipe would be wrong
+enum RecipeConstraint {
+  REQ_NONE,
+  REQ_DST_NOT_SRC,  // dst is written before src is read
+  REQ_DST_NOT_BASE, // dst is written before base is read
+};
+
+const size_t MAX_RECIPE_STEPS = 6;
+const size_t MAX_RECIPES      = 3;
+
+struct RecipeStep {
+  GadgetType    type;
+  RecipeOperand op1, op2;
+};
+
+// the steps are terminated by an UNDEFINED one, and are always followed by
+// the reordering of the registers
+struct Recipe {
+  RecipeConstraint constraint;
+  RecipeStep       steps[MAX_RECIPE_STEPS];
+};
+
+// the alternatives are terminated by an empty one
+struct RecipeList {
+  OperandForm form;
+  // flag effects: SAVE_BEFORE_EXEC if the instruction defines the flags
+  FlagSaveMode flagSave;
+  Recipe       recipes[MAX_RECIPES];
+};
+
+//   mov dst, src
+constexpr RecipeList MovRR = {
+    OperandForm::RR,
+    FlagSaveMode::SAVE_AFTER_EXEC,
+    {// mov dst, src
+     {REQ_NONE, {{GadgetType::COPY, OP_DST, OP_SRC}}},
+     // mov dst, 0; add dst, src
+     {REQ_DST_NOT_SRC,
+      {{GadgetType::MOV, OP_DST, OP_ZERO}, {GadgetType::ADD, OP_DST, OP_SRC}}},
+     // mov dst, 0; xor dst, src
+     {REQ_DST_NOT_SRC,
+      {{GadgetType::MOV, OP_DST, OP_ZERO},
+       {GadgetType::XOR, OP_DST, OP_SRC}}}}};
+
+//   mov dst, imm
+constexpr RecipeList MovRI = {
+    OperandForm::RI,
+    FlagSaveMode::SAVE_AFTER_EXEC,
+    {{REQ_NONE, {{GadgetType::MOV, OP_DST, OP_IMM}}}}};
+
+//   mov dst, [base + disp]
+constexpr RecipeList MovRM = {
+    OperandForm::RM,
+    FlagSaveMode::SAVE_AFTER_EXEC,
+    {// mov s1, disp; add s1, base; mov s1, [s1]; mov dst, s1
+     {REQ_NONE,
+      {{GadgetType::MOV, OP_SCRATCH_1, OP_DISP},
+       {GadgetType::ADD, OP_SCRATCH_1, OP_BASE},
+       {GadgetType::LOAD_1, OP_SCRATCH_1},
+       {GadgetType::COPY, OP_DST, OP_SCRATCH_1}}},
+     // mov s1, disp; add s1, base; mov dst, [s1]
+     {REQ_NONE,
+      {{GadgetType::MOV, OP_SCRATCH_1, OP_DISP},
+       {GadgetType::ADD, OP_SCRATCH_1, OP_BASE},
+       {GadgetType::LOAD, OP_DST, OP_SCRATCH_1}}},
+     // mov dst, disp; add dst, base; mov dst, [dst]
+     {REQ_DST_NOT_BASE,
+      {{GadgetType::MOV, OP_DST, OP_DISP},
+       {GadgetType::ADD, OP_DST, OP_BASE},
+       {GadgetType::LOAD_1, OP_DST}}}}};
+
+//   cmp dst, src
+constexpr RecipeList CmpRR = {
+    OperandForm::RR,
+    FlagSaveMode::SAVE_BEFORE_EXEC,
+    {// mov s1, dst; sub s1, src
+     {REQ_NONE,
+      {{GadgetType::COPY, OP_SCRATCH_1, OP_DST},
+       {GadgetType::SUB, OP_SCRATCH_1, OP_SRC}}},
+     // mov s1, 0; add s1, dst; sub s1, src
+     {REQ_NONE,
+      {{GadgetType::MOV, OP_SCRATCH_1, OP_ZERO},
+       {GadgetType::ADD, OP_SCRATCH_1, OP_DST},
+       {GadgetType::SUB, OP_SCRATCH_1, OP_SRC}}}}};
+
+//   cmp dst, imm
+constexpr RecipeList CmpRI = {
+    OperandForm::RI,
+    FlagSaveMode::SAVE_BEFORE_EXEC,
+    {// mov s2, imm; mov s1, dst; sub s1, s2
+     {REQ_NONE,
+      {{GadgetType::MOV, OP_SCRATCH_2, OP_IMM},
+       {GadgetType::COPY, OP_SCRATCH_1, OP_DST},
+       {GadgetType::SUB, OP_SCRATCH_1, OP_SCRATCH_2}}},
+     // mov s2, imm; mov s1, 0; add s1, dst; sub s1, s2
+     {REQ_NONE,
+      {{GadgetType::MOV, OP_SCRATCH_2, OP_IMM},
+       {GadgetType::MOV, OP_SCRATCH_1, OP_ZERO},
+       {GadgetType::ADD, OP_SCRATCH_1, OP_DST},
+       {GadgetType::SUB, OP_SCRATCH_1, OP_SCRATCH_2}}}}};
+
+//   cmp dst, [base + disp]
+constexpr RecipeList CmpRM = {
+    OperandForm::RM,
+    FlagSaveMode::SAVE_BEFORE_EXEC,
+    {// mov s1, disp; add s1, base; mov s1, [s1]; mov s2, dst; sub s2, s1
+     {REQ_NONE,
+      {{GadgetType::MOV, OP_SCRATCH_1, OP_DISP},
+       {GadgetType::ADD, OP_SCRATCH_1, OP_BASE},
+       {GadgetType::LOAD_1, OP_SCRATCH_1},
+       {GadgetType::COPY, OP_SCRATCH_2, OP_DST},
+       {GadgetType::SUB, OP_SCRATCH_2, OP_SCRATCH_1}}},
+     // mov s1, disp; add s1, base; mov s2, [s1]; mov s1, dst; sub s1, s2
+     {REQ_NONE,
+      {{GadgetType::MOV, OP_SCRATCH_1, OP_DISP},
+       {GadgetType::ADD, OP_SCRATCH_1, OP_BASE},
+       {GadgetType::LOAD, OP_SCRATCH_2, OP_SCRATCH_1},
+       {GadgetType::COPY, OP_SCRATCH_1, OP_DST},
+       {GadgetType::SUB, OP_SCRATCH_1, OP_SCRATCH_2}}}}};
+
+//   cmp [base + disp], imm
+constexpr RecipeList CmpMI = {
+    OperandForm::MI,
+    FlagSaveMode::SAVE_BEFORE_EXEC,
+    {// mov s2, imm; mov s1, disp; add s1, base; mov s1, [s1]; sub s1, s2
+     {REQ_NONE,
+      {{GadgetType::MOV, OP_SCRATCH_2, OP_IMM},
+       {GadgetType::MOV, OP_SCRATCH_1, OP_DISP},
+       {GadgetType::ADD, OP_SCRATCH_1, OP_BASE},
+       {GadgetType::LOAD_1, OP_SCRATCH_1},
+       {GadgetType::SUB, OP_SCRATCH_1, OP_SCRATCH_2}}},
+     // mov s2, disp; add s2, base; mov s1, [s2]; mov s2, imm; sub s1, s2
+     {REQ_NONE,
+      {{GadgetType::MOV, OP_SCRATCH_2, OP_DISP},
+       {GadgetType::ADD, OP_SCRATCH_2, OP_BASE},
+       {GadgetType::LOAD, OP_SCRATCH_1, OP_SCRATCH_2},
+       {GadgetType::MOV, OP_SCRATCH_2, OP_IMM},
+       {GadgetType::SUB, OP_SCRATCH_1, OP_SCRATCH_2}}}}};
+
+// arithmeticRM - recipes of "op dst, [base + disp]", where op is the given
+// gadget type
+constexpr RecipeList arithmeticRM(GadgetType type) {
+  return {OperandForm::RRM,
+          FlagSaveMode::SAVE_BEFORE_EXEC,
+          {// mov s1, disp; add s1, base; mov s1, [s1]; op dst, s1
+           {REQ_NONE,
+            {{GadgetType::MOV, OP_SCRATCH_1, OP_DISP},
+             {GadgetType::ADD, OP_SCRATCH_1, OP_BASE},
+             {GadgetType::LOAD_1, OP_SCRATCH_1},
+             {type, OP_DST, OP_SCRATCH_1}}},
+           // mov s2, disp; add s2, base; mov s1, [s2]; op dst, s1
+           {REQ_NONE,
+            {{GadgetType::MOV, OP_SCRATCH_2, OP_DISP},
+             {GadgetType::ADD, OP_SCRATCH_2, OP_BASE},
+             {GadgetType::LOAD, OP_SCRATCH_1, OP_SCRATCH_2},
+             {type, OP_DST, OP_SCRATCH_1}}}}};
+}
+
+constexpr RecipeList AddRM = arithmeticRM(GadgetType::ADD);
+constexpr RecipeList SubRM = arithmeticRM(GadgetType::SUB);
+constexpr RecipeList AndRM = arithmeticRM(GadgetType::AND);
+constexpr RecipeList XorRM = arithmeticRM(GadgetType::XOR);
+
+struct RecipeEntry {
+  unsigned int      opcode;
+  const RecipeList *recipes;
+};
+
+constexpr RecipeEntry RecipeTable[] = {
+    {X86::MOV32rr, &MovRR},   {X86::MOV64rr, &MovRR},
+    {X86::MOV32ri, &MovRI},   {X86::MOV64ri32, &MovRI},
+    {X86::MOV64ri, &MovRI},   {X86::MOV32rm, &MovRM},
+    {X86::MOV64rm, &MovRM},   {X86::CMP32rr, &CmpRR},
+    {X86::CMP64rr, &CmpRR},   {X86::CMP32ri, &CmpRI},
+    {X86::CMP32ri8, &CmpRI},  {X86::CMP64ri32, &CmpRI},
+    {X86::CMP64ri8, &CmpRI},  {X86::CMP32rm, &CmpRM},
+    {X86::CMP64rm, &CmpRM},   {X86::CMP32mi, &CmpMI},
+    {X86::CMP32mi8, &CmpMI},  {X86::CMP64mi32, &CmpMI},
+    {X86::CMP64mi8, &CmpMI},  {X86::ADD32rm, &AddRM},
+    {X86::ADD64rm, &AddRM},   {X86::SUB32rm, &SubRM},
+    {X86::SUB64rm, &SubRM},   {X86::AND32rm, &AndRM},
+    {X86::AND64rm, &AndRM},   {X86::XOR32rm, &XorRM},
+    {X86::XOR64rm, &XorRM},
+};
+
+// findRecipes - alternative recipes of the opcode, or nullptr
+constexpr const RecipeList *findRecipes(unsigned int opcode) {
+  for (const RecipeEntry &entry : RecipeTable) {
+    if (entry.opcode == opcode) {
+      return entry.recipes;
+    }
+  }
+
+  return nullptr;
+}
+
 } // namespace
 
 // ------------------------------------------------------------------------
 // ROP Chain
 // ------------------------------------------------------------------------
 
+const char *getStatusName(ROPChainStatus status) {
+  switch (status) {
+  case ROPChainStatus::OK:
+    return "ok";
+  case ROPChainStatus::ERR_NOT_IMPLEMENTED:
+    return "not implemented";
+  case ROPChainStatus::ERR_NO_REGISTER_AVAILABLE:
+    return "no scratch register available";
+  case ROPChainStatus::ERR_NO_GADGETS_AVAILABLE:
+    return "no gadget available";
+  case ROPChainStatus::ERR_UNSUPPORTED:
+    return "unsupported";
+  case ROPChainStatus::ERR_UNSUPPORTED_STACKPOINTER:
+    return "uses the stack pointer";
+  case ROPChainStatus::ERR_DEBUG_INSTRUCTION:
+    return "debug instruction";
+  case ROPChainStatus::COUNT:
+    break;
+  }
+  return "?";
+}
+
+// isCancellingPair - equal microgadgets, but only if they're both XCHG
+// instructions (terminated by a plain ret)
+static bool isCancellingPair(const ChainElem &a, const ChainElem &b) {
+  return a == b && a.type == ChainElem::Type::GADGET &&
+         a.microgadget->Type == GadgetType::XCHG && !a.microgadget->retSlots;
+}
+
 bool ROPChain::canMerge(const ROPChain &other) {
   if (!valid()) {
     return true;
@@ -206,8 +538,22 @@ void ROPChain::merge(const ROPChain &other) {
     return;
   }
 
-  append(other);
-  removeDuplicates();
+  // this chain is the stack of removeDuplicates(): pushing the elements of
+  // the other chain cancels the xchg pairs formed across the boundary
+  int otherSuccessor = -1;
+  for (size_t i = 0; i < other.size(); i++) {
+    const ChainElem &elem = other.chain[i];
+
+    if (!chain.empty() && isCancellingPair(chain.back(), elem)) {
+      chain.pop_back();
+      continue;
+    }
+    if ((int)i == other.successor) {
+      otherSuccessor = chain.size();
+    }
+    chain.push_back(elem);
+  }
+
   hasNormalInstr |= other.hasNormalInstr;
   hasConditionalJump |= other.hasConditionalJump;
   hasUnconditionalJump |= other.hasUnconditionalJump;
@@ -215,31 +561,33 @@ void ROPChain::merge(const ROPChain &other) {
     callee = other.callee;
   }
 
-  // handle conditional jump + unconditional jmp chain
-  if (other.successor && !successor) {
-    for (auto it = rbegin(); it != rend(); ++it) {
-      if (*it == *other.successor) {
-        successor = &*it;
-        break;
-      }
-    }
+  // handle conditional jump + unconditional jmp chain:
+  // the fallthrough of the conditional jump becomes the jump target
+  if (otherSuccessor >= 0 && successor < 0) {
+    const ChainElem target               = chain[otherSuccessor];
+    bool            conditionalJumpFound = false;
+    size_t          top                  = 0;
 
-    bool conditionalJumpFound = false;
+    successor = otherSuccessor;
 
-    for (auto it = begin(); it != end();) {
-      if (it->type == ChainElem::Type::JMP_FALLTHROUGH) {
-        *it                  = *successor;
+    for (size_t i = 0; i < chain.size(); i++) {
+      if (chain[i].type == ChainElem::Type::JMP_FALLTHROUGH) {
+        chain[i]             = target;
+        successor            = top;
         conditionalJumpFound = true;
-      } else if (conditionalJumpFound && *successor == *it) {
-        it = chain.erase(it);
+      } else if (conditionalJumpFound && chain[i] == target) {
         continue;
       }
-      ++it;
+      chain[top++] = chain[i];
     }
+    chain.resize(top);
   }
 }
 
-ROPEngine::ROPEngine(const BinaryAutopsy &BA) : BA(BA) {}
+ROPEngine::ROPEngine(const BinaryAutopsy                 &BA,
+                     int                                 &lastEspId,
+                     const std::set<const Microgadget *> *excludedGadgets)
+    : BA(BA), lastEspId(lastEspId), excludedGadgets(excludedGadgets) {}
 
 bool ROPEngine::convertOperandToChainPushImm(const MachineOperand &operand,
                                              ChainElem            &result) {
@@ -249,6 +597,13 @@ bool ROPEngine::convertOperandToChainPushImm(const MachineOperand &operand,
   }
 
   if (operand.isGlobal()) {
+    // @PLT only changes the relocation of a direct call, while the other
+    // flags (@GOT, @GOTOFF, ...) make the value relative to the PIC base
+    if (operand.getTargetFlags() != X86II::MO_NO_FLAG &&
+        operand.getTargetFlags() != X86II::MO_PLT) {
+      return false;
+    }
+
     result = ChainElem::fromGlobal(operand.getGlobal(), operand.getOffset());
     return true;
   }
@@ -264,7 +619,9 @@ ROPEngine::handleArithmeticRI(MachineInstr              *MI,
 
   switch (MI->getOpcode()) {
   case X86::ADD32ri8:
-  case X86::ADD32ri: {
+  case X86::ADD32ri:
+  case X86::ADD64ri8:
+  case X86::ADD64ri32: {
     if (!MI->getOperand(2).isImm()) {
       return ROPChainStatus::ERR_UNSUPPORTED;
     }
@@ -274,7 +631,9 @@ ROPEngine::handleArithmeticRI(MachineInstr              *MI,
     break;
   }
   case X86::SUB32ri8:
-  case X86::SUB32ri: {
+  case X86::SUB32ri:
+  case X86::SUB64ri8:
+  case X86::SUB64ri32: {
     if (!MI->getOperand(2).isImm()) {
       return ROPChainStatus::ERR_UNSUPPORTED;
     }
@@ -284,7 +643,9 @@ ROPEngine::handleArithmeticRI(MachineInstr              *MI,
     break;
   }
   case X86::AND32ri8:
-  case X86::AND32ri: {
+  case X86::AND32ri:
+  case X86::AND64ri8:
+  case X86::AND64ri32: {
     if (!MI->getOperand(2).isImm()) {
       return ROPChainStatus::ERR_UNSUPPORTED;
     }
@@ -293,12 +654,14 @@ ROPEngine::handleArithmeticRI(MachineInstr              *MI,
     imm         = MI->getOperand(2).getImm();
     break;
   }
-  case X86::INC32r: {
+  case X86::INC32r:
+  case X86::INC64r: {
     gadget_type = GadgetType::ADD;
     imm         = 1;
     break;
   }
-  case X86::DEC32r: {
+  case X86::DEC32r:
+  case X86::DEC64r: {
     gadget_type = GadgetType::SUB;
     imm         = 1;
     break;
@@ -307,7 +670,7 @@ ROPEngine::handleArithmeticRI(MachineInstr              *MI,
   }
 
   Register        dest_reg = MI->getOperand(0).getReg();
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, missingGadget, excludedGadgets);
 
   builder.append(GadgetType::MOV, SCRATCH_1)
       .append(ChainElem::fromImmediate(imm));
@@ -335,18 +698,22 @@ ROPEngine::handleArithmeticRR(MachineInstr              *MI,
   switch (MI->getOpcode()) {
   case X86::ADD32rr:
   case X86::ADD32rr_DB:
+  case X86::ADD64rr:
+  case X86::ADD64rr_DB:
     gadget_type = (src1 == src2) ? GadgetType::ADD_1 : GadgetType::ADD;
     break;
   case X86::SUB32rr:
+  case X86::SUB64rr:
     gadget_type = (src1 == src2) ? GadgetType::SUB_1 : GadgetType::SUB;
     break;
   case X86::AND32rr:
+  case X86::AND64rr:
     gadget_type = (src1 == src2) ? GadgetType::AND_1 : GadgetType::AND;
     break;
   default: return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, missingGadget, excludedGadgets);
 
   builder.append(gadget_type, dst, src2);
   builder.reorder();
@@ -355,50 +722,407 @@ ROPEngine::handleArithmeticRR(MachineInstr              *MI,
   return builder.build(state, chain);
 }
 
-ROPChainStatus
-ROPEngine::handleArithmeticRM(MachineInstr              *MI,
-                              std::vector<unsigned int> &scratchRegs) {
-  GadgetType gadget_type;
+ROPChainStatus ROPEngine::handleRecipe(MachineInstr              *MI,
+                                       std::vector<unsigned int> &scratchRegs,
+                                       FlagSaveMode              &flagSave) {
+  const RecipeList *list = findRecipes(MI->getOpcode());
 
-  switch (MI->getOpcode()) {
-  case X86::ADD32rm: gadget_type = GadgetType::ADD; break;
-  case X86::SUB32rm: gadget_type = GadgetType::SUB; break;
-  case X86::AND32rm: gadget_type = GadgetType::AND; break;
-  default: return ROPChainStatus::ERR_UNSUPPORTED;
+  if (!list) {
+    return ROPChainStatus::ERR_NOT_IMPLEMENTED;
   }
 
-  if (MI->getOperand(0).getReg() == X86::NoRegister) {
-    return ROPChainStatus::ERR_UNSUPPORTED;
+  // extract operands
+  Register  dst  = X86::NoRegister;
+  Register  src  = X86::NoRegister;
+  Register  base = X86::NoRegister; // may stay NoRegister
+  ChainElem imm_elem, disp_elem;
+
+  //      [orig_i + scale_i+1 * orig_i+2 + disp_i+3], segment orig_i+4
+  auto bindMemory = [&](unsigned int i) {
+    // skip scaled-index addressing mode and segment registers since we cannot
+    // handle them
+    for (unsigned int j : {i + 2, i + 4}) {
+      if (MI->getOperand(j).isReg() &&
+          MI->getOperand(j).getReg() != X86::NoRegister) {
+        return false;
+      }
+    }
+
+    base = MI->getOperand(i).getReg();
+    return convertOperandToChainPushImm(MI->getOperand(i + 3), disp_elem);
+  };
+
+  bool bound = false;
+
+  switch (list->form) {
+  case OperandForm::RR:
+    dst   = MI->getOperand(0).getReg();
+    src   = MI->getOperand(1).getReg();
+    bound = src != X86::NoRegister;
+    break;
+  case OperandForm::RI:
+    dst   = MI->getOperand(0).getReg();
+    bound = convertOperandToChainPushImm(MI->getOperand(1), imm_elem);
+    break;
+  case OperandForm::RM:
+    dst   = MI->getOperand(0).getReg();
+    bound = bindMemory(1);
+    break;
+  case OperandForm::RRM:
+    dst   = MI->getOperand(0).getReg();
+    bound = bindMemory(2);
+    break;
+  case OperandForm::MI:
+    bound = bindMemory(0) &&
+            convertOperandToChainPushImm(MI->getOperand(5), imm_elem);
+    break;
   }
 
-  // skip scaled-index addressing mode since we cannot handle them
-  //      xxx     orig_0/1, [orig_2 + scale_3 * orig_4 + disp_5]
-  if (MI->getOperand(4).isReg() &&
-      MI->getOperand(4).getReg() != X86::NoRegister) {
+  if (!bound || (list->form != OperandForm::MI && dst == X86::NoRegister)) {
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  // extract operands
-  Register dst = MI->getOperand(0).getReg();
-  Register src = MI->getOperand(2).getReg(); // may be NoRegister
+  auto getReg = [&](RecipeOperand op) -> int {
+    switch (op) {
+    case OP_DST: return dst;
+    case OP_SRC: return src;
+    case OP_BASE: return base;
+    case OP_SCRATCH_1: return SCRATCH_1;
+    case OP_SCRATCH_2: return SCRATCH_2;
+    default: return X86::NoRegister;
+    }
+  };
 
-  ChainElem disp_elem;
-  if (!convertOperandToChainPushImm(MI->getOperand(5), disp_elem)) {
+  ROPChainStatus status = ROPChainStatus::ERR_UNSUPPORTED;
+  MissingGadget  missing;
+  ROPChain       best;
+  XchgState      bestState;
+  bool           failed = false, found = false;
+
+  for (const Recipe &recipe : list->recipes) {
+    if (recipe.steps[0].type == GadgetType::UNDEFINED) {
+      break;
+    }
+
+    if ((recipe.constraint == REQ_DST_NOT_SRC && dst == src) ||
+        (recipe.constraint == REQ_DST_NOT_BASE && dst == base)) {
+      continue;
+    }
+
+    ROPChainBuilder builder(BA, scratchRegs, missingGadget, excludedGadgets);
+
+    for (const RecipeStep &step : recipe.steps) {
+      if (step.type == GadgetType::UNDEFINED) {
+        break;
+      }
+
+      if ((step.op1 == OP_BASE || step.op2 == OP_BASE) &&
+          base == X86::NoRegister) {
+        continue;
+      }
+
+      switch (step.op2) {
+      case OP_IMM:
+        builder.append(step.type, getReg(step.op1)).append(imm_elem);
+        break;
+      case OP_DISP:
+        builder.append(step.type, getReg(step.op1)).append(disp_elem);
+        break;
+      case OP_ZERO:
+        builder.append(step.type, getReg(step.op1))
+            .append(ChainElem::fromImmediate(0));
+        break;
+      default:
+        builder.append(step.type, getReg(step.op1), getReg(step.op2));
+        break;
+      }
+    }
+    builder.reorder();
+    builder.normalInstrFlag = true;
+
+    ROPChain       built;
+    XchgState      builtState(state);
+    ROPChainStatus result = builder.build(builtState, built);
+
+    if (result == ROPChainStatus::OK) {
+      if (!found || built.size() < best.size()) {
+        best      = std::move(built);
+        bestState = builtState;
+        found     = true;
+      }
+    } else if (!failed) {
+      // the failure of the first alternative is the one reported
+      status  = result;
+      missing = missingGadget;
+      failed  = true;
+    }
+  }
+
+  if (!found) {
+    missingGadget = missing;
+    return status;
+  }
+
+  chain.append(best);
+  chain.hasNormalInstr = best.hasNormalInstr;
+  state                = bestState;
+  flagSave             = list->flagSave;
+
+  return ROPChainStatus::OK;
+}
+
+// excludeRegs - scratch registers, except the given ones
+static std::vector<unsigned int>
+excludeRegs(const std::vector<unsigned int> &scratchRegs,
+            std::initializer_list<unsigned int> regs) {
+  std::vector<unsigned int> result;
+
+  for (unsigned int reg : scratchRegs) {
+    if (std::find(regs.begin(), regs.end(), reg) == regs.end()) {
+      result.push_back(reg);
+    }
+  }
+
+  return result;
+}
+
+// getMultiplyCost - number of gadgets evaluating the digits, most significant
+// first: the first non-zero digit initialises the result (+x or 0 - x), then
+// each position doubles it and adds or subtracts x
+static unsigned int getMultiplyCost(const std::vector<int> &digits) {
+  unsigned int cost = 0;
+  bool         init = false;
+
+  for (auto it = digits.rbegin(); it != digits.rend(); ++it) {
+    if (init) {
+      cost += *it ? 2 : 1;
+    } else if (*it) {
+      cost += *it > 0 ? 1 : 2;
+      init = true;
+    }
+  }
+
+  // mov dst, 0
+  return init ? cost : 1;
+}
+
+// getMultiplyDigits - signed binary digits (least significant first) of a
+// multiplication by a constant, in the form requiring the fewest add/sub
+// gadgets: plain binary or non-adjacent form (NAF), truncated to the
+// register width.
+static std::vector<int> getMultiplyDigits(uint64_t     factor,
+                                          unsigned int width) {
+  std::vector<int> binary, naf;
+
+  for (unsigned int i = 0; i < width; i++) {
+    binary.push_back((factor >> i) & 1);
+  }
+
+  for (uint64_t n = factor; n != 0 && naf.size() < width; n >>= 1) {
+    int digit = (n & 1) ? 2 - (int)(n & 3) : 0;
+    naf.push_back(digit);
+    n -= digit;
+  }
+
+  return getMultiplyCost(naf) < getMultiplyCost(binary) ? naf : binary;
+}
+
+ROPChainStatus ROPEngine::handleImul(MachineInstr              *MI,
+                                     std::vector<unsigned int> &scratchRegs) {
+  // imul sets CF and OF on signed overflow, which the gadgets do not
+  // reproduce
+  if (!MI->registerDefIsDead(X86::EFLAGS)) {
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  Register  dst        = MI->getOperand(0).getReg();
+  Register  src        = MI->getOperand(1).getReg();
+  Register  factor_reg = X86::NoRegister; // imul dst, factor_reg
+  Register  base       = X86::NoRegister; // imul dst, [base + disp]
+  ChainElem factor_elem;                  // imul dst, src, imm / [base + disp]
+  bool      fromMemory = false;
+  bool      is64Bit =
+      MI->getParent()->getParent()->getSubtarget<X86Subtarget>().is64Bit();
 
-  builder.append(GadgetType::MOV, SCRATCH_1).append(disp_elem);
-  if (src != X86::NoRegister) {
-    builder.append(GadgetType::ADD, SCRATCH_1, src);
+  switch (MI->getOpcode()) {
+  case X86::IMUL32rr:
+  case X86::IMUL64rr: factor_reg = MI->getOperand(2).getReg(); break;
+  case X86::IMUL32rri:
+  case X86::IMUL32rri8:
+  case X86::IMUL64rri8:
+  case X86::IMUL64rri32:
+    if (!MI->getOperand(2).isImm()) {
+      return ROPChainStatus::ERR_UNSUPPORTED;
+    }
+    factor_elem = ChainElem::fromImmediate(MI->getOperand(2).getImm());
+    break;
+  case X86::IMUL32rm:
+  case X86::IMUL64rm:
+    // skip scaled-index addressing mode since we cannot handle them
+    //      imul    orig_0, [orig_2 + scale_3 * orig_4 + disp_5]
+    if (MI->getOperand(4).isReg() &&
+        MI->getOperand(4).getReg() != X86::NoRegister) {
+      return ROPChainStatus::ERR_UNSUPPORTED;
+    }
+    // instruction uses a segment register
+    if (MI->getOperand(6).isReg() &&
+        MI->getOperand(6).getReg() != X86::NoRegister) {
+      return ROPChainStatus::ERR_UNSUPPORTED;
+    }
+    if (!convertOperandToChainPushImm(MI->getOperand(5), factor_elem)) {
+      return ROPChainStatus::ERR_UNSUPPORTED;
+    }
+    base       = MI->getOperand(2).getReg();
+    fromMemory = true;
+    break;
+  default: return ROPChainStatus::ERR_UNSUPPORTED;
   }
-  builder.append(GadgetType::LOAD_1, SCRATCH_1);
-  builder.append(gadget_type, dst, SCRATCH_1);
-  builder.reorder();
-  builder.normalInstrFlag = true;
 
-  return builder.build(state, chain);
+  // appends the gadgets loading the second factor, and returns the register
+  // holding it
+  auto appendFactor = [&](ROPChainBuilder &builder) -> int {
+    if (fromMemory) {
+      builder.append(GadgetType::MOV, SCRATCH_1).append(factor_elem);
+      if (base != X86::NoRegister) {
+        builder.append(GadgetType::ADD, SCRATCH_1, base);
+      }
+      builder.append(GadgetType::LOAD_1, SCRATCH_1);
+      return SCRATCH_1;
+    }
+    if (factor_reg == X86::NoRegister) {
+      builder.append(GadgetType::MOV, SCRATCH_1).append(factor_elem);
+      return SCRATCH_1;
+    }
+    if (factor_reg == dst) {
+      builder.append(GadgetType::COPY, SCRATCH_1, factor_reg);
+      return SCRATCH_1;
+    }
+    return factor_reg;
+  };
+
+  // dst may be dead before "imul dst, src, imm": it is written before the
+  // second factor is used
+  std::vector<unsigned int> regs = excludeRegs(scratchRegs, {dst});
+
+  //   (load factor)
+  //   mov dst, src
+  //   imul dst, factor
+  auto buildImul = [&]() {
+    ROPChainBuilder builder(BA, regs, missingGadget, excludedGadgets);
+    int             factor = appendFactor(builder);
+
+    builder.append(GadgetType::COPY, dst, src);
+    builder.append(GadgetType::IMUL, dst, factor);
+    builder.reorder();
+    builder.normalInstrFlag = true;
+
+    return builder.build(state, chain);
+  };
+
+  //   (load factor)
+  //   mov dst, src
+  //   mul factor  # with dst in eax, clobbers edx
+  auto buildMul = [&]() {
+    Register high = is64Bit ? X86::RDX : X86::EDX;
+
+    // edx must be free, and the xchgs must not move another register there:
+    // they start from the identity, and do not involve edx
+    if (dst == high ||
+        std::find(scratchRegs.begin(), scratchRegs.end(), high) ==
+            scratchRegs.end()) {
+      return ROPChainStatus::ERR_NO_REGISTER_AVAILABLE;
+    }
+
+    std::vector<unsigned int> mulRegs = excludeRegs(scratchRegs, {dst, high});
+    ROPChainBuilder           builder(BA,
+                            mulRegs,
+                            missingGadget,
+                            excludedGadgets);
+    int                       factor = appendFactor(builder);
+
+    builder.append(GadgetType::COPY, dst, src);
+    builder.reorder();
+    builder.append(GadgetType::MUL, dst, factor);
+    builder.reorder();
+    builder.normalInstrFlag = true;
+
+    return builder.build(state, chain);
+  };
+
+  if (factor_reg != X86::NoRegister || fromMemory) {
+    ROPChainStatus status = buildImul();
+    return status == ROPChainStatus::OK ? status : buildMul();
+  }
+
+  // multiplication by a constant: shift/add fallback
+  uint64_t multiplier = MI->getOperand(2).getImm();
+  if (!is64Bit) {
+    multiplier &= 0xffffffff;
+  }
+
+  std::vector<int> digits = getMultiplyDigits(multiplier, is64Bit ? 64 : 32);
+  unsigned int     cost   = getMultiplyCost(digits);
+
+  //   (mov scratch, src)
+  //   mov dst, src  /  mov dst, 0; sub dst, src
+  //   add dst, dst; add dst, src  /  sub dst, src
+  //   ...
+  auto buildShiftAdd = [&]() {
+    ROPChainBuilder builder(BA, regs, missingGadget, excludedGadgets);
+    int             x    = src;
+    bool            init = false;
+
+    if (src == dst) {
+      builder.append(GadgetType::COPY, SCRATCH_1, src);
+      x = SCRATCH_1;
+    }
+
+    for (auto it = digits.rbegin(); it != digits.rend(); ++it) {
+      if (init) {
+        builder.append(GadgetType::ADD_1, dst, dst);
+        if (*it > 0) {
+          builder.append(GadgetType::ADD, dst, x);
+        } else if (*it < 0) {
+          builder.append(GadgetType::SUB, dst, x);
+        }
+      } else if (*it > 0) {
+        builder.append(GadgetType::COPY, dst, x);
+        init = true;
+      } else if (*it < 0) {
+        builder.append(GadgetType::MOV, dst)
+            .append(ChainElem::fromImmediate(0));
+        builder.append(GadgetType::SUB, dst, x);
+        init = true;
+      }
+    }
+
+    if (!init) {
+      builder.append(GadgetType::MOV, dst).append(ChainElem::fromImmediate(0));
+    }
+    builder.reorder();
+    builder.normalInstrFlag = true;
+
+    return builder.build(state, chain);
+  };
+
+  // the shift/add sequence is preferred when it is as short as mov + imul
+  if (cost <= 2) {
+    ROPChainStatus status = buildShiftAdd();
+    if (status == ROPChainStatus::OK) {
+      return status;
+    }
+  }
+
+  ROPChainStatus status = buildImul();
+  if (status != ROPChainStatus::OK) {
+    status = buildMul();
+  }
+  if (status != ROPChainStatus::OK && cost > 2 &&
+      cost <= MAX_MULTIPLY_GADGETS) {
+    status = buildShiftAdd();
+  }
+
+  return status;
 }
 
 ROPChainStatus
@@ -414,7 +1138,7 @@ ROPEngine::handleXor32RR(MachineInstr              *MI,
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, missingGadget, excludedGadgets);
 
   builder.append(GadgetType::XOR_1, dst);
   builder.reorder();
@@ -445,7 +1169,7 @@ ROPChainStatus ROPEngine::handleLea32r(MachineInstr              *MI,
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, missingGadget, excludedGadgets);
 
   if (src == X86::NoRegister) {
     // lea dst, [disp]
@@ -472,86 +1196,44 @@ ROPChainStatus ROPEngine::handleLea32r(MachineInstr              *MI,
 }
 
 ROPChainStatus
-ROPEngine::handleMov32rm(MachineInstr              *MI,
+ROPEngine::handleMov32mr(MachineInstr              *MI,
                          std::vector<unsigned int> &scratchRegs) {
-  if (MI->getOperand(0).getReg() == X86::NoRegister) {
+  if (MI->getOperand(5).getReg() == X86::NoRegister) {
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
   // skip scaled-index addressing mode since we cannot handle them
-  //      mov     orig_0, [orig_1 + scale_2 * orig_3 + disp_4]
-  if (MI->getOperand(3).isReg() &&
-      MI->getOperand(3).getReg() != X86::NoRegister) {
+  //      mov     [orig_0 + scale_1 * orig_2 + disp_3], orig_5
+  if (MI->getOperand(2).isReg() &&
+      MI->getOperand(2).getReg() != X86::NoRegister) {
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
   // instruction uses a segment register
-  if (MI->getOperand(5).isReg() &&
-      MI->getOperand(5).getReg() != X86::NoRegister) {
+  if (MI->getOperand(4).isReg() &&
+      MI->getOperand(4).getReg() != X86::NoRegister) {
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
   // extract operands
-  Register  dst = MI->getOperand(0).getReg();
-  Register  src = MI->getOperand(1).getReg(); // may be NoRegister
+  Register  dst = MI->getOperand(0).getReg(); // may be NoRegister
+  Register  src = MI->getOperand(5).getReg();
   ChainElem disp_elem;
 
-  if (!convertOperandToChainPushImm(MI->getOperand(4), disp_elem)) {
+  if (!convertOperandToChainPushImm(MI->getOperand(3), disp_elem)) {
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  if (isStackPointer(src)) {
+    return ROPChainStatus::ERR_UNSUPPORTED;
+  }
 
-  builder.append(GadgetType::MOV, SCRATCH_1).append(disp_elem);
-  if (src != X86::NoRegister) {
-    builder.append(GadgetType::ADD, SCRATCH_1, src);
-  }
-  builder.append(GadgetType::LOAD_1, SCRATCH_1);
-  builder.append(GadgetType::COPY, dst, SCRATCH_1);
-  builder.reorder();
-  builder.normalInstrFlag = true;
-
-  return builder.build(state, chain);
-}
-
-ROPChainStatus
-ROPEngine::handleMov32mr(MachineInstr              *MI,
-                         std::vector<unsigned int> &scratchRegs) {
-  if (MI->getOperand(5).getReg() == X86::NoRegister) {
-    return ROPChainStatus::ERR_UNSUPPORTED;
-  }
-
-  // skip scaled-index addressing mode since we cannot handle them
-  //      mov     [orig_0 + scale_1 * orig_2 + disp_3], orig_5
-  if (MI->getOperand(2).isReg() &&
-      MI->getOperand(2).getReg() != X86::NoRegister) {
-    return ROPChainStatus::ERR_UNSUPPORTED;
-  }
-  // instruction uses a segment register
-  if (MI->getOperand(4).isReg() &&
-      MI->getOperand(4).getReg() != X86::NoRegister) {
-    return ROPChainStatus::ERR_UNSUPPORTED;
-  }
-
-  // extract operands
-  Register  dst = MI->getOperand(0).getReg(); // may be NoRegister
-  Register  src = MI->getOperand(5).getReg();
-  ChainElem disp_elem;
-
-  if (!convertOperandToChainPushImm(MI->getOperand(3), disp_elem)) {
-    return ROPChainStatus::ERR_UNSUPPORTED;
-  }
-
-  if (src == X86::ESP) {
-    return ROPChainStatus::ERR_UNSUPPORTED;
-  }
-
-  if (dst == X86::ESP) {
+  if (isStackPointer(dst)) {
     if (disp_elem.type != ChainElem::Type::IMM_VALUE || disp_elem.value < 0) {
       return ROPChainStatus::ERR_UNSUPPORTED;
     }
 
-    ROPChainBuilder builder(BA, scratchRegs);
-    ChainElem       esp_elem = ChainElem::createStackPointerPush();
+    ROPChainBuilder builder(BA, scratchRegs, missingGadget, excludedGadgets);
+    ChainElem       esp_elem = ChainElem::createStackPointerPush(++lastEspId);
 
     disp_elem =
         ChainElem::createStackPointerOffset(disp_elem.value, esp_elem.esp_id);
@@ -565,7 +1247,7 @@ ROPEngine::handleMov32mr(MachineInstr              *MI,
     return builder.build(state, chain);
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, missingGadget, excludedGadgets);
 
   builder.append(GadgetType::MOV, SCRATCH_1).append(disp_elem);
   if (dst != X86::NoRegister) {
@@ -608,13 +1290,13 @@ ROPEngine::handleMov32mi(MachineInstr              *MI,
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  if (dst == X86::ESP) {
+  if (isStackPointer(dst)) {
     if (disp_elem.type != ChainElem::Type::IMM_VALUE || disp_elem.value < 0) {
       return ROPChainStatus::ERR_UNSUPPORTED;
     }
 
-    ROPChainBuilder builder(BA, scratchRegs);
-    ChainElem       esp_elem = ChainElem::createStackPointerPush();
+    ROPChainBuilder builder(BA, scratchRegs, missingGadget, excludedGadgets);
+    ChainElem       esp_elem = ChainElem::createStackPointerPush(++lastEspId);
 
     disp_elem =
         ChainElem::createStackPointerOffset(disp_elem.value, esp_elem.esp_id);
@@ -629,7 +1311,7 @@ ROPEngine::handleMov32mi(MachineInstr              *MI,
     return builder.build(state, chain);
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, missingGadget, excludedGadgets);
 
   builder.append(GadgetType::MOV, SCRATCH_2).append(imm_elem);
   builder.append(GadgetType::MOV, SCRATCH_1).append(disp_elem);
@@ -643,261 +1325,225 @@ ROPEngine::handleMov32mi(MachineInstr              *MI,
   return builder.build(state, chain);
 }
 
-ROPChainStatus
-ROPEngine::handleMov32rr(MachineInstr              *MI,
-                         std::vector<unsigned int> &scratchRegs) {
-  if (MI->getOperand(0).getReg() == 0 || MI->getOperand(1).getReg() == 0) {
+ROPChainStatus ROPEngine::handleJmp1(MachineInstr              *MI,
+                                     std::vector<unsigned int> &scratchRegs) {
+  if (!MI->getOperand(0).isMBB()) {
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  // extract operands
-  Register dst = MI->getOperand(0).getReg();
-  Register src = MI->getOperand(1).getReg();
-
-  ROPChainBuilder builder(BA, scratchRegs);
-
-  builder.append(GadgetType::COPY, dst, src);
-  builder.reorder();
-  builder.normalInstrFlag = true;
+  chain.emplace_back(ChainElem::fromJmpTarget(MI->getOperand(0).getMBB()));
+  chain.hasUnconditionalJump = true;
+  chain.successor            = chain.size() - 1;
 
-  return builder.build(state, chain);
+  return ROPChainStatus::OK;
 }
 
-ROPChainStatus
-ROPEngine::handleMov32ri(MachineInstr              *MI,
-                         std::vector<unsigned int> &scratchRegs) {
-  if (MI->getOperand(0).getReg() == 0) {
-    return ROPChainStatus::ERR_UNSUPPORTED;
+// getCmovCondition - finds the CMOV gadget testing the condition of a Jcc,
+// CMOVcc or SETcc instruction. If reverse is set, the gadget moves when the
+// condition does not hold.
+static bool
+getCmovCondition(const MachineInstr &MI, GadgetType &type, bool &reverse) {
+#if LLVM_VERSION_MAJOR >= 9
+  // the condition code is the last explicit operand
+  switch (MI.getOperand(MI.getNumExplicitOperands() - 1).getImm()) {
+  case X86::COND_E:
+    type    = GadgetType::CMOVE;
+    reverse = false;
+    break;
+  case X86::COND_NE:
+    type    = GadgetType::CMOVE;
+    reverse = true;
+    break;
+  case X86::COND_B:
+    type    = GadgetType::CMOVB;
+    reverse = false;
+    break;
+  case X86::COND_AE:
+    type    = GadgetType::CMOVB;
+    reverse = true;
+    break;
+  default: return false;
   }
-
-  // extract operands
-  Register  dst = MI->getOperand(0).getReg();
-  ChainElem imm_elem;
-
-  if (!convertOperandToChainPushImm(MI->getOperand(1), imm_elem)) {
-    return ROPChainStatus::ERR_UNSUPPORTED;
+#else
+  switch (MI.getOpcode()) {
+  case X86::JE_1:
+  case X86::CMOVE32rr:
+  case X86::CMOVE64rr:
+  case X86::SETEr:
+    type    = GadgetType::CMOVE;
+    reverse = false;
+    break;
+  case X86::JNE_1:
+  case X86::CMOVNE32rr:
+  case X86::CMOVNE64rr:
+  case X86::SETNEr:
+    type    = GadgetType::CMOVE;
+    reverse = true;
+    break;
+  case X86::JB_1:
+  case X86::CMOVB32rr:
+  case X86::CMOVB64rr:
+  case X86::SETBr:
+    type    = GadgetType::CMOVB;
+    reverse = false;
+    break;
+  case X86::JAE_1:
+  case X86::CMOVAE32rr:
+  case X86::CMOVAE64rr:
+  case X86::SETAEr:
+    type    = GadgetType::CMOVB;
+    reverse = true;
+    break;
+  default: return false;
   }
+#endif
 
-  ROPChainBuilder builder(BA, scratchRegs);
-
-  builder.append(GadgetType::MOV, dst).append(imm_elem);
-  builder.reorder();
-  builder.normalInstrFlag = true;
-
-  return builder.build(state, chain);
+  return true;
 }
 
-ROPChainStatus
-ROPEngine::handleCmp32mi(MachineInstr              *MI,
-                         std::vector<unsigned int> &scratchRegs) {
-  // skip scaled-index addressing mode since we cannot handle them
-  //      cmp     [orig_0 + scale_1 * orig_2 + disp_3], orig_5
-  if ((MI->getOperand(2).isReg() &&
-       MI->getOperand(2).getReg() != X86::NoRegister) ||
-      (MI->getOperand(4).isReg() &&
-       MI->getOperand(4).getReg() != X86::NoRegister)) {
-    return ROPChainStatus::ERR_UNSUPPORTED;
-  }
-
-  // extract operands
-  Register  dst = MI->getOperand(0).getReg(); // may be NoRegister
-  ChainElem imm_elem;
+ROPChainStatus ROPEngine::handleJcc1(MachineInstr              *MI,
+                                     std::vector<unsigned int> &scratchRegs) {
+  // Jcc1 ROPification strategy:
+  //   pop reg1
+  //   ...target1...
+  //   pop reg2
+  //   ...target2...
+  //   cmov?? reg1, reg2
+  //   (xchg reg2)
+  //   jmp reg1  # xchg is not allowed
 
-  if (!convertOperandToChainPushImm(MI->getOperand(5), imm_elem)) {
+  if (!MI->getOperand(0).isMBB()) {
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ChainElem disp_elem;
+  GadgetType cmov_type;
+  bool       reverse;
 
-  if (!convertOperandToChainPushImm(MI->getOperand(3), disp_elem)) {
+  if (!getCmovCondition(*MI, cmov_type, reverse)) {
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, missingGadget, excludedGadgets);
 
-  builder.append(GadgetType::MOV, SCRATCH_2).append(imm_elem);
-  builder.append(GadgetType::MOV, SCRATCH_1).append(disp_elem);
-  if (dst != X86::NoRegister) {
-    builder.append(GadgetType::ADD, SCRATCH_1, dst);
-  }
-  builder.append(GadgetType::LOAD_1, SCRATCH_1);
-  builder.append(GadgetType::SUB, SCRATCH_1, SCRATCH_2);
+  builder.append(GadgetType::MOV, reverse ? SCRATCH_1 : SCRATCH_2)
+      .append(ChainElem::fromJmpTarget(MI->getOperand(0).getMBB()));
+  builder.append(GadgetType::MOV, reverse ? SCRATCH_2 : SCRATCH_1)
+      .append(ChainElem::createJmpFallthrough());
+  builder.append(cmov_type, SCRATCH_1, SCRATCH_2);
   builder.reorder();
-  builder.normalInstrFlag = true;
+  builder.append(GadgetType::JMP, SCRATCH_1);
+  builder.conditionalJumpInstrFlag = true;
 
   return builder.build(state, chain);
 }
 
 ROPChainStatus
-ROPEngine::handleCmp32rr(MachineInstr              *MI,
-                         std::vector<unsigned int> &scratchRegs) {
+ROPEngine::handleCmov32rr(MachineInstr              *MI,
+                          std::vector<unsigned int> &scratchRegs) {
   // extract operands
-  if (MI->getOperand(0).getReg() == 0) {
-    return ROPChainStatus::ERR_UNSUPPORTED;
-  }
-
-  Register reg1 = MI->getOperand(0).getReg();
-  Register reg2 = MI->getOperand(1).getReg();
-
-  ROPChainBuilder builder(BA, scratchRegs);
-
-  builder.append(GadgetType::COPY, SCRATCH_1, reg1);
-  builder.append(GadgetType::SUB, SCRATCH_1, reg2);
-  builder.reorder();
-  builder.normalInstrFlag = true;
-
-  return builder.build(state, chain);
-}
+  Register dst  = MI->getOperand(0).getReg();
+  Register src1 = MI->getOperand(1).getReg();
+  Register src2 = MI->getOperand(2).getReg();
 
-ROPChainStatus
-ROPEngine::handleCmp32ri(MachineInstr              *MI,
-                         std::vector<unsigned int> &scratchRegs) {
-  // extract operands
-  if (MI->getOperand(0).getReg() == 0) {
+  if (dst != src1) {
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  Register  reg = MI->getOperand(0).getReg();
-  ChainElem imm_elem;
+  GadgetType cmov_type;
+  bool       reverse;
 
-  if (!convertOperandToChainPushImm(MI->getOperand(1), imm_elem)) {
+  if (!getCmovCondition(*MI, cmov_type, reverse)) {
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  // the gadgets must not modify the flags before the cmov, nor afterwards
+  ROPChainBuilder builder(BA, scratchRegs, missingGadget, excludedGadgets);
 
-  builder.append(GadgetType::MOV, SCRATCH_2).append(imm_elem);
-  builder.append(GadgetType::COPY, SCRATCH_1, reg);
-  builder.append(GadgetType::SUB, SCRATCH_1, SCRATCH_2);
+  if (!reverse) {
+    //   cmov?? dst, src2
+    builder.append(cmov_type, dst, src2);
+  } else {
+    //   mov scratch, src2
+    //   cmov?? scratch, dst
+    //   mov dst, scratch
+    builder.append(GadgetType::COPY, SCRATCH_1, src2);
+    builder.append(cmov_type, SCRATCH_1, dst);
+    builder.append(GadgetType::COPY, dst, SCRATCH_1);
+  }
   builder.reorder();
   builder.normalInstrFlag = true;
 
   return builder.build(state, chain);
 }
 
-ROPChainStatus
-ROPEngine::handleCmp32rm(MachineInstr              *MI,
-                         std::vector<unsigned int> &scratchRegs) {
-  if (MI->getOperand(0).getReg() == X86::NoRegister) {
-    return ROPChainStatus::ERR_UNSUPPORTED;
+// isSetcc - returns true if MI is a SETcc writing a register
+static bool isSetcc(const MachineInstr &MI) {
+  switch (MI.getOpcode()) {
+#if LLVM_VERSION_MAJOR >= 9
+  case X86::SETCCr:
+#else
+  case X86::SETEr:
+  case X86::SETNEr:
+  case X86::SETBr:
+  case X86::SETAEr:
+#endif
+    return true;
+  default: return false;
   }
+}
 
-  // skip scaled-index addressing mode since we cannot handle them
-  //      xxx     orig_0, [orig_1 + scale_2 * orig_3 + disp_4]
-  if ((MI->getOperand(3).isReg() &&
-       MI->getOperand(3).getReg() != X86::NoRegister) ||
-      (MI->getOperand(5).isReg() &&
-       MI->getOperand(5).getReg() != X86::NoRegister)) {
-    return ROPChainStatus::ERR_UNSUPPORTED;
-  }
+ROPChainStatus ROPEngine::handleSetcc(MachineInstr              *MI,
+                                      std::vector<unsigned int> &scratchRegs) {
+  MachineBasicBlock  *MBB     = MI->getParent();
+  const X86Subtarget &STI     = MBB->getParent()->getSubtarget<X86Subtarget>();
+  bool                is64Bit = STI.is64Bit();
 
-  // extract operands
-  Register  dst = MI->getOperand(0).getReg();
-  Register  src = MI->getOperand(1).getReg(); // may be NoRegister
-  ChainElem disp_elem;
+  // the byte is merged into the register of the gadgets' size
+  Register dst8 = MI->getOperand(0).getReg();
+  Register dst  = getX86SubSuperRegisterOrZero(dst8, is64Bit ? 64 : 32);
 
-  if (!convertOperandToChainPushImm(MI->getOperand(4), disp_elem)) {
+  // only the low byte registers (e.g., al, not ah) can be merged
+  if (dst == X86::NoRegister || getX86SubSuperRegister(dst, 8) != dst8) {
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
-
-  builder.append(GadgetType::MOV, SCRATCH_1).append(disp_elem);
-  if (src != X86::NoRegister) {
-    builder.append(GadgetType::ADD, SCRATCH_1, src);
-  }
-  builder.append(GadgetType::LOAD_1, SCRATCH_1);
-  builder.append(GadgetType::COPY, SCRATCH_2, dst);
-  builder.append(GadgetType::SUB, SCRATCH_2, SCRATCH_1);
-  builder.reorder();
-  builder.normalInstrFlag = true;
-
-  return builder.build(state, chain);
-}
+  GadgetType cmov_type;
+  bool       reverse;
 
-ROPChainStatus ROPEngine::handleJmp1(MachineInstr              *MI,
-                                     std::vector<unsigned int> &scratchRegs) {
-  if (!MI->getOperand(0).isMBB()) {
+  if (!getCmovCondition(*MI, cmov_type, reverse)) {
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  chain.emplace_back(ChainElem::fromJmpTarget(MI->getOperand(0).getMBB()));
-  chain.hasUnconditionalJump = true;
-  chain.successor            = &chain.chain.back();
-
-  return ROPChainStatus::OK;
-}
-
-ROPChainStatus ROPEngine::handleJcc1(MachineInstr              *MI,
-                                     std::vector<unsigned int> &scratchRegs) {
-  // Jcc1 ROPification strategy:
-  //   pop reg1
-  //   ...target1...
-  //   pop reg2
-  //   ...target2...
-  //   cmov?? reg1, reg2
-  //   (xchg reg2)
-  //   jmp reg1  # xchg is not allowed
-
-  if (!MI->getOperand(0).isMBB()) {
+  // merging the byte into the register clobbers the flags, while setcc
+  // preserves them
+  const X86InstrInfo *TII = STI.getInstrInfo();
+  if (!TII->isSafeToClobberEFLAGS(*MBB, std::next(MI->getIterator()))) {
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  GadgetType cmov_type;
-  bool       reverse;
-
-#if LLVM_VERSION_MAJOR >= 9
-  switch (MI->getOperand(1).getImm()) {
-  case X86::COND_E:
-    cmov_type = GadgetType::CMOVE;
-    reverse   = false;
-    break;
-  case X86::COND_NE:
-    cmov_type = GadgetType::CMOVE;
-    reverse   = true;
-    break;
-  case X86::COND_B:
-    cmov_type = GadgetType::CMOVB;
-    reverse   = false;
-    break;
-  case X86::COND_AE:
-    cmov_type = GadgetType::CMOVB;
-    reverse   = true;
-    break;
-  default: return ROPChainStatus::ERR_UNSUPPORTED;
-  }
-#else
-  switch (MI->getOpcode()) {
-  case X86::JE_1:
-    cmov_type = GadgetType::CMOVE;
-    reverse   = false;
-    break;
-  case X86::JNE_1:
-    cmov_type = GadgetType::CMOVE;
-    reverse   = true;
-    break;
-  case X86::JB_1:
-    cmov_type = GadgetType::CMOVB;
-    reverse   = false;
-    break;
-  case X86::JAE_1:
-    cmov_type = GadgetType::CMOVB;
-    reverse   = true;
-    break;
-  default: return ROPChainStatus::ERR_UNSUPPORTED;
-  }
-#endif
+  // the upper bytes of dst may be dead before setcc (e.g., setcc; movzx), but
+  // they must not be used as scratch registers
+  std::vector<unsigned int> regs = excludeRegs(scratchRegs, {dst});
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  //   mov scratch1, 0 (1 if reversed)
+  //   mov scratch2, 1 (0 if reversed)
+  //   cmov?? scratch1, scratch2
+  //   mov scratch2, 0xffffff00   (sign-extended on x86-64)
+  //   and dst, scratch2
+  //   add dst, scratch1
+  ROPChainBuilder builder(BA, regs, missingGadget, excludedGadgets);
 
-  builder.append(GadgetType::MOV, reverse ? SCRATCH_1 : SCRATCH_2)
-      .append(ChainElem::fromJmpTarget(MI->getOperand(0).getMBB()));
-  builder.append(GadgetType::MOV, reverse ? SCRATCH_2 : SCRATCH_1)
-      .append(ChainElem::createJmpFallthrough());
+  builder.append(GadgetType::MOV, SCRATCH_1)
+      .append(ChainElem::fromImmediate(reverse ? 1 : 0));
+  builder.append(GadgetType::MOV, SCRATCH_2)
+      .append(ChainElem::fromImmediate(reverse ? 0 : 1));
   builder.append(cmov_type, SCRATCH_1, SCRATCH_2);
+  builder.append(GadgetType::MOV, SCRATCH_2)
+      .append(ChainElem::fromImmediate(~0xff));
+  builder.append(GadgetType::AND, dst, SCRATCH_2);
+  builder.append(GadgetType::ADD, dst, SCRATCH_1);
   builder.reorder();
-  builder.append(GadgetType::JMP, SCRATCH_1);
-  builder.conditionalJumpInstrFlag = true;
+  builder.normalInstrFlag = true;
 
   return builder.build(state, chain);
 }
@@ -914,7 +1560,7 @@ ROPChainStatus ROPEngine::handleCall(MachineInstr              *MI,
     return ROPChainStatus::ERR_UNSUPPORTED;
   }
 
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, missingGadget, excludedGadgets);
 
   builder.append(callee_elem);
   builder.append(ChainElem::createJmpFallthrough());
@@ -939,7 +1585,7 @@ ROPEngine::handleCallReg(MachineInstr              *MI,
   }
 
   Register        reg = MI->getOperand(0).getReg();
-  ROPChainBuilder builder(BA, scratchRegs);
+  ROPChainBuilder builder(BA, scratchRegs, missingGadget, excludedGadgets);
 
   builder.append(GadgetType::JMP, reg);
   builder.append(ChainElem::createJmpFallthrough());
@@ -948,20 +1594,128 @@ ROPEngine::handleCallReg(MachineInstr              *MI,
   return builder.build(state, chain);
 }
 
+ROPChainStatus
+ROPEngine::handleCallMem(MachineInstr              *MI,
+                         std::vector<unsigned int> &scratchRegs) {
+  // skip scaled-index addressing mode since we cannot handle them
+  //      call    [orig_0 + scale_1 * orig_2 + disp_3]
+  if (MI->getOperand(2).isReg() &&
+      MI->getOperand(2).getReg() != X86::NoRegister) {
+    return ROPChainStatus::ERR_UNSUPPORTED;
+  }
+  // instruction uses a segment register
+  if (MI->getOperand(4).isReg() &&
+      MI->getOperand(4).getReg() != X86::NoRegister) {
+    return ROPChainStatus::ERR_UNSUPPORTED;
+  }
+
+  Register              base = MI->getOperand(0).getReg(); // may be NoRegister
+  const MachineOperand &disp = MI->getOperand(3);
+
+  if (isStackPointer(base)) {
+    return ROPChainStatus::ERR_UNSUPPORTED;
+  }
+
+  ROPChainBuilder builder(BA, scratchRegs, missingGadget, excludedGadgets);
+
+  if (disp.isGlobal() && disp.getTargetFlags() == X86II::MO_GOT &&
+      disp.getOffset() == 0) {
+    // call [got + callee@GOT] (-fno-plt) jumps to the address stored in the
+    // GOT entry of the callee, i.e. it is a direct call:
+    //   pop reg1
+    //   [callee]
+    //   jmp reg1
+    //   [return addr]
+    builder.append(ChainElem::fromGlobal(disp.getGlobal(), 0));
+    builder.append(ChainElem::createJmpFallthrough());
+    builder.jumpInstrFlag = true;
+
+    ROPChainStatus rv = builder.build(state, chain);
+    if (rv == ROPChainStatus::OK) {
+      chain.callee = disp.getGlobal();
+    }
+    return rv;
+  }
+
+  //   mov scratch, disp
+  //   add scratch, base
+  //   mov scratch, [scratch]
+  //   jmp scratch
+  //   [return addr]
+  ChainElem disp_elem;
+
+  if (!convertOperandToChainPushImm(disp, disp_elem)) {
+    return ROPChainStatus::ERR_UNSUPPORTED;
+  }
+
+  builder.append(GadgetType::MOV, SCRATCH_1).append(disp_elem);
+  if (base != X86::NoRegister) {
+    builder.append(GadgetType::ADD, SCRATCH_1, base);
+  }
+  builder.append(GadgetType::LOAD_1, SCRATCH_1);
+  builder.reorder();
+  builder.append(GadgetType::JMP, SCRATCH_1);
+  builder.append(ChainElem::createJmpFallthrough());
+  builder.jumpInstrFlag = true;
+
+  return builder.build(state, chain);
+}
+
 ROPChainStatus ROPEngine::ropify(MachineInstr              &MI,
                                  std::vector<unsigned int> &scratchRegs,
                                  bool                       shouldFlagSaved,
                                  ROPChain                  &resultChain) {
-  if (MI.getOpcode() != X86::CALLpcrel32 && MI.getOpcode() != X86::CALL32r &&
-      MI.getOpcode() != X86::MOV32mr && MI.getOpcode() != X86::MOV32mi) {
+  missingGadget = MissingGadget();
+
+  switch (MI.getOpcode()) {
+  case X86::CALLpcrel32:
+  case X86::CALL32r:
+  case X86::CALL32m:
+  case X86::MOV32mr:
+  case X86::MOV32mi:
+  case X86::CALL64pcrel32:
+  case X86::CALL64r:
+  case X86::CALL64m:
+  case X86::MOV64mr:
+  case X86::MOV64mi32: break;
+  default:
     // if ESP is one of the operands of MI -> abort
     for (unsigned int i = 0; i < MI.getNumOperands(); i++) {
-      if (MI.getOperand(i).isReg() && MI.getOperand(i).getReg() == X86::ESP) {
+      if (MI.getOperand(i).isReg() &&
+          isStackPointer(MI.getOperand(i).getReg())) {
         return ROPChainStatus::ERR_UNSUPPORTED_STACKPOINTER;
       }
     }
   }
 
+  if (MI.getParent()->getParent()->getSubtarget<X86Subtarget>().is64Bit()) {
+    for (unsigned int i = 0; i < MI.getNumExplicitOperands(); i++) {
+      const MachineOperand &operand = MI.getOperand(i);
+
+      if (!operand.isReg() || operand.getReg() == X86::NoRegister) {
+        continue;
+      }
+
+      // the byte written by setcc is merged into its 64-bit register (see
+      // handleSetcc())
+      if (i == 0 && isSetcc(MI)) {
+        continue;
+      }
+
+      // RIP-relative addressing cannot be moved into a chain
+      if (operand.getReg() == X86::RIP) {
+        return ROPChainStatus::ERR_UNSUPPORTED;
+      }
+
+      // gadgets work on 64-bit registers only, while operations on
+      // sub-registers (e.g., mov eax, ecx zero-extends into rax) are left as
+      // they are
+      if (!X86::GR64RegClass.contains(operand.getReg())) {
+        return ROPChainStatus::ERR_NOT_IMPLEMENTED;
+      }
+    }
+  }
+
   DEBUG_WITH_TYPE(LIVENESS_ANALYSIS,
                   dbg_fmt("[LivenessAnalysis] Available scratch registers:\t"));
   for (auto &reg : scratchRegs) {
@@ -981,7 +1735,15 @@ ROPChainStatus ROPEngine::ropify(MachineInstr              &MI,
   case X86::AND32ri8:
   case X86::AND32ri:
   case X86::INC32r:
-  case X86::DEC32r: {
+  case X86::DEC32r:
+  case X86::ADD64ri8:
+  case X86::ADD64ri32:
+  case X86::SUB64ri8:
+  case X86::SUB64ri32:
+  case X86::AND64ri8:
+  case X86::AND64ri32:
+  case X86::INC64r:
+  case X86::DEC64r: {
     status   = handleArithmeticRI(&MI, scratchRegs);
     flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
     break;
@@ -990,61 +1752,44 @@ ROPChainStatus ROPEngine::ropify(MachineInstr              &MI,
   case X86::SUB32rr:
   case X86::AND32rr:
   case X86::ADD32rr_DB:
+  case X86::ADD64rr:
+  case X86::SUB64rr:
+  case X86::AND64rr:
+  case X86::ADD64rr_DB:
     status   = handleArithmeticRR(&MI, scratchRegs);
     flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
     break;
-  case X86::ADD32rm:
-  case X86::SUB32rm:
-  case X86::AND32rm:
-    status   = handleArithmeticRM(&MI, scratchRegs);
+  case X86::IMUL32rr:
+  case X86::IMUL32rri:
+  case X86::IMUL32rri8:
+  case X86::IMUL32rm:
+  case X86::IMUL64rr:
+  case X86::IMUL64rri8:
+  case X86::IMUL64rri32:
+  case X86::IMUL64rm:
+    status   = handleImul(&MI, scratchRegs);
     flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
     break;
   case X86::XOR32rr:
+  case X86::XOR64rr:
     status   = handleXor32RR(&MI, scratchRegs);
     flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
     break;
-  case X86::CMP32mi:
-  case X86::CMP32mi8:
-    status   = handleCmp32mi(&MI, scratchRegs);
-    flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
-    break;
-  case X86::CMP32rr:
-    status   = handleCmp32rr(&MI, scratchRegs);
-    flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
-    break;
-  case X86::CMP32ri:
-  case X86::CMP32ri8:
-    status   = handleCmp32ri(&MI, scratchRegs);
-    flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
-    break;
-  case X86::CMP32rm:
-    status   = handleCmp32rm(&MI, scratchRegs);
-    flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
-    break;
   case X86::LEA32r:
+  case X86::LEA64r:
     status   = handleLea32r(&MI, scratchRegs);
     flagSave = FlagSaveMode::SAVE_AFTER_EXEC;
     break;
-  case X86::MOV32rm:
-    status   = handleMov32rm(&MI, scratchRegs);
-    flagSave = FlagSaveMode::SAVE_AFTER_EXEC;
-    break;
   case X86::MOV32mr:
+  case X86::MOV64mr:
     status   = handleMov32mr(&MI, scratchRegs);
     flagSave = FlagSaveMode::SAVE_AFTER_EXEC;
     break;
   case X86::MOV32mi:
+  case X86::MOV64mi32:
     status   = handleMov32mi(&MI, scratchRegs);
     flagSave = FlagSaveMode::SAVE_AFTER_EXEC;
     break;
-  case X86::MOV32rr:
-    status   = handleMov32rr(&MI, scratchRegs);
-    flagSave = FlagSaveMode::SAVE_AFTER_EXEC;
-    break;
-  case X86::MOV32ri:
-    status   = handleMov32ri(&MI, scratchRegs);
-    flagSave = FlagSaveMode::SAVE_AFTER_EXEC;
-    break;
   case X86::JMP_1:
     status   = handleJmp1(&MI, scratchRegs);
     flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
@@ -1060,15 +1805,52 @@ ROPChainStatus ROPEngine::ropify(MachineInstr              &MI,
     status   = handleJcc1(&MI, scratchRegs);
     flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
     break;
+#if LLVM_VERSION_MAJOR >= 9
+  case X86::CMOV32rr:
+  case X86::CMOV64rr:
+#else
+  case X86::CMOVE32rr:
+  case X86::CMOVNE32rr:
+  case X86::CMOVB32rr:
+  case X86::CMOVAE32rr:
+  case X86::CMOVE64rr:
+  case X86::CMOVNE64rr:
+  case X86::CMOVB64rr:
+  case X86::CMOVAE64rr:
+#endif
+    status   = handleCmov32rr(&MI, scratchRegs);
+    flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
+    break;
+#if LLVM_VERSION_MAJOR >= 9
+  case X86::SETCCr:
+#else
+  case X86::SETEr:
+  case X86::SETNEr:
+  case X86::SETBr:
+  case X86::SETAEr:
+#endif
+    status   = handleSetcc(&MI, scratchRegs);
+    flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
+    break;
   case X86::CALLpcrel32:
+  case X86::CALL64pcrel32:
     status   = handleCall(&MI, scratchRegs);
     flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
     break;
   case X86::CALL32r:
+  case X86::CALL64r:
     status   = handleCallReg(&MI, scratchRegs);
     flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
     break;
-  default: return ROPChainStatus::ERR_NOT_IMPLEMENTED;
+  case X86::CALL32m:
+  case X86::CALL64m:
+    status   = handleCallMem(&MI, scratchRegs);
+    flagSave = FlagSaveMode::SAVE_BEFORE_EXEC;
+    break;
+  default:
+    // instructions described by the recipe table
+    status = handleRecipe(&MI, scratchRegs, flagSave);
+    break;
   }
 
   if (status == ROPChainStatus::OK) {
@@ -1081,31 +1863,21 @@ ROPChainStatus ROPEngine::ropify(MachineInstr              &MI,
 }
 
 void ROPChain::removeDuplicates() {
-  bool duplicates;
+  // chain[0, top) is the stack of the retained elements
+  size_t top = 0;
 
-  do {
-    duplicates = false;
-
-    if (chain.size() < 2) {
-      break;
+  for (size_t i = 0; i < chain.size(); i++) {
+    if (top > 0 && isCancellingPair(chain[top - 1], chain[i])) {
+      top--;
+      continue;
     }
-
-    for (auto it = chain.begin() + 1; it != chain.end();) {
-      // equal microgadgets, but only if they're both XCHG instructions
-      if (*it == *(it - 1) && it->type == ChainElem::Type::GADGET &&
-          it->microgadget->Type == GadgetType::XCHG) {
-        it         = chain.erase(it - 1);
-        it         = chain.erase(it);
-        duplicates = true;
-      }
-
-      if (it != chain.end()) {
-        ++it;
-      } else {
-        break;
-      }
+    if ((int)i == successor) {
+      successor = top;
     }
-  } while (duplicates);
+    chain[top++] = chain[i];
+  }
+
+  chain.resize(top);
 }
 
 } // namespace ropf
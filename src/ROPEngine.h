@@ -16,6 +16,7 @@
 #include "LivenessAnalysis.h"
 #include "XchgGraph.h"
 #include "llvm/CodeGen/MachineInstr.h"
+#include <set>
 #include <string>
 #include <tuple>
 #include <vector>
@@ -30,7 +31,9 @@ enum class FlagSaveMode { NOT_SAVED, SAVE_BEFORE_EXEC, SAVE_AFTER_EXEC };
 class ROPChain {
 public:
   std::vector<ChainElem> chain;
-  ChainElem             *successor; // jump target at the end of chain
+  // successor - index of the jump target at the end of chain, or -1.
+  // (an index stays valid when the chain is copied or reallocated)
+  int                    successor;
   FlagSaveMode           flagSave;
   bool hasNormalInstr, hasConditionalJump, hasUnconditionalJump;
   // call target information, if this chain calls other function
@@ -60,7 +63,7 @@ public:
 
   void emplace_back(const ChainElem &elem) { chain.emplace_back(elem); }
 
-  bool valid() { return !chain.empty() || successor; }
+  bool valid() { return !chain.empty() || successor >= 0; }
 
   ROPChain &append(const ROPChain &other) {
     chain.insert(chain.end(), other.begin(), other.end());
@@ -69,11 +72,14 @@ public:
 
   bool canMerge(const ROPChain &other);
 
+  // merge - appends the other chain. Both chains must be free of duplicates
+  // (see removeDuplicates()): xchg gadgets cancelling each other across the
+  // boundary are removed while appending, in time linear in other.size().
   void merge(const ROPChain &other);
 
   void clear() {
     chain.clear();
-    successor            = nullptr;
+    successor            = -1;
     flagSave             = FlagSaveMode::NOT_SAVED;
     hasNormalInstr       = false;
     hasConditionalJump   = false;
@@ -81,9 +87,10 @@ public:
     callee               = nullptr;
   }
 
-  // Reiteratively removes adjacent pairs of equal xchg gadgets to reduce the
-  // chain size. Indeed, two consecutive equal xchg gadgets undo each other's
-  // effects.
+  // Removes adjacent pairs of equal xchg gadgets to reduce the chain size.
+  // Indeed, two consecutive equal xchg gadgets undo each other's effects.
+  // Pairs which become adjacent after a removal are removed as well: the chain
+  // is scanned once, keeping the retained elements as a stack.
   void removeDuplicates();
 
   ROPChain() { clear(); }
@@ -101,57 +108,77 @@ enum class ROPChainStatus {
   COUNT
 };
 
+// getStatusName - short description of the status (for diagnostics)
+const char *getStatusName(ROPChainStatus status);
+
+// Gadget primitive which could not be found, when the chain cannot be built
+// because of ERR_NO_GADGETS_AVAILABLE.
+struct MissingGadget {
+  GadgetType   type = GadgetType::UNDEFINED;
+  unsigned int reg1 = 0, reg2 = 0;
+};
+
 // Keeps track of all the instructions to be replaced with the obfuscated
 // ones. Handles the injection of auxiliary machine code to guarantee the
 // correct chain execution and to resume the non-obfuscated code execution
 // afterwards.
 class ROPEngine {
-  ROPChain             chain;
-  XchgState            state;
-  const BinaryAutopsy &BA;
+  ROPChain                             chain;
+  XchgState                            state;
+  const BinaryAutopsy                 &BA;
+  // last id of the ESP_PUSH elements (see ChainElem::createStackPointerPush())
+  int                                 &lastEspId;
+  // gadgets which must not be used, or nullptr
+  const std::set<const Microgadget *> *excludedGadgets;
 
   ROPChainStatus handleArithmeticRI(llvm::MachineInstr *,
                                     std::vector<unsigned int> &scratchRegs);
   ROPChainStatus handleArithmeticRR(llvm::MachineInstr *,
                                     std::vector<unsigned int> &scratchRegs);
-  ROPChainStatus handleArithmeticRM(llvm::MachineInstr *,
-                                    std::vector<unsigned int> &scratchRegs);
+  ROPChainStatus handleImul(llvm::MachineInstr *,
+                            std::vector<unsigned int> &scratchRegs);
   ROPChainStatus handleXor32RR(llvm::MachineInstr *,
                                std::vector<unsigned int> &scratchRegs);
   ROPChainStatus handleLea32r(llvm::MachineInstr *,
                               std::vector<unsigned int> &scratchRegs);
-  ROPChainStatus handleMov32rm(llvm::MachineInstr *,
-                               std::vector<unsigned int> &scratchRegs);
   ROPChainStatus handleMov32mr(llvm::MachineInstr *,
                                std::vector<unsigned int> &scratchRegs);
   ROPChainStatus handleMov32mi(llvm::MachineInstr *,
                                std::vector<unsigned int> &scratchRegs);
-  ROPChainStatus handleMov32rr(llvm::MachineInstr *,
-                               std::vector<unsigned int> &scratchRegs);
-  ROPChainStatus handleMov32ri(llvm::MachineInstr *,
-                               std::vector<unsigned int> &scratchRegs);
-  ROPChainStatus handleCmp32mi(llvm::MachineInstr *,
-                               std::vector<unsigned int> &scratchRegs);
-  ROPChainStatus handleCmp32rr(llvm::MachineInstr *,
-                               std::vector<unsigned int> &scratchRegs);
-  ROPChainStatus handleCmp32ri(llvm::MachineInstr *,
-                               std::vector<unsigned int> &scratchRegs);
-  ROPChainStatus handleCmp32rm(llvm::MachineInstr *,
-                               std::vector<unsigned int> &scratchRegs);
   ROPChainStatus handleJmp1(llvm::MachineInstr *,
                             std::vector<unsigned int> &scratchRegs);
   ROPChainStatus handleJcc1(llvm::MachineInstr *,
                             std::vector<unsigned int> &scratchRegs);
+  ROPChainStatus handleCmov32rr(llvm::MachineInstr *,
+                                std::vector<unsigned int> &scratchRegs);
+  ROPChainStatus handleSetcc(llvm::MachineInstr *,
+                             std::vector<unsigned int> &scratchRegs);
   ROPChainStatus handleCall(llvm::MachineInstr *,
                             std::vector<unsigned int> &scratchRegs);
   ROPChainStatus handleCallReg(llvm::MachineInstr *,
                                std::vector<unsigned int> &scratchRegs);
+  ROPChainStatus handleCallMem(llvm::MachineInstr *,
+                               std::vector<unsigned int> &scratchRegs);
+  // handleRecipe - lowers the instructions of the recipe table, setting the
+  // flag save mode of the chain
+  ROPChainStatus handleRecipe(llvm::MachineInstr *,
+                              std::vector<unsigned int> &scratchRegs,
+                              FlagSaveMode              &flagSave);
   bool convertOperandToChainPushImm(const llvm::MachineOperand &operand,
                                     ChainElem                  &result);
 
 public:
-  // Constructor
-  ROPEngine(const BinaryAutopsy &BA);
+  // set by ropify() if no gadget is available
+  MissingGadget missingGadget;
+
+  // Constructor. lastEspId is shared by the engines building chains which
+  // may be merged, e.g. the ones of the same basic block. The
+  // excludedGadgets (e.g., the gadgets of a static archive which the module
+  // cannot reference) are skipped when the gadgets are selected; a chain
+  // uses one of them only for an exchange with no other gadget.
+  ROPEngine(const BinaryAutopsy                 &BA,
+            int                                 &lastEspId,
+            const std::set<const Microgadget *> *excludedGadgets = nullptr);
 
   ROPChainStatus ropify(llvm::MachineInstr        &MI,
                         std::vector<unsigned int> &scratchRegs,
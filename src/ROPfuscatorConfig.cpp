@@ -135,6 +135,12 @@ void parseFunctionOptions(const toml::Value    &config,
               CONFIG_OPAQUE_GADGET_ADDRESSES_ENABLED,
               funcParam.opaqueGadgetAddressesEnabled);
 
+  // Instruction hiding enabled
+  parseOption(config,
+              tomlSect,
+              CONFIG_OPAQUE_STEGANO_ENABLED,
+              funcParam.opaqueSteganoEnabled);
+
   /* =========================
    * STRINGS PARSING
    */
@@ -224,6 +230,21 @@ void parseFunctionOptions(const toml::Value    &config,
       funcParam.opaqueBranchTargetsPercentage = branches_obfuscation_percentage;
     }
   }
+
+  // hidden instructions percentage
+  int stegano_percentage;
+  if (parseOption(config,
+                  tomlSect,
+                  CONFIG_OPAQUE_STEGANO_PERCENTAGE,
+                  stegano_percentage)) {
+    if (stegano_percentage < 0 || stegano_percentage > 100) {
+      dbg_fmt("Ignoring instruction hiding percentage \"{}\". It should be a "
+              "value between 0 and 100. Ignoring.",
+              stegano_percentage);
+    } else {
+      funcParam.opaqueSteganoPercentage = stegano_percentage;
+    }
+  }
 }
 
 } // namespace
@@ -246,6 +267,33 @@ ROPfuscatorConfig::getParameter(const std::string &funcname) const {
   return defaultParameter;
 }
 
+bool ROPfuscatorConfig::getPreset(const std::string    &name,
+                                  ObfuscationParameter &param) const {
+  auto it = presetsParameter.find(name);
+  if (it != presetsParameter.end()) {
+    param = it->second;
+    return true;
+  }
+
+  if (name == CONFIG_PRESET_OFF) {
+    param                    = ObfuscationParameter();
+    param.obfuscationEnabled = false;
+  } else if (name == CONFIG_PRESET_LIGHT) {
+    // ROP transformation only
+    param = ObfuscationParameter();
+  } else if (name == CONFIG_PRESET_HEAVY) {
+    param                          = ObfuscationParameter();
+    param.opaquePredicatesEnabled  = true;
+    param.opaqueConstantsAlgorithm = OPAQUE_CONSTANT_ALGORITHM_MULTCOMP;
+    param.opaqueSteganoEnabled     = true;
+    param.opaqueSteganoPercentage  = 10;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
 void ROPfuscatorConfig::loadFromFile(const std::string &filename) {
   dbg_fmt("[*] Loading obfuscation configuration \"{}\".\n", filename);
 
@@ -262,6 +310,7 @@ void ROPfuscatorConfig::loadFromFile(const std::string &filename) {
   // setting default values
   globalConfig     = GlobalConfig();
   defaultParameter = ObfuscationParameter();
+  presetsParameter.clear();
 
   // =====================================
   // parsing [general] section, if present
@@ -333,6 +382,75 @@ void ROPfuscatorConfig::loadFromFile(const std::string &filename) {
                 CONFIG_GENERAL_SECTION,
                 CONFIG_WRITE_INSTR_STAT,
                 globalConfig.writeInstrStat);
+
+    // Verify chains with the offline interpreter
+    parseOption(*general_section,
+                CONFIG_GENERAL_SECTION,
+                CONFIG_VERIFY_CHAINS,
+                globalConfig.verifyChains);
+
+    // Chain profiling output
+    parseOption(*general_section,
+                CONFIG_GENERAL_SECTION,
+                CONFIG_CHAIN_PROFILE,
+                globalConfig.chainProfileOutput);
+
+    // Compile-time budgets
+    parseOption(*general_section,
+                CONFIG_GENERAL_SECTION,
+                CONFIG_MODULE_TIME_BUDGET,
+                globalConfig.moduleTimeBudget);
+    parseOption(*general_section,
+                CONFIG_GENERAL_SECTION,
+                CONFIG_FUNC_TIME_BUDGET,
+                globalConfig.functionTimeBudget);
+
+    // Opaque construct generation threads
+    parseOption(*general_section,
+                CONFIG_GENERAL_SECTION,
+                CONFIG_OPAQUE_THREADS,
+                globalConfig.opaqueThreads);
+
+    // Position-independent chains
+    parseOption(*general_section,
+                CONFIG_GENERAL_SECTION,
+                CONFIG_PIC_CHAINS,
+                globalConfig.positionIndependentChains);
+
+    // Placement of the chain setup code
+    std::string placement;
+    if (parseOption(*general_section,
+                    CONFIG_GENERAL_SECTION,
+                    CONFIG_CHAIN_SETUP,
+                    placement)) {
+      placement = strTolower(placement);
+      if (placement != CHAIN_SETUP_INLINE &&
+          placement != CHAIN_SETUP_OUTLINED && placement != CHAIN_SETUP_COLD) {
+        dbg_fmt("Warning: cannot understand \"{}\" as a chain setup "
+                "placement. Placement configuration is ignored.\n",
+                placement);
+      } else {
+        globalConfig.chainSetupPlacement = placement;
+      }
+    }
+
+    // Maximum chain length
+    parseOption(*general_section,
+                CONFIG_GENERAL_SECTION,
+                CONFIG_MAX_CHAIN_LENGTH,
+                globalConfig.maxChainLength);
+
+    // Chain bundles
+    parseOption(*general_section,
+                CONFIG_GENERAL_SECTION,
+                CONFIG_BUNDLE_CHAINS,
+                globalConfig.bundleChains);
+
+    // Library analyses kept in memory
+    parseOption(*general_section,
+                CONFIG_GENERAL_SECTION,
+                CONFIG_ANALYSIS_CACHE_SIZE,
+                globalConfig.analysisCacheSize);
   }
 
   // =====================================
@@ -393,6 +511,29 @@ void ROPfuscatorConfig::loadFromFile(const std::string &filename) {
     }
   }
   // =====================================
+
+  // =====================================
+  // parsing [presets.*] sections, if present
+  if (auto *presets_section = configuration_data.find(CONFIG_PRESETS_SECTION)) {
+
+    if (!presets_section->is<toml::Table>()) {
+      // error
+      dbg_fmt("[presets] should be a section.\n");
+      exit(-1);
+    }
+
+    for (auto &kv : presets_section->as<toml::Table>()) {
+      std::string sectname = CONFIG_PRESETS_SECTION "." + kv.first;
+
+      DEBUG_WITH_TYPE(OBF_CONFIG, dbg_fmt("Parsing: [{}]\n", sectname));
+
+      ObfuscationParameter preset_parameter;
+      parseFunctionOptions(kv.second, sectname, preset_parameter);
+
+      presetsParameter[kv.first] = preset_parameter;
+    }
+  }
+  // =====================================
 }
 
 } // namespace ropf
@@ -15,6 +15,18 @@ namespace ropf {
 #define CONFIG_GENERAL_SECTION   "general"
 #define CONFIG_FUNCTIONS_SECTION "functions"
 #define CONFIG_FUNCTIONS_DEFAULT "default"
+#define CONFIG_PRESETS_SECTION   "presets"
+
+// built-in presets, which can be redefined in [presets.*]
+#define CONFIG_PRESET_OFF   "off"
+#define CONFIG_PRESET_LIGHT "light"
+#define CONFIG_PRESET_HEAVY "heavy"
+
+// prefix of the source-level annotations selecting a preset, e.g.
+// __attribute__((annotate("ropfuscator:heavy"))) (see include/ropfuscator.h)
+#define ANNOTATION_PREFIX "ropfuscator:"
+// region marker restoring the parameter of the function
+#define ANNOTATION_REGION_END "end"
 
 // =========================
 // General configuration options
@@ -31,6 +43,21 @@ namespace ropf {
 #define CONFIG_USE_CHAIN_LABEL     "use_chain_label"
 #define CONFIG_RNG_SEED            "rng_seed"
 #define CONFIG_WRITE_INSTR_STAT    "write_instr_stat"
+#define CONFIG_VERIFY_CHAINS       "verify_chains"
+#define CONFIG_CHAIN_PROFILE       "chain_profile_output"
+#define CONFIG_MODULE_TIME_BUDGET  "module_time_budget"
+#define CONFIG_FUNC_TIME_BUDGET    "function_time_budget"
+#define CONFIG_OPAQUE_THREADS      "opaque_threads"
+#define CONFIG_PIC_CHAINS          "position_independent_chains"
+#define CONFIG_CHAIN_SETUP         "chain_setup_placement"
+#define CONFIG_MAX_CHAIN_LENGTH    "max_chain_length"
+#define CONFIG_BUNDLE_CHAINS       "bundle_chains"
+#define CONFIG_ANALYSIS_CACHE_SIZE "analysis_cache_size"
+
+// placements of the code building the chains
+#define CHAIN_SETUP_INLINE   "inline"
+#define CHAIN_SETUP_OUTLINED "outlined"
+#define CHAIN_SETUP_COLD     "cold"
 
 // =========================
 // Functions-specific options
@@ -65,6 +92,10 @@ namespace ropf {
 // opaque stack values
 #define CONFIG_OPAQUE_STACK_VALUES_ENABLED "opaque_saved_stack_values_enabled"
 
+// instruction hiding
+#define CONFIG_OPAQUE_STEGANO_ENABLED    "opaque_stegano_enabled"
+#define CONFIG_OPAQUE_STEGANO_PERCENTAGE "opaque_stegano_percentage"
+
 //===========================
 
 /// obfuscation configuration parameter for each function
@@ -95,6 +126,11 @@ struct ObfuscationParameter {
   std::string  opaqueConstantsAlgorithm;
   /// opaque predicate input generation algorithm for this function
   std::string  opaqueInputGenAlgorithm;
+  /// true if native instructions may be hidden in the code building the
+  /// following chain (only effective if opaquePredicatesEnabled == true)
+  bool         opaqueSteganoEnabled;
+  /// percentage of ropfuscable instructions to leave native and hide
+  unsigned int opaqueSteganoPercentage;
 
   ObfuscationParameter()
       : obfuscationEnabled(true), opaquePredicatesEnabled(false),
@@ -105,7 +141,8 @@ struct ObfuscationParameter {
         opaqueSavedStackValuesEnabled(true), opaqueGadgetAddressesEnabled(true),
         gadgetAddressesObfuscationPercentage(100),
         opaqueConstantsAlgorithm(OPAQUE_CONSTANT_ALGORITHM_MOV),
-        opaqueInputGenAlgorithm(OPAQUE_RANDOM_ALGORITHM_ADDREG) {}
+        opaqueInputGenAlgorithm(OPAQUE_RANDOM_ALGORITHM_ADDREG),
+        opaqueSteganoEnabled(false), opaqueSteganoPercentage(0) {}
 };
 
 /// obfuscation configuration for the entire compilation unit
@@ -137,22 +174,67 @@ struct GlobalConfig {
   size_t                   rng_seed;
   // if enabled, write instruction obfuscation statistics to file
   bool                     writeInstrStat;
+  // if enabled, each chain is executed offline and checked against the
+  // instruction it replaces (see ChainInterpreter.h)
+  bool                     verifyChains;
+  // if set, obfuscated programs count the executions of each chain and write
+  // them to this file at exit (see ChainProfiler.h)
+  std::string              chainProfileOutput;
+  // compile-time budgets (in seconds, 0 if unlimited) for the whole module and
+  // for each function. The functions whose estimated compile time exceeds a
+  // budget are obfuscated with cheaper algorithms (the estimate is static, so
+  // the output does not depend on the machine).
+  int                      moduleTimeBudget;
+  int                      functionTimeBudget;
+  // number of threads planning the chains of the basic blocks and generating
+  // the opaque constructs (0: one per core, 1: no worker threads)
+  int                      opaqueThreads;
+  // if enabled, the addresses pushed by the chains are computed from the GOT
+  // (x86-32) or from RIP (x86-64), so that the code needs no text relocations
+  bool                     positionIndependentChains;
+  // placement of the code building the chains: in place of the obfuscated
+  // instructions ("inline"), at the end of the function ("outlined") or in
+  // the .text.unlikely section ("cold"), reached through a jmp
+  std::string              chainSetupPlacement;
+  // maximum number of elements of a merged chain (0 if unlimited). Longer
+  // chains are split, preferring the boundaries where few registers are live.
+  int                      maxChainLength;
+  // if enabled, the code of each chain is bundled: the few passes following
+  // ROPfuscator which iterate over bundles step over a chain at once. Each
+  // instruction is still allocated, and the passes iterating over single
+  // instructions (e.g., the machine verifier) still visit it. The bundles
+  // are expanded by the AsmPrinter (see patches/ropfuscator_pass.patch).
+  bool                     bundleChains;
+  // [BinaryAutopsy] number of library analyses kept in memory when no module
+  // uses them, so that the following modules compiled by the same process
+  // (e.g., with LTO) do not analyse the library again
+  int                      analysisCacheSize;
 
   GlobalConfig()
       : libraryPath(), librarySHA1(), linkedLibraries(),
         obfuscationEnabled(true), searchSegmentForGadget(true),
         avoidMultiversionSymbol(false), showProgress(false),
         printInstrStat(false), useChainLabel(false), rng_seed(0),
-        writeInstrStat(false) {}
+        writeInstrStat(false), verifyChains(false), chainProfileOutput(),
+        moduleTimeBudget(0), functionTimeBudget(0), opaqueThreads(0),
+        positionIndependentChains(false),
+        chainSetupPlacement(CHAIN_SETUP_INLINE), maxChainLength(0),
+        bundleChains(false), analysisCacheSize(2) {}
 };
 
 struct ROPfuscatorConfig {
   ObfuscationParameter                        defaultParameter;
   GlobalConfig                                globalConfig;
   std::map<std::string, ObfuscationParameter> functionsParameter;
+  // presets selected by source-level annotations
+  std::map<std::string, ObfuscationParameter> presetsParameter;
 
   ObfuscationParameter getParameter(const std::string &funcname) const;
 
+  // getPreset - looks up the preset (defined in [presets.*], or built-in).
+  // Returns false if the preset does not exist.
+  bool getPreset(const std::string &name, ObfuscationParameter &param) const;
+
   void loadFromFile(const std::string &filename);
 };
 
@@ -8,8 +8,11 @@
 
 #include "ROPfuscatorCore.h"
 #include "BinAutopsy.h"
+#include "ChainInterpreter.h"
+#include "ChainProfiler.h"
 #include "Debug.h"
 #include "LivenessAnalysis.h"
+#include "MCTargetDesc/X86BaseInfo.h"
 #include "MathUtil.h"
 #include "OpaqueConstruct.h"
 #include "ROPEngine.h"
@@ -23,9 +26,16 @@
 #include "X86TargetMachine.h"
 #include "llvm/CodeGen/MachineFunction.h"
 #include "llvm/CodeGen/MachineInstr.h"
+#include "llvm/CodeGen/MachineInstrBundle.h"
+#include "llvm/CodeGen/MachineOptimizationRemarkEmitter.h"
+#include "llvm/IR/Comdat.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Module.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include <cmath>
 #include <fstream>
@@ -111,10 +121,41 @@ namespace {
 // base class
 struct ROPChainPushInst {
   std::shared_ptr<OpaqueConstruct> opaqueConstant;
-  virtual void compile(X86AssembleHelper &, StackState &) = 0;
-  virtual ~ROPChainPushInst()                             = default;
+  // compile - x86-32 lowering. Addresses are computed from stack.pic_base,
+  // if set, rather than relocated in the code.
+  virtual void compile(X86AssembleHelper &, StackState &)   = 0;
+  // compile64 - x86-64 lowering (opaque constructs are not supported)
+  virtual void compile64(X86AssembleHelper &, StackState &) = 0;
+  virtual ~ROPChainPushInst()                               = default;
 };
 
+// pushes a 64-bit value, computed in rax by compute(), without clobbering
+// registers and flags:
+//   lea rsp, [rsp-8]
+//   push rax
+//   compute()   (e.g., movabs rax, value)
+//   mov [rsp+8], rax
+//   pop rax
+// (xchg [rsp], rax would be shorter, but it implicitly locks the bus)
+template <typename F> void pushComputed64(X86AssembleHelper &as, F compute) {
+  as.lea64(as.reg(X86::RSP), as.mem(X86::RSP, -8));
+  as.push64(as.reg(X86::RAX));
+  compute();
+  as.mov64(as.mem(X86::RSP, 8), as.reg(X86::RAX));
+  as.pop64(as.reg(X86::RAX));
+}
+
+// pushes a 64-bit value, which cannot be encoded as immediate operand of push
+template <typename T> void pushValue64(X86AssembleHelper &as, T value) {
+  pushComputed64(as, [&]() { as.mov64(as.reg(X86::RAX), value); });
+}
+
+// isLocal - true if the global is resolved at link time, i.e. its address
+// can be computed relative to the code rather than loaded from the GOT
+bool isLocal(const llvm::GlobalValue *gv) {
+  return gv->isDSOLocal() || gv->hasLocalLinkage();
+}
+
 // immediate (immediate operand, etc)
 struct PUSH_IMM : public ROPChainPushInst {
   int64_t value;
@@ -136,6 +177,14 @@ struct PUSH_IMM : public ROPChainPushInst {
       as.push(as.imm(value));
     }
   }
+  virtual void compile64(X86AssembleHelper &as, StackState &) override {
+    if (isInt<32>(value)) {
+      // push $imm (sign-extended)
+      as.push64(as.imm(value));
+    } else {
+      pushValue64(as, as.imm(value));
+    }
+  }
   virtual ~PUSH_IMM() = default;
 };
 
@@ -146,6 +195,8 @@ struct PUSH_GV : public ROPChainPushInst {
   PUSH_GV(const llvm::GlobalValue *gv, int64_t offset)
       : gv(gv), offset(offset) {}
   virtual void compile(X86AssembleHelper &as, StackState &stack) override {
+    unsigned int got = stack.pic_base;
+
     if (opaqueConstant) {
       uint32_t opaque =
           *opaqueConstant->getOutput().findValue(OpaqueStorage::EAX);
@@ -154,12 +205,49 @@ struct PUSH_GV : public ROPChainPushInst {
 
       // adjust eax to be the constant
       uint32_t diff = offset - opaque;
-      as.add(as.reg(X86::EAX), as.imm(gv, diff));
+      if (!got) {
+        as.add(as.reg(X86::EAX), as.imm(gv, diff));
+      } else if (isLocal(gv)) {
+        // add eax, got; add eax, global@GOTOFF+diff
+        as.add(as.reg(X86::EAX), as.reg(got));
+        as.add(as.reg(X86::EAX), as.gotoff(gv, diff));
+      } else {
+        // add eax, [got + global@GOT]; add eax, diff
+        as.add(as.reg(X86::EAX), as.mem(got, gv, 0, X86II::MO_GOT));
+        as.add(as.reg(X86::EAX), as.imm(diff));
+      }
       // push eax
       as.push(as.reg(X86::EAX));
-    } else {
+    } else if (!got) {
       // push global_symbol
       as.push(as.imm(gv, offset));
+    } else if (isLocal(gv)) {
+      // push got; add [esp], global@GOTOFF+offset
+      as.push(as.reg(got));
+      as.add(as.mem(X86::ESP), as.gotoff(gv, offset));
+    } else {
+      // push [got + global@GOT]; add [esp], offset
+      as.push(as.mem(got, gv, 0, X86II::MO_GOT));
+      if (offset) {
+        as.add(as.mem(X86::ESP), as.imm(offset));
+      }
+    }
+  }
+  virtual void compile64(X86AssembleHelper &as, StackState &stack) override {
+    if (!stack.pic_base) {
+      pushValue64(as, as.imm(gv, offset));
+    } else if (isLocal(gv)) {
+      // lea rax, [rip + global+offset]
+      pushComputed64(as, [&]() {
+        as.lea64(as.reg(X86::RAX), as.mem(X86::RIP, gv, offset));
+      });
+    } else {
+      // mov rax, [rip + global@GOTPCREL]; lea rax, [rax+offset]
+      pushComputed64(as, [&]() {
+        as.mov64(as.reg(X86::RAX),
+                 as.mem(X86::RIP, gv, 0, X86II::MO_GOTPCREL));
+        as.lea64(as.reg(X86::RAX), as.mem(X86::RAX, offset));
+      });
     }
   }
   virtual ~PUSH_GV() = default;
@@ -169,24 +257,73 @@ struct PUSH_GV : public ROPChainPushInst {
 struct PUSH_GADGET : public ROPChainPushInst {
   const Symbol *anchor;
   uint32_t      offset;
-  explicit PUSH_GADGET(const Symbol *anchor, uint32_t offset)
-      : anchor(anchor), offset(offset) {}
+  // local - the anchor is defined by a static archive linked into the image
+  bool          local;
+  PUSH_GADGET(const Symbol *anchor, uint32_t offset, bool local)
+      : anchor(anchor), offset(offset), local(local) {}
   virtual void compile(X86AssembleHelper &as, StackState &stack) override {
+    // the anchor symbols are defined by the library: with position-independent
+    // addresses, they are loaded from the GOT (unless they are local)
+    unsigned int got = stack.pic_base;
+
     if (opaqueConstant) {
       auto opaqueValues =
           *opaqueConstant->getOutput().findValues(OpaqueStorage::EAX);
 
       opaqueConstant->compile(as, stack);
 
-      // add eax, $symbol
-      as.add(as.reg(X86::EAX), as.label(anchor->Label));
+      if (got && local) {
+        // add eax, got; add eax, symbol@GOTOFF
+        as.add(as.reg(X86::EAX), as.reg(got));
+        as.add(as.reg(X86::EAX), as.gotoff(as.label(anchor->Label)));
+      } else if (got) {
+        // add eax, [got + symbol@GOT]
+        as.add(as.reg(X86::EAX),
+               as.mem(got, as.label(anchor->Label), 0, X86II::MO_GOT));
+      } else {
+        // add eax, $symbol
+        as.add(as.reg(X86::EAX), as.label(anchor->Label));
+      }
       // push eax
       as.push(as.reg(X86::EAX));
+    } else if (got && local) {
+      // push got; add [esp], symbol@GOTOFF+offset
+      as.push(as.reg(got));
+      as.add(as.mem(X86::ESP),
+             as.gotoff(as.label(anchor->Label), (int32_t)offset));
+    } else if (got) {
+      // push [got + symbol@GOT]; add [esp], offset
+      as.push(as.mem(got, as.label(anchor->Label), 0, X86II::MO_GOT));
+      if (offset) {
+        as.add(as.mem(X86::ESP), as.imm(offset));
+      }
     } else {
       // push $symbol+offset
       as.push(as.addOffset(as.label(anchor->Label), offset));
     }
   }
+  virtual void compile64(X86AssembleHelper &as, StackState &stack) override {
+    // the gadget may precede the anchor symbol: the offset is signed
+    if (!stack.pic_base) {
+      pushValue64(as, as.addOffset(as.label(anchor->Label), (int32_t)offset));
+      return;
+    }
+    if (local) {
+      // lea rax, [rip + symbol+offset]
+      pushComputed64(as, [&]() {
+        as.lea64(as.reg(X86::RAX),
+                 as.mem(X86::RIP, as.label(anchor->Label), (int32_t)offset));
+      });
+      return;
+    }
+    // mov rax, [rip + symbol@GOTPCREL]; lea rax, [rax+offset]
+    pushComputed64(as, [&]() {
+      as.mov64(
+          as.reg(X86::RAX),
+          as.mem(X86::RIP, as.label(anchor->Label), 0, X86II::MO_GOTPCREL));
+      as.lea64(as.reg(X86::RAX), as.mem(X86::RAX, (int32_t)offset));
+    });
+  }
   virtual ~PUSH_GADGET() = default;
 };
 
@@ -195,6 +332,8 @@ struct PUSH_LABEL : public ROPChainPushInst {
   X86AssembleHelper::Label label;
   explicit PUSH_LABEL(const X86AssembleHelper::Label &label) : label(label) {}
   virtual void compile(X86AssembleHelper &as, StackState &stack) override {
+    unsigned int got = stack.pic_base;
+
     if (opaqueConstant) {
       uint32_t value =
           *opaqueConstant->getOutput().findValue(OpaqueStorage::EAX);
@@ -202,14 +341,34 @@ struct PUSH_LABEL : public ROPChainPushInst {
       opaqueConstant->compile(as, stack);
 
       // adjust eax to jump target address
-      as.add(as.reg(X86::EAX), as.addOffset(label, -value));
+      if (got) {
+        // add eax, got; add eax, label@GOTOFF-value
+        as.add(as.reg(X86::EAX), as.reg(got));
+        as.add(as.reg(X86::EAX), as.gotoff(label, -value));
+      } else {
+        as.add(as.reg(X86::EAX), as.addOffset(label, -value));
+      }
       // push eax
       as.push(as.reg(X86::EAX));
+    } else if (got) {
+      // push got; add [esp], label@GOTOFF
+      as.push(as.reg(got));
+      as.add(as.mem(X86::ESP), as.gotoff(label));
     } else {
       // push label
       as.push(label);
     }
   }
+  virtual void compile64(X86AssembleHelper &as, StackState &stack) override {
+    if (!stack.pic_base) {
+      pushValue64(as, label);
+      return;
+    }
+    // lea rax, [rip + label]
+    pushComputed64(as, [&]() {
+      as.lea64(as.reg(X86::RAX), as.mem(X86::RIP, label));
+    });
+  }
   virtual ~PUSH_LABEL() = default;
 };
 
@@ -218,6 +377,9 @@ struct PUSH_ESP : public ROPChainPushInst {
   virtual void compile(X86AssembleHelper &as, StackState &stack) override {
     as.push(as.reg(X86::ESP));
   }
+  virtual void compile64(X86AssembleHelper &as, StackState &) override {
+    as.push64(as.reg(X86::RSP));
+  }
   virtual ~PUSH_ESP() = default;
 };
 
@@ -226,6 +388,9 @@ struct PUSH_EFLAGS : public ROPChainPushInst {
   virtual void compile(X86AssembleHelper &as, StackState &stack) override {
     as.pushf();
   }
+  virtual void compile64(X86AssembleHelper &as, StackState &) override {
+    as.pushf64();
+  }
   virtual ~PUSH_EFLAGS() = default;
 };
 
@@ -245,6 +410,663 @@ void putLabelInMBB(MachineBasicBlock &MBB, X86AssembleHelper::Label label) {
   as.putLabel(label);
 }
 
+// bundleChainCode - bundles the code emitted after begin, up to end, and
+// removes begin (a placeholder). Inline assembly is left out of the bundles,
+// since the AsmPrinter only expands the other instructions. The bundled
+// instructions are neither merged nor freed: only the passes using the
+// bundle iterator (MachineBasicBlock::iterator) see one instruction.
+void bundleChainCode(MachineBasicBlock          &MBB,
+                     MachineInstr               *begin,
+                     MachineBasicBlock::iterator end) {
+  MachineBasicBlock::instr_iterator first = std::next(begin->getIterator());
+  MachineBasicBlock::instr_iterator last  = end.getInstrIterator();
+  begin->eraseFromParent();
+
+  while (first != last) {
+    if (first->isInlineAsm()) {
+      ++first;
+      continue;
+    }
+
+    MachineBasicBlock::instr_iterator next = std::next(first);
+    while (next != last && !next->isInlineAsm()) {
+      ++next;
+    }
+    if (std::next(first) != next) {
+      finalizeBundle(MBB, first, next);
+    }
+    first = next;
+  }
+}
+
+// isHideable - true if MI can be moved into the code pushing the following
+// chain. The stack pointer and the flags are modified by that code, and the
+// control flow must reach the chain.
+bool isHideable(const MachineInstr &MI, const TargetRegisterInfo *TRI) {
+  if (MI.isPseudo() || MI.isCall() || MI.isBranch() || MI.isReturn() ||
+      MI.isTerminator() || MI.hasUnmodeledSideEffects()) {
+    return false;
+  }
+
+  for (unsigned int reg : {X86::ESP, X86::EFLAGS}) {
+    if (MI.readsRegister(reg, TRI) || MI.modifiesRegister(reg, TRI)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// stackMemOperand - returns the index of the memory operand of MI if its
+// base register is the stack pointer, -1 otherwise
+int stackMemOperand(const MachineInstr &MI) {
+  const MCInstrDesc &desc  = MI.getDesc();
+  int                memOp = X86II::getMemoryOperandNo(desc.TSFlags);
+  if (memOp < 0) {
+    return -1;
+  }
+  memOp += X86II::getOperandBias(desc);
+
+  const MachineOperand &base = MI.getOperand(memOp + X86::AddrBaseReg);
+  if (!base.isReg() || base.getReg() != X86::ESP) {
+    return -1;
+  }
+  return memOp;
+}
+
+// keepableRegs - registers which can stay clobbered from the end of a chain
+// (replacing last) to the beginning of the next one (replacing next), since
+// neither the chain nor the native instructions in between use them. Their
+// values are kept in slots reserved above the stack pointer (see
+// insertROPChain()), hence the native instructions in between must only use
+// the stack pointer as the base of a memory operand, whose displacement is
+// then adjusted by adjustStackOperands().
+std::set<unsigned int> keepableRegs(const ROPChain           &chain,
+                                    const ROPChain           &nextChain,
+                                    const MachineInstr       &last,
+                                    const MachineInstr       &next,
+                                    const TargetRegisterInfo *TRI,
+                                    const MCInstrInfo        *MCII) {
+  std::set<unsigned int> regs = {X86::EAX,
+                                 X86::EBX,
+                                 X86::ECX,
+                                 X86::EDX,
+                                 X86::ESI,
+                                 X86::EDI,
+                                 X86::EBP};
+
+  // both chains must resume right after themselves, without calling
+  // functions: the next chain releases the reserved slots once it resumes
+  for (const ROPChain *c : {&chain, &nextChain}) {
+    if (c->callee || c->hasConditionalJump || c->hasUnconditionalJump) {
+      return {};
+    }
+  }
+  // the flags pushed below the slots would be popped by the wrong code
+  if (chain.flagSave == FlagSaveMode::SAVE_AFTER_EXEC) {
+    return {};
+  }
+
+  auto removeOverlapping = [&](unsigned int used) {
+    for (auto it = regs.begin(); it != regs.end();) {
+      if (used && TRI->regsOverlap(*it, used)) {
+        it = regs.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  };
+
+  // registers used by the gadgets
+  for (auto &elem : chain) {
+    if (elem.type != ChainElem::Type::GADGET) {
+      continue;
+    }
+    for (auto &inst : elem.microgadget->Instr) {
+      for (unsigned int i = 0; i < inst.getNumOperands(); i++) {
+        if (inst.getOperand(i).isReg()) {
+          removeOverlapping(inst.getOperand(i).getReg());
+        }
+      }
+      const MCInstrDesc &desc = MCII->get(inst.getOpcode());
+      for (const MCPhysReg *reg = desc.getImplicitUses(); reg && *reg; ++reg) {
+        removeOverlapping(*reg);
+      }
+      for (const MCPhysReg *reg = desc.getImplicitDefs(); reg && *reg; ++reg) {
+        removeOverlapping(*reg);
+      }
+    }
+  }
+
+  // registers used by the native instructions in between. Instructions to
+  // be hidden in the next chain are not necessarily moved into it, so they
+  // are native instructions as well.
+  for (auto it = std::next(last.getIterator()); &*it != &next; ++it) {
+    if (it->isDebugInstr()) {
+      continue;
+    }
+    // the stack pointer must stay where the compiler expects it
+    if (it->isCall() || it->isReturn() || it->isTerminator() ||
+        it->isInlineAsm() || it->isCFIInstruction() ||
+        it->hasUnmodeledSideEffects()) {
+      return {};
+    }
+
+    int memOp = stackMemOperand(*it);
+    for (unsigned int i = 0; i < it->getNumOperands(); i++) {
+      const MachineOperand &op = it->getOperand(i);
+      if (!op.isReg() || !op.getReg()) {
+        continue;
+      }
+      if (TRI->regsOverlap(op.getReg(), X86::ESP) &&
+          (memOp < 0 || static_cast<int>(i) != memOp + X86::AddrBaseReg ||
+           !it->getOperand(memOp + X86::AddrDisp).isImm())) {
+        return {};
+      }
+      removeOverlapping(op.getReg());
+    }
+  }
+
+  return regs;
+}
+
+// adjustStackOperands - adds size to the displacement of the memory operands
+// based on the stack pointer, in the native instructions between last and
+// next, which run while size bytes are reserved on the stack
+void adjustStackOperands(MachineInstr &last, MachineInstr &next, int size) {
+  for (auto it = std::next(last.getIterator()); &*it != &next; ++it) {
+    int memOp = stackMemOperand(*it);
+    if (memOp >= 0) {
+      MachineOperand &disp = it->getOperand(memOp + X86::AddrDisp);
+      disp.setImm(disp.getImm() + size);
+    }
+  }
+}
+
+const char *degradationName(Degradation level) {
+  switch (level) {
+  case Degradation::NONE:
+    return "none";
+  case Degradation::CHEAP_OPAQUE:
+    return "cheap-opaque";
+  case Degradation::ROP_ONLY:
+    return "rop-only";
+  }
+  return "";
+}
+
+// applyDegradation - makes the obfuscation cheaper, according to level.
+// Opaque constants are mostly responsible for the compile time (e.g., prime
+// generation for "multcomp", or the formulas of "r3sat32").
+void applyDegradation(ObfuscationParameter &param, Degradation level) {
+  if (level >= Degradation::CHEAP_OPAQUE) {
+    param.opaqueConstantsAlgorithm = OPAQUE_CONSTANT_ALGORITHM_MOV;
+  }
+  if (level >= Degradation::ROP_ONLY) {
+    param.opaquePredicatesEnabled = false;
+  }
+}
+
+Degradation nextDegradation(Degradation level) {
+  return level == Degradation::ROP_ONLY
+             ? level
+             : static_cast<Degradation>(static_cast<int>(level) + 1);
+}
+
+// estimatedCost - estimated compile time (in seconds) of an instruction
+// obfuscated with param. The estimate is static, rather than measured while
+// compiling, so that the degradation of the functions does not depend on the
+// machine or on its load: a module is always obfuscated in the same way. The
+// costs are rough orders of magnitude (the opaque constants of "multcomp" and
+// "r3sat32" take most of the time).
+double estimatedCost(const ObfuscationParameter &param) {
+  if (!param.obfuscationEnabled) {
+    return 0;
+  }
+  if (!param.opaquePredicatesEnabled) {
+    return 1e-5;
+  }
+  if (param.opaqueConstantsAlgorithm == OPAQUE_CONSTANT_ALGORITHM_MOV) {
+    return 1e-4;
+  }
+  return 1e-3;
+}
+
+// chain waiting to be inserted, until its basic block is entirely scanned
+// and its opaque constructs are generated
+struct PendingChain {
+  ROPChain                    chain;
+  // instructions replaced by the chain
+  std::vector<MachineInstr *> instrs;
+  // native instructions to hide in the chain
+  std::vector<MachineInstr *> hiddenInstrs;
+  int                         id;
+  // parameter of the region where the chain is
+  ObfuscationParameter        param;
+  // chain elements, before lowering
+  unsigned int                length = 0;
+
+  std::unique_ptr<ROPfuscatorCore::LoweredChain> lowered;
+};
+
+// chain of a single instruction merged in chain0, kept while chains have a
+// maximum length so that chain0 can be split afterwards
+struct ChainPart {
+  ROPChain     chain;
+  // scratch registers of the instruction, i.e. registers that are not live
+  // at the boundary before it
+  unsigned int scratchRegs;
+};
+
+// chooseChainSplit - returns the number of parts to flush from the merged
+// chain, so that the next chain can be merged within maxLength elements, or
+// 0 if the chain cannot be split. The boundary where most registers are dead
+// is chosen (the latest one on ties), since the registers saved around the
+// two chains are fewer there. The boundary after a conditional jump is never
+// chosen: the fallthrough jmp must stay in the same chain. Flags are dead at
+// every boundary, as chains saving the flags are not merged.
+size_t chooseChainSplit(const std::vector<ChainPart> &parts,
+                        const ROPChain               &next,
+                        unsigned int                  nextScratchRegs,
+                        size_t                        maxLength) {
+  size_t best      = 0;
+  int    bestScore = -1;
+  // elements following the boundary (an upper bound: merging may remove the
+  // xchg gadgets cancelling each other across the parts)
+  size_t tailLength = next.size();
+
+  for (size_t n = parts.size(); n > 0; n--) {
+    if (n < parts.size()) {
+      tailLength += parts[n].chain.size();
+    }
+    if (parts[n - 1].chain.hasConditionalJump) {
+      continue;
+    }
+    // an earlier boundary would split the merged chain again
+    if (tailLength > maxLength && n < parts.size()) {
+      break;
+    }
+
+    int score = n == parts.size() ? nextScratchRegs : parts[n].scratchRegs;
+    if (score > bestScore) {
+      best      = n;
+      bestScore = score;
+    }
+  }
+
+  return best;
+}
+
+// outcome of the planning of an instruction, replayed (statistics, remarks,
+// verification) when its block is applied
+struct PlannedInstr {
+  MachineInstr             *MI;
+  ROPChainStatus            status;
+  // true if the instruction is replaced by a chain (rather than left native
+  // or hidden in a chain)
+  bool                      replaced = false;
+  // scratch registers available before the instruction
+  std::vector<unsigned int> scratchRegs;
+  MissingGadget             missing;
+  // chain of the instruction, kept only if the chains are verified or if the
+  // instruction is to be hidden
+  ROPChain                  chain;
+  // parameter of the region of an instruction to be hidden, to replace it
+  // by a chain if it is not moved into the next one
+  ObfuscationParameter      hideParam;
+};
+
+// chains of a basic block: planned (possibly on the worker threads), then
+// lowered and inserted in block order
+struct PendingBlock {
+  MachineBasicBlock          *MBB;
+  // parameters at the beginning of the block, and of the function
+  ObfuscationParameter        param, funcParam;
+  // seed of the random numbers drawn while planning the block
+  uint32_t                    seed;
+  // outcome of each instruction, in order
+  std::vector<PlannedInstr>   instrs;
+  std::vector<PendingChain>   chains;
+  // instructions to remove once the chains are inserted
+  std::vector<MachineInstr *> instrToDelete;
+  // instructions counted as processed (GC_LABEL excluded)
+  size_t                      processed = 0;
+  Degradation                 degradation;
+};
+
+// readAnnotatedPresets - returns the presets selected by
+// __attribute__((annotate("ropfuscator:<preset>"))), which clang collects in
+// llvm.global.annotations as { function, annotation, file, line } entries.
+std::map<const Function *, std::string> readAnnotatedPresets(Module &module) {
+  std::map<const Function *, std::string> presets;
+
+  GlobalVariable *annotations =
+      module.getNamedGlobal("llvm.global.annotations");
+  if (!annotations || !annotations->hasInitializer()) {
+    return presets;
+  }
+
+  auto *entries = dyn_cast<ConstantArray>(annotations->getInitializer());
+  if (!entries) {
+    return presets;
+  }
+
+  for (const Use &use : entries->operands()) {
+    auto *entry = dyn_cast<ConstantStruct>(use.get());
+    if (!entry || entry->getNumOperands() < 2) {
+      continue;
+    }
+
+    auto *function =
+        dyn_cast<Function>(entry->getOperand(0)->stripPointerCasts());
+    auto *string =
+        dyn_cast<GlobalVariable>(entry->getOperand(1)->stripPointerCasts());
+    if (!function || !string || !string->hasInitializer()) {
+      continue;
+    }
+
+    auto *data = dyn_cast<ConstantDataSequential>(string->getInitializer());
+    if (!data || !data->isCString()) {
+      continue;
+    }
+
+    StringRef annotation = data->getAsCString();
+    if (annotation.consume_front(ANNOTATION_PREFIX)) {
+      presets[function] = annotation.str();
+    }
+  }
+
+  return presets;
+}
+
+// regionMarker - returns true if MI is a region marker, i.e., the inline
+// assembly comment "# ropfuscator:<preset>" (see include/ropfuscator.h)
+bool regionMarker(const MachineInstr &MI, std::string &preset) {
+  if (!MI.isInlineAsm() || !MI.getOperand(0).isSymbol()) {
+    return false;
+  }
+
+  StringRef text = StringRef(MI.getOperand(0).getSymbolName()).trim();
+  if (!text.consume_front("#")) {
+    return false;
+  }
+
+  text = text.ltrim();
+  if (!text.consume_front(ANNOTATION_PREFIX)) {
+    return false;
+  }
+
+  preset = text.trim().str();
+  return true;
+}
+
+// regionParameter - sets param to the parameter of the region starting at a
+// marker of the given preset. Returns false if the preset is unknown, in
+// which case the current parameter is kept.
+bool regionParameter(const ROPfuscatorConfig   &config,
+                     const std::string          &preset,
+                     const ObfuscationParameter &funcParam,
+                     bool                        is64Bit,
+                     Degradation                 degradation,
+                     ObfuscationParameter       &param) {
+  ObfuscationParameter regionParam = funcParam;
+
+  bool known = preset == ANNOTATION_REGION_END ||
+               config.getPreset(preset, regionParam);
+
+  if (!known) {
+    regionParam = param;
+  }
+  if (is64Bit) {
+    regionParam.opaquePredicatesEnabled = false;
+  }
+  applyDegradation(regionParam, degradation);
+
+  param = regionParam;
+  return known;
+}
+
+// planBlock - ropifies the instructions of the block and merges the chains
+// of consecutive instructions. Neither the function nor the gadgets are
+// modified, hence blocks can be planned concurrently. The random numbers are
+// drawn from block.seed: the plan does not depend on the threads.
+// The engine does not select the unreachableGadgets when another gadget does
+// the same job; instructions which cannot do without them are left native.
+void planBlock(PendingBlock                        &block,
+               const BinaryAutopsy                 &BA,
+               const X86InstrInfo                  *TII,
+               const ROPfuscatorConfig             &config,
+               bool                                 is64Bit,
+               bool                                 keepChains,
+               const std::set<const Microgadget *> &unreachableGadgets) {
+  math::Random::ScopedSeed scopedSeed(block.seed);
+
+  MachineBasicBlock        &MBB = *block.MBB;
+  const TargetRegisterInfo *TRI =
+      MBB.getParent()->getSubtarget().getRegisterInfo();
+
+  // parameter of the current region
+  ObfuscationParameter param = block.param;
+
+  // instruction hiding relies on the opaque constructs
+  bool hidingEnabled =
+      param.opaquePredicatesEnabled && param.opaqueSteganoEnabled;
+
+  // perform register liveness analysis to get a list of registers that can be
+  // safely clobbered to compute temporary data
+  ScratchRegMap MBBScratchRegs = performLivenessAnalysis(MBB);
+
+  ROPChain                    chain0; // merged chain
+  std::vector<MachineInstr *> chain0Instrs;
+  // native instructions to hide in chain0, and the ones which can be hidden
+  // in the next chain (i.e., the native instructions right before it)
+  std::vector<MachineInstr *> chain0Hidden, hideCandidates;
+  // chains of the instructions of chain0, if chains have a maximum length
+  std::vector<ChainPart>      chain0Parts;
+  size_t                      maxChainLength =
+      config.globalConfig.maxChainLength;
+  // ids of the ESP_PUSH elements, assigned in the order of the instructions
+  // (chains are only merged within the block)
+  int                         lastEspId = 0;
+
+  // chain ids are assigned when the block is applied
+  auto flushChain0 = [&]() {
+    if (chain0.valid()) {
+      block.chains.push_back({std::move(chain0),
+                              std::move(chain0Instrs),
+                              std::move(chain0Hidden),
+                              -1,
+                              param});
+      chain0.clear();
+      chain0Instrs.clear();
+      chain0Hidden.clear();
+      chain0Parts.clear();
+    }
+  };
+
+  // flushChain0Head - flushes the chain of the first n instructions of
+  // chain0, which is rebuilt from the remaining ones
+  auto flushChain0Head = [&](size_t n) {
+    std::vector<ChainPart>      tailParts(chain0Parts.begin() + n,
+                                          chain0Parts.end());
+    std::vector<MachineInstr *> tailInstrs(chain0Instrs.begin() + n,
+                                           chain0Instrs.end());
+
+    chain0.clear();
+    for (size_t i = 0; i < n; i++) {
+      chain0.merge(chain0Parts[i].chain);
+    }
+    chain0Instrs.resize(n);
+    flushChain0();
+
+    for (ChainPart &part : tailParts) {
+      chain0.merge(part.chain);
+    }
+    chain0Instrs = std::move(tailInstrs);
+    chain0Parts  = std::move(tailParts);
+  };
+
+  for (auto it = MBB.begin(), it_end = MBB.end(); it != it_end; ++it) {
+    MachineInstr &MI = *it;
+    PlannedInstr  planned;
+    planned.MI = &MI;
+
+    // MachineFunction.getInstructionCount() does not take in account
+    // GC_LABEL hence we adapt to match LLVM's instruction count
+    if (MI.getOpcode() != llvm::TargetOpcode::GC_LABEL) {
+      block.processed++;
+    }
+
+    if (MI.isDebugInstr()) {
+      planned.status = ROPChainStatus::ERR_DEBUG_INSTRUCTION;
+      block.instrs.push_back(std::move(planned));
+      continue;
+    }
+
+    // a region marker switches the parameter of the following instructions
+    // (unknown presets are reported by obfuscateFunction())
+    std::string preset;
+    if (regionMarker(MI, preset)) {
+      regionParameter(config,
+                      preset,
+                      block.funcParam,
+                      is64Bit,
+                      block.degradation,
+                      param);
+
+      // chains do not span regions
+      flushChain0();
+      hideCandidates.clear();
+      hidingEnabled =
+          param.opaquePredicatesEnabled && param.opaqueSteganoEnabled;
+
+      // the marker is only an assembly comment
+      block.instrToDelete.push_back(&MI);
+      continue;
+    }
+
+    if (!param.obfuscationEnabled) {
+      continue;
+    }
+
+    // get the list of scratch registers available for this instruction
+    planned.scratchRegs = MBBScratchRegs.find(&MI)->second;
+    // ropify() may consume the scratch registers, hence the copy
+    std::vector<unsigned int> MIScratchRegs  = planned.scratchRegs;
+    unsigned int              MIScratchCount = MIScratchRegs.size();
+
+    // Do this instruction and/or following instructions
+    // use current flags (i.e. affected by current flags)?
+    bool shouldFlagSaved = !TII->isSafeToClobberEFLAGS(MBB, it);
+    // Does this instruction modify (define/kill) flags?
+    // bool isFlagModifiedInInstr = false;
+    // Example instruction sequence describing how these booleans are set:
+    //   mov eax, 1    # false, false
+    //   add eax, 1    # false, true
+    //   cmp eax, ebx  # false, true
+    //   mov ecx, 1    # true,  false (caution!)
+    //   mov edx, 2    # true,  false (caution!)
+    //   je .Local1    # true,  false
+    //   add eax, ebx  # false, true
+    //   adc ecx, edx  # true,  true
+    //   adc ecx, 1    # true,  true
+
+    ROPChain       result;
+    ROPEngine      engine(BA, lastEspId, &unreachableGadgets);
+    ROPChainStatus status =
+        engine.ropify(MI, MIScratchRegs, shouldFlagSaved, result);
+
+    bool isJump = result.hasConditionalJump || result.hasUnconditionalJump;
+    if (isJump && result.flagSave == FlagSaveMode::SAVE_AFTER_EXEC) {
+      // when flag should be saved after resume, jmp instruction cannot be
+      // ROPified
+      status = ROPChainStatus::ERR_UNSUPPORTED;
+    }
+    // with a static archive, some gadgets cannot be referenced by the module:
+    // the engine falls back on them only when nothing else matches
+    if (status == ROPChainStatus::OK && !unreachableGadgets.empty() &&
+        std::any_of(result.begin(), result.end(), [&](const ChainElem &elem) {
+          return elem.type == ChainElem::Type::GADGET &&
+                 unreachableGadgets.count(elem.microgadget);
+        })) {
+      status = ROPChainStatus::ERR_NO_GADGETS_AVAILABLE;
+    }
+
+    planned.status  = status;
+    planned.missing = engine.missingGadget;
+
+    if (status != ROPChainStatus::OK) {
+      block.instrs.push_back(std::move(planned));
+
+      flushChain0();
+      // an instruction which is not hidden stays between the candidates and
+      // the chain: the candidates cannot be moved across it
+      if (hidingEnabled && isHideable(MI, TRI) &&
+          math::Random::range32(0, 99) < param.opaqueSteganoPercentage) {
+        hideCandidates.push_back(&MI);
+      } else {
+        hideCandidates.clear();
+      }
+      continue;
+    }
+
+    // leave the instruction native, to hide it in the next chain. Only
+    // instructions which would start a chain are picked, so that chains
+    // are not split. The chain is kept in case the instruction cannot be
+    // moved into the next chain (see insertROPChain()).
+    if (hidingEnabled && !chain0.valid() && isHideable(MI, TRI) &&
+        math::Random::range32(0, 99) < param.opaqueSteganoPercentage) {
+      planned.chain     = result;
+      planned.hideParam = param;
+      block.instrs.push_back(std::move(planned));
+      hideCandidates.push_back(&MI);
+      continue;
+    }
+
+    planned.replaced = true;
+    if (keepChains) {
+      planned.chain = result;
+    }
+    block.instrs.push_back(std::move(planned));
+
+    // add current instruction in the To-Delete list
+    block.instrToDelete.push_back(&MI);
+
+    if (!chain0.valid()) {
+      // a chain starts here
+      chain0Hidden.swap(hideCandidates);
+      hideCandidates.clear();
+    }
+
+    bool mergeable = chain0.canMerge(result);
+    // a long chain pushes all its elements onto the stack before running:
+    // bound its stack footprint by splitting it
+    if (mergeable && maxChainLength && chain0.valid() &&
+        chain0.size() + result.size() > maxChainLength) {
+      size_t n = chooseChainSplit(chain0Parts,
+                                  result,
+                                  MIScratchCount,
+                                  maxChainLength);
+      if (n == chain0Parts.size()) {
+        mergeable = false;
+      } else if (n > 0) {
+        flushChain0Head(n);
+      }
+    }
+
+    if (!mergeable) {
+      flushChain0();
+    }
+    if (maxChainLength) {
+      chain0Parts.push_back({result, MIScratchCount});
+    }
+    chain0.merge(result);
+    chain0Instrs.push_back(&MI);
+  }
+
+  flushChain0();
+}
+
 } // namespace
 
 class ChainElementSelector {
@@ -308,7 +1130,7 @@ public:
 
 ROPfuscatorCore::ROPfuscatorCore(llvm::Module            &module,
                                  const ROPfuscatorConfig &config)
-    : config(config), BA(nullptr), TII(nullptr),
+    : config(config), BA(nullptr), TII(nullptr), interpreter(nullptr),
       sourceFileName(module.getSourceFileName()) {
   total_chain_elems = 0;
   total_func_count  = 0;
@@ -323,10 +1145,29 @@ ROPfuscatorCore::ROPfuscatorCore(llvm::Module            &module,
     }
   }
 
+  functionPresets = readAnnotatedPresets(module);
+
   if (config.globalConfig.rng_seed) {
     math::Random::engine().seed(config.globalConfig.rng_seed);
   }
 
+  // the chain interpreter and the profiling counters are x86-32 only
+  if (Triple(module.getTargetTriple()).getArch() == Triple::x86_64) {
+    if (this->config.globalConfig.verifyChains) {
+      dbg_fmt("[!] Chain verification is not supported on x86-64\n");
+      this->config.globalConfig.verifyChains = false;
+    }
+    if (!this->config.globalConfig.chainProfileOutput.empty()) {
+      dbg_fmt("[!] Chain profiling is not supported on x86-64\n");
+      this->config.globalConfig.chainProfileOutput.clear();
+    }
+  }
+
+  if (!this->config.globalConfig.chainProfileOutput.empty()) {
+    emitChainProfileDumper(module,
+                           this->config.globalConfig.chainProfileOutput);
+  }
+
   if (config.globalConfig.writeInstrStat) {
     auto          logfile = fmt::format("{}-{}",
                                ROPFUSCATOR_OBFUSCATION_STATISTICS_FILE_HEAD,
@@ -358,6 +1199,10 @@ ROPfuscatorCore::ROPfuscatorCore(llvm::Module            &module,
   branchTargetSelector = new ChainElementSelector(
       0,
       {ChainElem::Type::JMP_BLOCK, ChainElem::Type::JMP_FALLTHROUGH});
+
+  if (this->config.globalConfig.verifyChains) {
+    interpreter = new ChainInterpreter();
+  }
 }
 
 ROPfuscatorCore::~ROPfuscatorCore() {
@@ -373,6 +1218,10 @@ ROPfuscatorCore::~ROPfuscatorCore() {
                        TII->getName(kv.first),
                        kv.second.toString(ROPChainStatEntry::DEBUG_FMT_SIMPLE));
 
+    // functions degraded by the compile-time budget
+    for (auto &kv : degradedFunctions)
+      f << fmt::format("{:^15}\t{}\n", degradationName(kv.second), kv.first);
+
     // this can happen as MachineFunction.getInstructionCount()
     // does not take in account some opcodes such as GC_LABEL
     if (module_total_instructions != processed_instructions) {
@@ -396,20 +1245,154 @@ ROPfuscatorCore::~ROPfuscatorCore() {
 
     dbg_fmt("============================================================\n");
     dbg_fmt("Total ROP chain elements: {}\n", total_chain_elems);
+    dbg_fmt("Hidden instructions: {}\n", hidden_instructions);
+  }
+
+  if (!degradedFunctions.empty()) {
+    dbg_fmt("[!] Compile-time budget exceeded: {} functions degraded\n",
+            degradedFunctions.size());
+    for (auto &kv : degradedFunctions) {
+      dbg_fmt("{:^15}\t{}\n", degradationName(kv.second), kv.first);
+    }
+  }
+
+  if (interpreter) {
+    dbg_fmt("[*] Chain verification: {} verified, {} failed, {} skipped "
+            "({} gadgets executed)\n",
+            interpreter->verifiedCount,
+            interpreter->failedCount,
+            interpreter->skippedCount,
+            interpreter->executedGadgets);
   }
 
   delete gadgetAddressSelector;
   delete immediateSelector;
   delete branchTargetSelector;
+  delete interpreter;
+
+  if (BA) {
+    BinaryAutopsy::release(BA, config.globalConfig);
+  }
 
   assert(module_total_instructions == processed_instructions);
 }
 
-void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
-                                     MachineBasicBlock          &MBB,
-                                     MachineInstr               &MI,
-                                     int                         chainID,
-                                     const ObfuscationParameter &param) {
+Degradation
+ROPfuscatorCore::chooseDegradation(size_t                      instrCount,
+                                   const ObfuscationParameter &param) {
+  const GlobalConfig &global = config.globalConfig;
+  Degradation         level  = moduleDegradation;
+  double              predicted;
+
+  while (true) {
+    ObfuscationParameter degraded = param;
+    applyDegradation(degraded, level);
+    predicted = instrCount * estimatedCost(degraded);
+
+    bool overModule = global.moduleTimeBudget &&
+                      moduleEstimate + predicted > global.moduleTimeBudget;
+    bool overFunction =
+        global.functionTimeBudget && predicted > global.functionTimeBudget;
+    if ((!overModule && !overFunction) || level == Degradation::ROP_ONLY) {
+      break;
+    }
+
+    level = nextDegradation(level);
+    if (overModule) {
+      // the following functions would exceed the budget as well
+      moduleDegradation = level;
+    }
+  }
+
+  moduleEstimate += predicted;
+  return level;
+}
+
+void ROPfuscatorCore::spawnOpaqueConstruct(
+    std::shared_ptr<OpaqueConstruct>                 &out,
+    std::function<std::shared_ptr<OpaqueConstruct>()> create) {
+  uint32_t seed = math::Random::rand();
+
+  runOnWorkers([&out, seed, create]() {
+    math::Random::ScopedSeed scopedSeed(seed);
+    out = create();
+  });
+}
+
+void ROPfuscatorCore::runOnWorkers(std::function<void()> job) {
+  int threads = config.globalConfig.opaqueThreads;
+  if (threads == 1) {
+    job();
+    return;
+  }
+
+  // the threads are started by the first job
+  if (!opaqueThreads) {
+#if LLVM_VERSION_MAJOR >= 11
+    opaqueThreads.reset(new ThreadPool(hardware_concurrency(threads)));
+#else
+    opaqueThreads.reset(threads > 0 ? new ThreadPool(threads)
+                                    : new ThreadPool());
+#endif
+  }
+  opaqueThreads->async(std::move(job));
+}
+
+const ROPfuscatorCore::SectionAnchors *
+ROPfuscatorCore::findSectionAnchors(uint64_t address) const {
+  auto it = sectionAnchors.upper_bound(address);
+  if (it == sectionAnchors.begin()) {
+    return nullptr;
+  }
+
+  const SectionAnchors &section = std::prev(it)->second;
+  if (address >= section.end || section.symbols.empty()) {
+    return nullptr;
+  }
+  return &section;
+}
+
+const Symbol *ROPfuscatorCore::pickSectionAnchor(const Microgadget &gadget,
+                                                 uint64_t &address) const {
+  std::vector<std::pair<uint64_t, const SectionAnchors *>> candidates;
+
+  for (uint64_t addr : gadget.addresses) {
+    if (const SectionAnchors *section = findSectionAnchors(addr)) {
+      candidates.emplace_back(addr, section);
+    }
+  }
+
+  // the chains using unreachable gadgets are not built (see planBlock())
+  assert(!candidates.empty());
+
+  auto &picked = candidates[math::Random::range32(0, candidates.size() - 1)];
+  const std::vector<const Symbol *> &symbols = picked.second->symbols;
+
+  address = picked.first;
+  return symbols[math::Random::range32(0, symbols.size() - 1)];
+}
+
+// chain converted to push instructions, waiting for its opaque constructs
+struct ROPfuscatorCore::LoweredChain {
+  std::vector<std::shared_ptr<ROPChainPushInst>> pushchain;
+  std::vector<const Symbol *>                    versionedSymbols;
+  X86AssembleHelper::Label                       asChainLabel, asResumeLabel;
+  bool                                           resumeLabelRequired;
+  // stack offset of the end of the chain
+  int                                            espoffset;
+  FlagSaveMode                                   flagSave;
+  const llvm::GlobalValue                       *callee;
+  ObfuscationParameter                           param;
+  // profile record counting the executions of the chain (if profiling)
+  const llvm::GlobalVariable                    *profileRecord;
+};
+
+std::unique_ptr<ROPfuscatorCore::LoweredChain>
+ROPfuscatorCore::lowerROPChain(ROPChain                   &chain,
+                               MachineBasicBlock          &MBB,
+                               MachineInstr               &MI,
+                               int                         chainID,
+                               const ObfuscationParameter &param) {
   X86AssembleHelper           as = X86AssembleHelper(MBB, MI.getIterator());
   bool                        isLastInstrInBlock  = MI.getNextNode() == nullptr;
   bool                        resumeLabelRequired = false;
@@ -418,6 +1401,9 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
   std::vector<const Symbol *> versionedSymbols;
   std::vector<unsigned>       gadgetsIdxToObfuscate, immediatesIdxToObfuscate,
       branchIdxToObfuscate;
+  // each chain element is a stack word
+  bool is64Bit  = MBB.getParent()->getSubtarget<X86Subtarget>().is64Bit();
+  int  wordSize = is64Bit ? 8 : 4;
 
   total_chain_elems += chain.size();
 
@@ -441,12 +1427,12 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
   }
 
   X86AssembleHelper::Label asChainLabel, asResumeLabel;
+  std::string              chainLabel, resumeLabel;
+  generateChainLabels(chainLabel,
+                      resumeLabel,
+                      MBB.getParent()->getName(),
+                      chainID);
   if (config.globalConfig.useChainLabel) {
-    std::string chainLabel, resumeLabel;
-    generateChainLabels(chainLabel,
-                        resumeLabel,
-                        MBB.getParent()->getName(),
-                        chainID);
     asChainLabel  = as.label(chainLabel);
     asResumeLabel = as.label(resumeLabel);
   } else {
@@ -454,6 +1440,15 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
     asResumeLabel = as.label();
   }
 
+  // count the executions of this chain (the counter is incremented by the
+  // setup code, see insertROPChain())
+  const GlobalVariable *profileRecord = nullptr;
+  if (!config.globalConfig.chainProfileOutput.empty()) {
+    profileRecord = createChainProfileRecord(
+        const_cast<Module &>(*MBB.getParent()->getFunction().getParent()),
+        chainLabel);
+  }
+
   // Convert ROP chain to push instructions
   std::vector<std::shared_ptr<ROPChainPushInst>> pushchain;
 
@@ -469,13 +1464,19 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
     pushchain.emplace_back(push);
     // modify isLastInstrInBlock flag, since we will emit popf instruction later
     isLastInstrInBlock = false;
-    espoffset -= 4;
+    espoffset -= wordSize;
   }
 
   // reversing the chain as we are going to push the values in reverse
   // order on the stack
   std::reverse(chain.begin(), chain.end());
 
+  // the parameter may change at each region
+  gadgetAddressSelector->setPercentage(
+      param.gadgetAddressesObfuscationPercentage);
+  immediateSelector->setPercentage(param.opaqueImmediateOperandsPercentage);
+  branchTargetSelector->setPercentage(param.opaqueBranchTargetsPercentage);
+
   // handle obfuscation of gadget addresses
   if (param.opaqueGadgetAddressesEnabled) {
     gadgetAddressSelector->select(chain, gadgetsIdxToObfuscate);
@@ -491,6 +1492,11 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
     branchTargetSelector->select(chain, branchIdxToObfuscate);
   }
 
+  // captured by the opaque construct generators
+  std::string opaqueAlgorithm      = param.opaqueConstantsAlgorithm;
+  std::string opaqueInputAlgorithm = param.opaqueInputGenAlgorithm;
+  bool        contextual           = param.contextualOpaquePredicatesEnabled;
+
   size_t idx = 0;
   // Pushes each chain element on the stack in reverse order
   for (auto elem : chain) {
@@ -502,11 +1508,13 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
       if (param.opaquePredicatesEnabled &&
           param.opaqueImmediateOperandsEnabled &&
           contains(immediatesIdxToObfuscate, idx)) {
-        push->opaqueConstant = OpaqueConstructFactory::createOpaqueConstant32(
-            OpaqueStorage::EAX,
-            param.opaqueConstantsAlgorithm,
-            param.opaqueInputGenAlgorithm,
-            param.contextualOpaquePredicatesEnabled);
+        spawnOpaqueConstruct(push->opaqueConstant, [=]() {
+          return OpaqueConstructFactory::createOpaqueConstant32(
+              OpaqueStorage::EAX,
+              opaqueAlgorithm,
+              opaqueInputAlgorithm,
+              contextual);
+        });
       }
 
       pushchain.emplace_back(push);
@@ -523,12 +1531,14 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
         // we have to limit value range, so that
         // linker will not complain about integer overflow in relocation
         uint32_t value = elem.value - math::Random::range32(0x1000, 0x10000000);
-        push->opaqueConstant = OpaqueConstructFactory::createOpaqueConstant32(
-            OpaqueStorage::EAX,
-            value,
-            param.opaqueConstantsAlgorithm,
-            param.opaqueInputGenAlgorithm,
-            param.contextualOpaquePredicatesEnabled);
+        spawnOpaqueConstruct(push->opaqueConstant, [=]() {
+          return OpaqueConstructFactory::createOpaqueConstant32(
+              OpaqueStorage::EAX,
+              value,
+              opaqueAlgorithm,
+              opaqueInputAlgorithm,
+              contextual);
+        });
       }
 
       pushchain.emplace_back(push);
@@ -536,18 +1546,27 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
     }
 
     case ChainElem::Type::GADGET: {
-      // Get a random symbol to reference this gadget in memory
-      const Symbol                *sym       = BA->getRandomSymbol();
-      // Choose a random address in the gadget
-      const std::vector<uint64_t> &addresses = elem.microgadget->addresses;
-      std::vector<uint32_t>        offsets;
-
-      // pick address randomly
-      std::sample(addresses.begin(),
-                  addresses.end(),
-                  std::back_inserter(offsets),
-                  1,
-                  math::Random::engine());
+      const Symbol         *sym;
+      std::vector<uint32_t> offsets;
+
+      if (BA->staticArchive) {
+        uint64_t address;
+        sym = pickSectionAnchor(*elem.microgadget, address);
+        offsets.push_back(address);
+      } else {
+        // Get a random symbol to reference this gadget in memory
+        sym = anchorSymbols[math::Random::range32(0, anchorSymbols.size() - 1)];
+
+        // Choose a random address in the gadget
+        const std::vector<uint64_t> &addresses = elem.microgadget->addresses;
+
+        // pick address randomly
+        std::sample(addresses.begin(),
+                    addresses.end(),
+                    std::back_inserter(offsets),
+                    1,
+                    math::Random::engine());
+      }
 
       for (auto &offset : offsets) {
         offset -= sym->Address;
@@ -555,35 +1574,37 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
 
       // .symver directive: necessary to prevent aliasing when more
       // symbols have the same name. We do this exclusively when the
-      // symbol Version is not "Base" (i.e., it is the only one
-      // available).
-      if (!sym->isUsed && sym->Version != "Base") {
+      // symbol has a Version which is not "Base" (i.e., it is the only one
+      // available). Symbols of static archives have no version.
+      if (!sym->Version.empty() && sym->Version != "Base" &&
+          versionedSymbolsUsed.insert(sym).second) {
         versionedSymbols.push_back(sym);
-        sym->isUsed = true;
       }
 
-      ROPChainPushInst *push = new PUSH_GADGET(sym, offsets[0]);
+      ROPChainPushInst *push =
+          new PUSH_GADGET(sym, offsets[0], BA->staticArchive);
 
       // if we should obfuscate the addresses and the current
       // index has been selected to be obfuscated
       if (param.opaquePredicatesEnabled && param.opaqueGadgetAddressesEnabled &&
           contains(gadgetsIdxToObfuscate, idx)) {
-        std::shared_ptr<OpaqueConstruct> opaqueConstant;
-
-        opaqueConstant = OpaqueConstructFactory::createOpaqueConstant32(
-            OpaqueStorage::EAX,
-            param.opaqueConstantsAlgorithm,
-            param.opaqueInputGenAlgorithm,
-            param.contextualOpaquePredicatesEnabled);
+        spawnOpaqueConstruct(push->opaqueConstant, [=]() {
+          std::shared_ptr<OpaqueConstruct> opaqueConstant;
 
-        auto opaqueValues =
-            *opaqueConstant->getOutput().findValues(OpaqueStorage::EAX);
-        auto adjuster =
-            OpaqueConstructFactory::createValueAdjustor(OpaqueStorage::EAX,
-                                                        opaqueValues,
-                                                        offsets);
-        push->opaqueConstant =
-            OpaqueConstructFactory::compose(adjuster, opaqueConstant);
+          opaqueConstant = OpaqueConstructFactory::createOpaqueConstant32(
+              OpaqueStorage::EAX,
+              opaqueAlgorithm,
+              opaqueInputAlgorithm,
+              contextual);
+
+          auto opaqueValues =
+              *opaqueConstant->getOutput().findValues(OpaqueStorage::EAX);
+          auto adjuster =
+              OpaqueConstructFactory::createValueAdjustor(OpaqueStorage::EAX,
+                                                          opaqueValues,
+                                                          offsets);
+          return OpaqueConstructFactory::compose(adjuster, opaqueConstant);
+        });
       }
 
       pushchain.emplace_back(push);
@@ -601,13 +1622,15 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
           contains(branchIdxToObfuscate, idx)) {
         // we have to limit value range, so that
         // linker will not complain about integer overflow in relocation
-        uint32_t value       = -math::Random::range32(0x1000, 0x10000000);
-        push->opaqueConstant = OpaqueConstructFactory::createOpaqueConstant32(
-            OpaqueStorage::EAX,
-            value,
-            param.opaqueConstantsAlgorithm,
-            param.opaqueInputGenAlgorithm,
-            param.contextualOpaquePredicatesEnabled);
+        uint32_t value = -math::Random::range32(0x1000, 0x10000000);
+        spawnOpaqueConstruct(push->opaqueConstant, [=]() {
+          return OpaqueConstructFactory::createOpaqueConstant32(
+              OpaqueStorage::EAX,
+              value,
+              opaqueAlgorithm,
+              opaqueInputAlgorithm,
+              contextual);
+        });
       }
       pushchain.emplace_back(push);
       break;
@@ -635,13 +1658,15 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
             contains(branchIdxToObfuscate, idx)) {
           // we have to limit value range, so that
           // linker will not complain about integer overflow in relocation
-          uint32_t value       = -math::Random::range32(0x1000, 0x10000000);
-          push->opaqueConstant = OpaqueConstructFactory::createOpaqueConstant32(
-              OpaqueStorage::EAX,
-              value,
-              param.opaqueConstantsAlgorithm,
-              param.opaqueInputGenAlgorithm,
-              param.contextualOpaquePredicatesEnabled);
+          uint32_t value = -math::Random::range32(0x1000, 0x10000000);
+          spawnOpaqueConstruct(push->opaqueConstant, [=]() {
+            return OpaqueConstructFactory::createOpaqueConstant32(
+                OpaqueStorage::EAX,
+                value,
+                opaqueAlgorithm,
+                opaqueInputAlgorithm,
+                contextual);
+          });
         }
         pushchain.emplace_back(push);
       } else {
@@ -664,6 +1689,13 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
       break;
     }
 
+    case ChainElem::Type::PADDING: {
+      // skipped by a "ret imm16" gadget
+      ROPChainPushInst *push = new PUSH_IMM(math::Random::rand());
+      pushchain.emplace_back(push);
+      break;
+    }
+
     case ChainElem::Type::ESP_OFFSET: {
       // push $(imm - espoffset)
       auto it = espOffsetMap.find(elem.esp_id);
@@ -678,16 +1710,94 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
     }
     }
 
-    espoffset -= 4;
+    espoffset -= wordSize;
     idx++;
   }
 
+  // restoring the order of the chain
+  std::reverse(chain.begin(), chain.end());
+
+  return std::unique_ptr<LoweredChain>(new LoweredChain{std::move(pushchain),
+                                                        versionedSymbols,
+                                                        asChainLabel,
+                                                        asResumeLabel,
+                                                        resumeLabelRequired,
+                                                        espoffset,
+                                                        chain.flagSave,
+                                                        chain.callee,
+                                                        param,
+                                                        profileRecord});
+}
+
+MachineBasicBlock *ROPfuscatorCore::getChainSetupBlock(MachineFunction &MF) {
+  const std::string &placement = config.globalConfig.chainSetupPlacement;
+
+  if (placement == CHAIN_SETUP_INLINE) {
+    return nullptr;
+  }
+
+  if (!chainSetupBlock) {
+    // the block is only reached through the jmps, since each chain ends with
+    // a ret and nothing falls through into it. A block may only fall through
+    // into its layout successor, which the last block of the function does
+    // not have: it ends with a return, a jump or a tail call, or its control
+    // flow never reaches the end, i.e. it ends with a noreturn call (e.g.,
+    // abort) or it is an empty block reached only by an "unreachable" path.
+    // Execution falling into the appended block would be undefined behaviour
+    // in the original function.
+    chainSetupBlock = MF.CreateMachineBasicBlock();
+    MF.push_back(chainSetupBlock);
+    chainSetupEnd = nullptr;
+
+    // the assembler switches section around the code of the block. The cold
+    // code of a COMDAT function belongs to the same group, otherwise it
+    // would be kept while the resume labels are discarded.
+    if (placement == CHAIN_SETUP_COLD &&
+        MF.getTarget().getTargetTriple().isOSBinFormatELF()) {
+      X86AssembleHelper as(*chainSetupBlock, chainSetupBlock->end());
+      std::string       section = ".text.unlikely";
+
+      if (const Comdat *comdat = MF.getFunction().getComdat()) {
+        std::string group = comdat->getName().str();
+        section += "." + group + ",\"axG\",@progbits," + group + ",comdat";
+      } else {
+        section += ",\"ax\",@progbits";
+      }
+      as.inlineasm(".pushsection " + section);
+      as.inlineasm(".popsection");
+      chainSetupEnd = &chainSetupBlock->back();
+    }
+  }
+
+  return chainSetupBlock;
+}
+
+void ROPfuscatorCore::insertROPChain(
+    LoweredChain                &lowered,
+    MachineBasicBlock           &MBB,
+    MachineInstr                &MI,
+    std::vector<MachineInstr *> &hiddenInstrs,
+    SavedRegsLink               &savedRegsLink) {
+  X86AssembleHelper           as = X86AssembleHelper(MBB, MI.getIterator());
+  const ObfuscationParameter &param     = lowered.param;
+  auto                       &pushchain = lowered.pushchain;
+  int                         espoffset = lowered.espoffset;
+  bool is64Bit  = MBB.getParent()->getSubtarget<X86Subtarget>().is64Bit();
+  int  wordSize = is64Bit ? 8 : 4;
+
+  // the code of the chain is emitted after a placeholder, and then bundled
+  MachineInstr *bundleBegin = nullptr, *setupBundleBegin = nullptr;
+  if (config.globalConfig.bundleChains) {
+    bundleBegin =
+        BuildMI(MBB, MI, DebugLoc(), TII->get(TargetOpcode::IMPLICIT_DEF));
+  }
+
   // EMIT PROLOGUE
 
   // symbol version directives
-  if (!versionedSymbols.empty()) {
+  if (!lowered.versionedSymbols.empty()) {
     std::stringstream ss;
-    for (auto *sym : versionedSymbols) {
+    for (auto *sym : lowered.versionedSymbols) {
       if (ss.tellp() > 0) {
         ss << "\n";
       }
@@ -696,6 +1806,29 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
     as.inlineasm(ss.str());
   }
 
+  // the code building the chain may be placed out of line: it is reached
+  // through a jmp, and ends with the ret into the chain
+  MachineBasicBlock          *setupBlock = getChainSetupBlock(*MBB.getParent());
+  MachineBasicBlock::iterator setupPosition;
+  if (chainSetupEnd) {
+    setupPosition = chainSetupEnd->getIterator();
+  } else if (setupBlock) {
+    setupPosition = setupBlock->end();
+  }
+  X86AssembleHelper setup =
+      setupBlock ? X86AssembleHelper(*setupBlock, setupPosition) : as;
+  if (setupBlock && bundleBegin) {
+    setupBundleBegin = BuildMI(*setupBlock,
+                               setupPosition,
+                               DebugLoc(),
+                               TII->get(TargetOpcode::IMPLICIT_DEF));
+  }
+  if (setupBlock) {
+    X86AssembleHelper::Label setupLabel = as.label();
+    as.jmp(setupLabel);
+    setup.putLabel(setupLabel);
+  }
+
   // save registers (and flags if necessary) on top of the stack
   std::set<unsigned int> savedRegs;
   StackState             stackState;
@@ -709,15 +1842,138 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
       }
     }
   }
-  if (chain.flagSave == FlagSaveMode::SAVE_BEFORE_EXEC) {
+  // position-independent chains: on x86-32, the GOT address is kept in a
+  // register which is not clobbered by the opaque constructs (at least EBP)
+  if (config.globalConfig.positionIndependentChains) {
+    if (is64Bit) {
+      stackState.pic_base = X86::RIP;
+    } else {
+      for (unsigned int reg : {X86::EBX,
+                               X86::ESI,
+                               X86::EDI,
+                               X86::ECX,
+                               X86::EDX,
+                               X86::EBP,
+                               X86::EAX}) {
+        if (!savedRegs.count(reg)) {
+          stackState.pic_base = reg;
+          break;
+        }
+      }
+      if (!stackState.pic_base) {
+        dbg_fmt("Internal error: no register available for the GOT "
+                "address\n");
+        exit(1);
+      }
+      savedRegs.insert(stackState.pic_base);
+    }
+  }
+  if (lowered.flagSave == FlagSaveMode::SAVE_BEFORE_EXEC) {
     savedRegs.insert(X86::EFLAGS);
   } else {
     savedRegs.erase(X86::EFLAGS);
   }
+  // the registers kept saved by the previous chains have no valid value
+  // until they are restored from their slots
+  std::set<unsigned int> clobberedRegs = savedRegs;
+  for (auto &kv : savedRegsLink.inherited) {
+    clobberedRegs.insert(kv.first);
+  }
+
+  // hidden instructions (picked with opaque_stegano_percentage while the
+  // block is planned) must not touch the registers clobbered by the opaque
+  // constructs: since they cannot be moved across the ones which do, only
+  // the last instructions before the chain are hidden. The other ones stay
+  // in place, and are replaced by their own chains by obfuscateFunction().
+  const TargetRegisterInfo *TRI =
+      MBB.getParent()->getSubtarget().getRegisterInfo();
+  auto firstHidden = hiddenInstrs.end();
+  while (firstHidden != hiddenInstrs.begin()) {
+    MachineInstr *hidden = *std::prev(firstHidden);
+    if (std::any_of(clobberedRegs.begin(),
+                    clobberedRegs.end(),
+                    [&](unsigned reg) {
+                      return hidden->readsRegister(reg, TRI) ||
+                             hidden->modifiesRegister(reg, TRI);
+                    })) {
+      break;
+    }
+    --firstHidden;
+  }
+
+  // each hidden instruction is emitted right before a push, preferably one
+  // computing an opaque constant (register values and stack offsets are
+  // preserved, since the instructions don't touch them)
+  std::multimap<size_t, MachineInstr *> hiddenPositions;
+  if (firstHidden != hiddenInstrs.end()) {
+    std::vector<size_t> slots;
+    for (size_t i = 0; i < pushchain.size(); i++) {
+      if (pushchain[i]->opaqueConstant) {
+        slots.push_back(i);
+      }
+    }
+    if (slots.empty()) {
+      for (size_t i = 0; i < pushchain.size(); i++) {
+        slots.push_back(i);
+      }
+    }
+
+    std::vector<size_t> positions;
+    for (auto it = firstHidden; it != hiddenInstrs.end(); ++it) {
+      positions.push_back(slots[math::Random::range32(0, slots.size() - 1)]);
+    }
+    // keep the original order of the instructions
+    std::sort(positions.begin(), positions.end());
+    for (auto it = firstHidden; it != hiddenInstrs.end(); ++it) {
+      hiddenPositions.emplace(positions[it - firstHidden], *it);
+    }
+    hidden_instructions += positions.size();
+  }
+  hiddenInstrs.erase(hiddenInstrs.begin(), firstHidden);
+
+  // the registers kept saved for the next chain are pushed first, into slots
+  // which stay reserved above the stack pointer once the chain has run, so
+  // that they are not overwritten while the native instructions in between
+  // run (e.g., by a signal handler). They are neither saved below the chain
+  // nor restored. The slots of the inherited registers move up accordingly.
+  savedRegsLink.kept.clear();
+  int pushedSize = 0;
+  for (auto it = savedRegs.begin(); it != savedRegs.end();) {
+    if (savedRegsLink.keepable.count(*it) &&
+        !savedRegsLink.inherited.count(*it)) {
+      setup.push(setup.reg(*it));
+      pushedSize += wordSize;
+      savedRegsLink.kept[*it] = -pushedSize;
+      it = savedRegs.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for (auto &kv : savedRegsLink.kept) {
+    kv.second += pushedSize;
+  }
+  savedRegsLink.reservedSize += pushedSize;
+
+  // the inherited registers are restored from their slots right before the
+  // chain runs, unless this chain keeps them as well
+  std::map<unsigned int, int> restoredRegs;
+  for (auto &kv : savedRegsLink.inherited) {
+    savedRegs.erase(kv.first);
+    if (savedRegsLink.keepable.count(kv.first)) {
+      savedRegsLink.kept[kv.first] = kv.second + pushedSize;
+    } else {
+      restoredRegs[kv.first] = kv.second + pushedSize;
+    }
+  }
+
   std::vector<unsigned int> stackRegLayout;
   if (!savedRegs.empty()) {
     // lea esp, [esp-4*(N+1)]   # where N = chain size
-    as.lea(as.reg(X86::ESP), as.mem(X86::ESP, espoffset));
+    if (is64Bit) {
+      setup.lea64(setup.reg(X86::RSP), setup.mem(X86::RSP, espoffset));
+    } else {
+      setup.lea(setup.reg(X86::ESP), setup.mem(X86::ESP, espoffset));
+    }
     // save registers (and flags)
     int offset = 0;
     stackRegLayout.insert(stackRegLayout.begin(),
@@ -731,40 +1987,84 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
       stackState.stack_mangled = true;
     }
     for (auto reg : stackRegLayout) {
-      offset -= 4;
+      offset -= wordSize;
       if (reg == X86::NoRegister) {
         uint32_t value = math::Random::rand();
-        as.push(as.imm(value));
+        if (is64Bit) {
+          setup.push64(setup.imm(value));
+        } else {
+          setup.push(setup.imm(value));
+        }
         stackState.addConst(value, espoffset + offset);
       } else {
         if (reg == X86::EFLAGS) {
-          as.pushf();
+          if (is64Bit) {
+            setup.pushf64();
+          } else {
+            setup.pushf();
+          }
         } else {
-          as.push(as.reg(reg));
+          if (is64Bit) {
+            setup.push64(setup.reg(reg));
+          } else {
+            setup.push(setup.reg(reg));
+          }
         }
         stackState.addReg(reg, espoffset + offset);
       }
     }
     // lea esp, [esp+4*(N+1+M)]
     // where N = chain size, M = num of saved registers
-    as.lea(as.reg(X86::ESP), as.mem(X86::ESP, -(offset + espoffset)));
+    if (is64Bit) {
+      setup.lea64(setup.reg(X86::RSP),
+                  setup.mem(X86::RSP, -(offset + espoffset)));
+    } else {
+      setup.lea(setup.reg(X86::ESP),
+                setup.mem(X86::ESP, -(offset + espoffset)));
+    }
   }
 
   // funcName_chain_X:
-  as.putLabel(asChainLabel);
+  setup.putLabel(lowered.asChainLabel);
+
+  // the call/pop sequence does not modify the flags, which may be pushed
+  // afterwards
+  if (!is64Bit && stackState.pic_base) {
+    setup.loadGOT(setup.reg(stackState.pic_base));
+  }
+
+  // the counter is incremented right below ESP, in the slots of the chain
+  // which are not pushed yet (profiling is x86-32 only)
+  if (lowered.profileRecord) {
+    emitChainProfileCounter(setup, lowered.profileRecord, stackState.pic_base);
+  }
 
   // emit rop chain
   stackState.stack_offset = 0;
-  for (auto &push : pushchain) {
-    push->compile(as, stackState);
-    stackState.stack_offset -= 4;
+  for (size_t i = 0; i < pushchain.size(); i++) {
+    auto &push  = pushchain[i];
+    auto  range = hiddenPositions.equal_range(i);
+    for (auto it = range.first; it != range.second; ++it) {
+      setup.moveInstr(*it->second);
+    }
+    if (is64Bit) {
+      push->compile64(setup, stackState);
+    } else {
+      push->compile(setup, stackState);
+    }
+    stackState.stack_offset -= wordSize;
   }
 
   // EMIT EPILOGUE
   // restore registers (and flags)
   if (!stackRegLayout.empty()) {
     // lea esp, [esp-4*N]   # where N = num of saved registers
-    as.lea(as.reg(X86::ESP), as.mem(X86::ESP, -4 * stackRegLayout.size()));
+    int savedSize = wordSize * stackRegLayout.size();
+    if (is64Bit) {
+      setup.lea64(setup.reg(X86::RSP), setup.mem(X86::RSP, -savedSize));
+    } else {
+      setup.lea(setup.reg(X86::ESP), setup.mem(X86::ESP, -savedSize));
+    }
     // restore registers (and flags)
     int popCount = 0;
     for (auto it = stackRegLayout.rbegin(); it != stackRegLayout.rend(); ++it) {
@@ -774,49 +2074,111 @@ void ROPfuscatorCore::insertROPChain(ROPChain                   &chain,
           popCount--;
           if (*it == X86::EFLAGS) {
             if (popCount > 0) {
-              as.add(as.reg(X86::ESP), as.imm(popCount * 4));
+              if (is64Bit) {
+                setup.lea64(setup.reg(X86::RSP),
+                            setup.mem(X86::RSP, popCount * wordSize));
+              } else {
+                setup.add(setup.reg(X86::ESP), setup.imm(popCount * 4));
+              }
               popCount = 0;
             }
-            as.popf();
+            if (is64Bit) {
+              setup.popf64();
+            } else {
+              setup.popf();
+            }
           } else {
-            as.pop(as.reg(*it));
+            if (is64Bit) {
+              setup.pop64(setup.reg(*it));
+            } else {
+              setup.pop(setup.reg(*it));
+            }
           }
         }
       }
     }
   }
 
-  if (chain.callee) {
+  // mov reg, [slot]  (esp points to the chain)
+  for (auto &kv : restoredRegs) {
+    setup.mov(setup.reg(kv.first), setup.mem(X86::ESP, kv.second - espoffset));
+  }
+
+  if (lowered.callee) {
     // Insert dummy call instruction (not actually output in assembly file)
     // to convince that this includes function call in later analysis.
     // Currently, EHStreamer::computeCallSiteTable will use this information
     // to generate correct call site information for C++ exception handling.
-    as.dummyCall(chain.callee);
+    if (is64Bit) {
+      as.dummyCall64(lowered.callee);
+    } else {
+      as.dummyCall(lowered.callee);
+    }
   }
 
   // ret
-  as.ret();
+  if (is64Bit) {
+    setup.ret64();
+  } else {
+    setup.ret();
+  }
 
   // resume_funcName_chain_X:
-  if (resumeLabelRequired) {
+  if (lowered.resumeLabelRequired) {
     // If the label is inserted when ROP chain terminates with jump,
     // AsmPrinter::isBlockOnlyReachableByFallthrough() doesn't work correctly
-    as.putLabel(asResumeLabel);
+    as.putLabel(lowered.asResumeLabel);
   }
 
   // restore eflags, if eflags should be restored AFTER chain execution
-  if (chain.flagSave == FlagSaveMode::SAVE_AFTER_EXEC) {
+  if (lowered.flagSave == FlagSaveMode::SAVE_AFTER_EXEC) {
     // popf (EFLAGS register restore)
-    as.popf();
+    if (is64Bit) {
+      as.popf64();
+    } else {
+      as.popf();
+    }
   }
 
-  // restoring the order of the chain
-  std::reverse(chain.begin(), chain.end());
+  // release the reserved slots, once no register is kept saved anymore
+  if (savedRegsLink.reservedSize && savedRegsLink.kept.empty()) {
+    as.lea(as.reg(X86::ESP), as.mem(X86::ESP, savedRegsLink.reservedSize));
+    savedRegsLink.reservedSize = 0;
+  }
+
+  if (bundleBegin) {
+    bundleChainCode(MBB, bundleBegin, MI.getIterator());
+  }
+  if (setupBundleBegin) {
+    bundleChainCode(*setupBlock, setupBundleBegin, setupPosition);
+  }
 }
 
-void ROPfuscatorCore::obfuscateFunction(MachineFunction &MF) {
+void ROPfuscatorCore::obfuscateFunction(MachineFunction                  &MF,
+                                        MachineOptimizationRemarkEmitter *ORE) {
   std::string          funcName = MF.getName().str();
   ObfuscationParameter param    = config.getParameter(funcName);
+  bool                 is64Bit  = MF.getSubtarget<X86Subtarget>().is64Bit();
+
+  chainSetupBlock = nullptr;
+  chainSetupEnd   = nullptr;
+
+  // source-level annotations take precedence over the function names
+  auto annotated = functionPresets.find(&MF.getFunction());
+  if (annotated != functionPresets.end() &&
+      !config.getPreset(annotated->second, param)) {
+    dbg_fmt("[!] {}: unknown preset \"{}\"\n", funcName, annotated->second);
+  }
+
+  // opaque constructs compute 32-bit values
+  if (is64Bit) {
+    param.opaquePredicatesEnabled = false;
+  }
+
+  // the profile dumper is part of the instrumentation, not of the program
+  if (funcName == CHAIN_PROFILE_DUMP_FUNCTION) {
+    return;
+  }
 
   if (!param.obfuscationEnabled) {
     if (config.globalConfig.showProgress) {
@@ -832,14 +2194,16 @@ void ROPfuscatorCore::obfuscateFunction(MachineFunction &MF) {
   curr_func_count++;
   module_total_instructions += MF.getInstructionCount();
 
-  // create a new singleton instance of Binary Autopsy
+  // get the analysis of the library (shared with the other modules)
   if (BA == nullptr) {
     if (config.globalConfig.linkedLibraries.empty()) {
       for (std::string libname : {"libgcc_s.so.1",
                                   "libpthread.so.0",
                                   "libm.so.6",
                                   "libstdc++.so.6"}) {
-        std::string path = findLibraryPath(libname);
+        std::string path =
+            findLibraryPath(libname,
+                            MF.getSubtarget<X86Subtarget>().is64Bit());
         if (!path.empty()) {
           config.globalConfig.linkedLibraries.push_back(path);
           dbg_fmt("[*] Avoiding gadgets from: {}\n", path);
@@ -847,7 +2211,37 @@ void ROPfuscatorCore::obfuscateFunction(MachineFunction &MF) {
       }
     }
 
-    BA = BinaryAutopsy::getInstance(config.globalConfig, MF);
+    BA            = BinaryAutopsy::acquire(config.globalConfig, MF);
+    anchorSymbols = BA->getModuleSymbols(*MF.getFunction().getParent());
+    if (anchorSymbols.empty()) {
+      dbg_fmt("[!] Error: no symbol of the library can be used by the "
+              "module\n");
+      exit(1);
+    }
+
+    // with a static archive, each anchor only references the gadgets of its
+    // own section
+    if (BA->staticArchive) {
+      for (const Section &section : BA->Sections) {
+        sectionAnchors[section.Address].end = section.Address + section.Length;
+      }
+      for (const Symbol *sym : anchorSymbols) {
+        auto it = sectionAnchors.upper_bound(sym->Address);
+        std::prev(it)->second.symbols.push_back(sym);
+      }
+
+      for (auto &kv : BA->GadgetPrimitives) {
+        for (auto &gadget : kv.second) {
+          if (std::none_of(gadget->addresses.begin(),
+                           gadget->addresses.end(),
+                           [this](uint64_t addr) {
+                             return findSectionAnchors(addr) != nullptr;
+                           })) {
+            unreachableGadgets.insert(gadget.get());
+          }
+        }
+      }
+    }
   }
 
   if (TII == nullptr) {
@@ -862,6 +2256,16 @@ void ROPfuscatorCore::obfuscateFunction(MachineFunction &MF) {
             curr_func_count);
   }
 
+  // the degradation is decided before the function is processed, from its
+  // estimated compile time
+  bool budgetEnabled = config.globalConfig.moduleTimeBudget ||
+                       config.globalConfig.functionTimeBudget;
+  Degradation degradation = Degradation::NONE;
+  if (budgetEnabled) {
+    degradation = chooseDegradation(MF.getInstructionCount(), param);
+    applyDegradation(param, degradation);
+  }
+
   // stats
   size_t obfuscated                      = 0;
   size_t processed_function_instructions = 0;
@@ -869,97 +2273,101 @@ void ROPfuscatorCore::obfuscateFunction(MachineFunction &MF) {
   // ASM labels for each ROP chain
   int chainID = 0;
 
-  gadgetAddressSelector->setPercentage(
-      param.gadgetAddressesObfuscationPercentage);
-  immediateSelector->setPercentage(param.opaqueImmediateOperandsPercentage);
-  branchTargetSelector->setPercentage(param.opaqueBranchTargetsPercentage);
+  const TargetRegisterInfo *TRI  = MF.getSubtarget().getRegisterInfo();
+  const MCInstrInfo        *MCII = MF.getTarget().getMCInstrInfo();
+
+  // parameter of the function, restored at the end of a region
+  ObfuscationParameter funcParam = param;
 
   // original instructions that have been successfully ROPified and that will be
   // removed at the end
   std::vector<MachineInstr *> instrToDelete;
 
-  for (MachineBasicBlock &MBB : MF) {
-    // perform register liveness analysis to get a list of registers that can be
-    // safely clobbered to compute temporary data
-    ScratchRegMap MBBScratchRegs = performLivenessAnalysis(MBB);
-
-    ROPChain      chain0; // merged chain
-    MachineInstr *prevMI = nullptr;
-    for (auto it = MBB.begin(), it_end = MBB.end(); it != it_end; ++it) {
-      MachineInstr &MI = *it;
-
-      // MachineFunction.getInstructionCount() does not take in account
-      // GC_LABEL hence we adapt to match LLVM's instruction count
-      if (MI.getOpcode() != llvm::TargetOpcode::GC_LABEL) {
-        processed_instructions++;
-        processed_function_instructions++;
-      }
-
-      if (MI.isDebugInstr()) {
-        instr_stat[MI.getOpcode()][ROPChainStatus::ERR_DEBUG_INSTRUCTION]++;
+  // the blocks are planned concurrently by the worker threads, then their
+  // chains are lowered and inserted in block order. The opaque constructs of
+  // the chains are generated by the worker threads as well, while the next
+  // blocks are lowered: the chains are inserted at the end.
+  std::vector<PendingBlock> pendingBlocks;
+  // the planning jobs refer to the elements
+  pendingBlocks.reserve(MF.size());
+
+  // lowerBlock - reports the outcome of the instructions of the block, and
+  // lowers its chains
+  auto lowerBlock = [&](PendingBlock &block) {
+    MachineBasicBlock &MBB = *block.MBB;
+
+    processed_instructions += block.processed;
+    processed_function_instructions += block.processed;
+
+    for (PlannedInstr &planned : block.instrs) {
+      MachineInstr  &MI     = *planned.MI;
+      ROPChainStatus status = planned.status;
+      unsigned int   op     = MI.getOpcode();
+
+      instr_stat[op][status]++;
+      if (status == ROPChainStatus::ERR_DEBUG_INSTRUCTION) {
         continue;
       }
 
       DEBUG_WITH_TYPE(PROCESSED_INSTR, dbg_fmt("    {}", MI));
 
-      // get the list of scratch registers available for this instruction
-      std::vector<unsigned int> MIScratchRegs =
-          MBBScratchRegs.find(&MI)->second;
-
-      // Do this instruction and/or following instructions
-      // use current flags (i.e. affected by current flags)?
-      bool shouldFlagSaved = !TII->isSafeToClobberEFLAGS(MBB, it);
-      // Does this instruction modify (define/kill) flags?
-      // bool isFlagModifiedInInstr = false;
-      // Example instruction sequence describing how these booleans are set:
-      //   mov eax, 1    # false, false
-      //   add eax, 1    # false, true
-      //   cmp eax, ebx  # false, true
-      //   mov ecx, 1    # true,  false (caution!)
-      //   mov edx, 2    # true,  false (caution!)
-      //   je .Local1    # true,  false
-      //   add eax, ebx  # false, true
-      //   adc ecx, edx  # true,  true
-      //   adc ecx, 1    # true,  true
-
-      ROPChain       result;
-      ROPChainStatus status =
-          ROPEngine(*BA).ropify(MI, MIScratchRegs, shouldFlagSaved, result);
-
-      bool isJump = result.hasConditionalJump || result.hasUnconditionalJump;
-      if (isJump && result.flagSave == FlagSaveMode::SAVE_AFTER_EXEC) {
-        // when flag should be saved after resume, jmp instruction cannot be
-        // ROPified
-        status = ROPChainStatus::ERR_UNSUPPORTED;
-      }
-
-      instr_stat[MI.getOpcode()][status]++;
-
       if (status != ROPChainStatus::OK) {
         DEBUG_WITH_TYPE(PROCESSED_INSTR,
                         dbg_fmt("{}\t✗ Unsupported instruction{}\n",
                                 COLOR_RED,
                                 COLOR_RESET));
 
-        if (chain0.valid()) {
-          insertROPChain(chain0, MBB, *prevMI, chainID++, param);
-          chain0.clear();
+        if (ORE) {
+          ORE->emit([&]() {
+            MachineOptimizationRemarkMissed remark(X86_ROPFUSCATOR_PASS_NAME,
+                                                   "NotObfuscated",
+                                                   MI.getDebugLoc(),
+                                                   &MBB);
+            remark << "instruction " << ore::NV("Opcode", TII->getName(op))
+                   << " not obfuscated: "
+                   << ore::NV("Reason", getStatusName(status));
+
+            if (status == ROPChainStatus::ERR_NO_GADGETS_AVAILABLE) {
+              const MissingGadget &missing = planned.missing;
+
+              remark << " (gadget "
+                     << ore::NV("GadgetType", gadgetTypeName(missing.type));
+              if (missing.reg1 != X86::NoRegister) {
+                remark << " " << ore::NV("Reg1", TRI->getName(missing.reg1));
+              }
+              if (missing.reg2 != X86::NoRegister) {
+                remark << ", " << ore::NV("Reg2", TRI->getName(missing.reg2));
+              }
+              remark << ")";
+            } else if (status == ROPChainStatus::ERR_NO_REGISTER_AVAILABLE) {
+              remark << " ("
+                     << ore::NV("ScratchRegs",
+                                (unsigned)planned.scratchRegs.size())
+                     << " scratch registers)";
+            }
+            return remark;
+          });
         }
         continue;
       }
-      // add current instruction in the To-Delete list
-      instrToDelete.push_back(&MI);
 
-      if (chain0.canMerge(result)) {
-        chain0.merge(result);
-      } else {
-        if (chain0.valid()) {
-          insertROPChain(chain0, MBB, *prevMI, chainID++, param);
-          chain0.clear();
+      // left native, to be hidden in a chain
+      if (!planned.replaced) {
+        continue;
+      }
+
+      if (interpreter) {
+        std::string error;
+        if (!interpreter->verify(MI,
+                                 planned.chain,
+                                 planned.scratchRegs,
+                                 error)) {
+          dbg_fmt("[!] {}: chain does not match {}\t({})\n",
+                  funcName,
+                  TII->getName(MI.getOpcode()),
+                  error);
         }
-        chain0 = std::move(result);
       }
-      prevMI = &MI;
 
       DEBUG_WITH_TYPE(PROCESSED_INSTR,
                       dbg_fmt("{}\t✓ Replaced{}\n", COLOR_GREEN, COLOR_RESET));
@@ -967,18 +2375,218 @@ void ROPfuscatorCore::obfuscateFunction(MachineFunction &MF) {
       obfuscated++;
     }
 
-    if (chain0.valid()) {
-      insertROPChain(chain0, MBB, *prevMI, chainID++, param);
-      chain0.clear();
+    instrToDelete.insert(instrToDelete.end(),
+                         block.instrToDelete.begin(),
+                         block.instrToDelete.end());
+
+    for (PendingChain &pending : block.chains) {
+      pending.id      = chainID++;
+      pending.length  = pending.chain.size();
+      pending.lowered = lowerROPChain(pending.chain,
+                                      MBB,
+                                      *pending.instrs.back(),
+                                      pending.id,
+                                      pending.param);
+    }
+  };
+
+  // insertUnmovedChain - replaces an instruction left native to be hidden in
+  // a chain, but which could not be moved into it, by its own chain
+  auto insertUnmovedChain = [&](MachineBasicBlock &MBB,
+                                PlannedInstr      &planned) {
+    MachineInstr &MI     = *planned.MI;
+    int           id     = chainID++;
+    size_t        length = planned.chain.size();
+
+    if (interpreter) {
+      std::string error;
+      if (!interpreter->verify(MI, planned.chain, planned.scratchRegs, error)) {
+        dbg_fmt("[!] {}: chain does not match {}\t({})\n",
+                funcName,
+                TII->getName(MI.getOpcode()),
+                error);
+      }
+    }
+
+    std::unique_ptr<LoweredChain> lowered =
+        lowerROPChain(planned.chain, MBB, MI, id, planned.hideParam);
+    if (opaqueThreads) {
+      opaqueThreads->wait();
+    }
+
+    std::vector<MachineInstr *> noHiddenInstrs;
+    SavedRegsLink               noSavedRegsLink;
+    insertROPChain(*lowered, MBB, MI, noHiddenInstrs, noSavedRegsLink);
+    instrToDelete.push_back(&MI);
+    obfuscated++;
+
+    if (ORE) {
+      ORE->emit([&]() {
+        return MachineOptimizationRemark(X86_ROPFUSCATOR_PASS_NAME,
+                                         "Obfuscated",
+                                         MI.getDebugLoc(),
+                                         &MBB)
+               << "instruction "
+               << ore::NV("Opcode", TII->getName(MI.getOpcode()))
+               << " replaced by chain " << ore::NV("ChainID", id) << " ("
+               << ore::NV("ChainLength", (unsigned)length) << " elements)";
+      });
+    }
+  };
+
+  // insertBlock - inserts the chains of the block, once their opaque
+  // constructs are generated
+  auto insertBlock = [&](PendingBlock &block) {
+    MachineBasicBlock &MBB = *block.MBB;
+
+    // the registers clobbered by the opaque constructs of a chain can be
+    // restored by the next chain, rather than being restored and saved again
+    SavedRegsLink savedRegsLink;
+    for (size_t i = 0; i < block.chains.size(); i++) {
+      PendingChain &pending = block.chains[i];
+
+      savedRegsLink.keepable.clear();
+      if (pending.param.opaquePredicatesEnabled &&
+          i + 1 < block.chains.size()) {
+        savedRegsLink.keepable =
+            keepableRegs(pending.chain,
+                         block.chains[i + 1].chain,
+                         *pending.instrs.back(),
+                         *block.chains[i + 1].instrs.front(),
+                         TRI,
+                         MCII);
+      }
+
+      insertROPChain(*pending.lowered,
+                     MBB,
+                     *pending.instrs.back(),
+                     pending.hiddenInstrs,
+                     savedRegsLink);
+      savedRegsLink.inherited = std::move(savedRegsLink.kept);
+
+      // the native instructions up to the next chain run with the slots
+      // reserved on the stack
+      if (!savedRegsLink.inherited.empty()) {
+        adjustStackOperands(*pending.instrs.back(),
+                            *block.chains[i + 1].instrs.front(),
+                            savedRegsLink.reservedSize);
+      }
+
+      if (ORE) {
+        for (MachineInstr *MI : pending.instrs) {
+          ORE->emit([&]() {
+            return MachineOptimizationRemark(X86_ROPFUSCATOR_PASS_NAME,
+                                             "Obfuscated",
+                                             MI->getDebugLoc(),
+                                             &MBB)
+                   << "instruction "
+                   << ore::NV("Opcode", TII->getName(MI->getOpcode()))
+                   << " replaced by chain " << ore::NV("ChainID", pending.id)
+                   << " (" << ore::NV("ChainLength", pending.length)
+                   << " elements)";
+          });
+        }
+        for (MachineInstr *MI : pending.hiddenInstrs) {
+          ORE->emit([&]() {
+            return MachineOptimizationRemark(X86_ROPFUSCATOR_PASS_NAME,
+                                             "Hidden",
+                                             MI->getDebugLoc(),
+                                             &MBB)
+                   << "instruction "
+                   << ore::NV("Opcode", TII->getName(MI->getOpcode()))
+                   << " hidden in chain " << ore::NV("ChainID", pending.id);
+          });
+        }
+      }
     }
 
-    // delete old vanilla instructions only after we finished to iterate through
-    // the basic block
-    for (auto &MI : instrToDelete) {
-      MI->eraseFromParent();
+    // the instructions left native to be hidden, but which were not moved
+    // into a chain (no chain follows them in the block, or they use the
+    // registers saved by the chain), are replaced by their own chains
+    std::set<MachineInstr *> hidden;
+    for (PendingChain &pending : block.chains) {
+      hidden.insert(pending.hiddenInstrs.begin(), pending.hiddenInstrs.end());
+    }
+    for (PlannedInstr &planned : block.instrs) {
+      if (planned.status == ROPChainStatus::OK && !planned.replaced &&
+          !hidden.count(planned.MI)) {
+        insertUnmovedChain(MBB, planned);
+      }
+    }
+  };
+
+  // the setup blocks appended to the function are not obfuscated
+  std::vector<MachineBasicBlock *> blocks;
+  for (MachineBasicBlock &MBB : MF) {
+    blocks.push_back(&MBB);
+  }
+
+  for (MachineBasicBlock *MBB : blocks) {
+    pendingBlocks.emplace_back();
+    PendingBlock &block = pendingBlocks.back();
+    block.MBB           = MBB;
+    block.param         = param;
+    block.funcParam     = funcParam;
+    block.seed          = math::Random::rand();
+    block.degradation   = degradation;
+
+    // parameter at the end of the block, i.e., at the beginning of the next
+    // one: regions extend across blocks
+    for (MachineInstr &MI : *MBB) {
+      std::string preset;
+      if (regionMarker(MI, preset) &&
+          !regionParameter(config,
+                           preset,
+                           funcParam,
+                           is64Bit,
+                           degradation,
+                           param)) {
+        dbg_fmt("[!] {}: unknown preset \"{}\"\n", funcName, preset);
+      }
     }
 
-    instrToDelete.clear();
+    auto job = [this, &block, is64Bit]() {
+      planBlock(block,
+                *BA,
+                TII,
+                config,
+                is64Bit,
+                interpreter != nullptr,
+                unreachableGadgets);
+    };
+    runOnWorkers(std::move(job));
+  }
+
+  // wait for the plans
+  if (opaqueThreads) {
+    opaqueThreads->wait();
+  }
+
+  for (PendingBlock &block : pendingBlocks) {
+    lowerBlock(block);
+  }
+
+  // wait for the opaque constructs
+  if (opaqueThreads) {
+    opaqueThreads->wait();
+  }
+
+  for (PendingBlock &block : pendingBlocks) {
+    insertBlock(block);
+  }
+
+  // delete old vanilla instructions only after we finished to iterate through
+  // the function
+  for (auto &MI : instrToDelete) {
+    MI->eraseFromParent();
+  }
+
+  if (degradation != Degradation::NONE) {
+    dbg_fmt("[!] {}: compile-time budget exceeded, obfuscation degraded to "
+            "{}\n",
+            funcName,
+            degradationName(degradation));
+    degradedFunctions.emplace_back(funcName, degradation);
   }
 
   // print obfuscation stats for this function
@@ -11,17 +11,26 @@
 
 #define ROPFUSCATOR_OBFUSCATION_STATISTICS_FILE_HEAD                           \
   "ropfuscator_obfuscation_stats"
+#include <functional>
 #include <map>
+#include <memory>
+#include <set>
+#include <utility>
 
 #include "ChainElem.h"
 #include "ROPfuscatorConfig.h"
 
+#define X86_ROPFUSCATOR_PASS_NAME "x86-ropfuscator"
+
 // forward declaration
 namespace llvm {
+class Function;
 class MachineFunction;
 class MachineBasicBlock;
 class MachineInstr;
+class MachineOptimizationRemarkEmitter;
 class Module;
+class ThreadPool;
 class X86InstrInfo;
 } // namespace llvm
 
@@ -30,32 +39,108 @@ namespace ropf {
 class BinaryAutopsy;
 class ROPChain;
 class ChainElementSelector;
+class ChainInterpreter;
+class OpaqueConstruct;
+
+// Cheaper obfuscation, used when the compile-time budget runs out:
+// CHEAP_OPAQUE replaces the opaque constant algorithm with "mov", ROP_ONLY
+// disables the opaque constructs.
+enum class Degradation { NONE, CHEAP_OPAQUE, ROP_ONLY };
 
 class ROPfuscatorCore {
 public:
   explicit ROPfuscatorCore(llvm::Module            &module,
                            const ROPfuscatorConfig &config);
   ~ROPfuscatorCore();
-  void obfuscateFunction(llvm::MachineFunction &MF);
+  // Obfuscates the function. If ORE is given, an optimization remark is
+  // emitted for each instruction, telling whether it has been obfuscated.
+  void obfuscateFunction(llvm::MachineFunction                  &MF,
+                         llvm::MachineOptimizationRemarkEmitter *ORE = nullptr);
+
+  // chain converted to push instructions (see lowerROPChain())
+  struct LoweredChain;
 
 private:
-  ROPfuscatorConfig         config;
-  BinaryAutopsy            *BA;
-  const llvm::X86InstrInfo *TII;
-  ChainElementSelector     *gadgetAddressSelector;
-  ChainElementSelector     *immediateSelector;
-  ChainElementSelector     *branchTargetSelector;
-  std::string               sourceFileName;
+  ROPfuscatorConfig                    config;
+  // analysis of the library, shared with the other modules (see
+  // BinaryAutopsy::acquire())
+  std::shared_ptr<const BinaryAutopsy> BA;
+  const llvm::X86InstrInfo            *TII;
+  ChainElementSelector                *gadgetAddressSelector;
+  ChainElementSelector                *immediateSelector;
+  ChainElementSelector                *branchTargetSelector;
+  ChainInterpreter                    *interpreter;
+  std::string                          sourceFileName;
+
+  // plan the chains of the basic blocks and generate the opaque constructs
+  // (see runOnWorkers())
+  std::unique_ptr<llvm::ThreadPool> opaqueThreads;
+
+  // block receiving the code building the chains of the current function,
+  // when it is not placed inline (see getChainSetupBlock())
+  llvm::MachineBasicBlock *chainSetupBlock = nullptr;
+  // the code is inserted before this instruction (or at the end of the block)
+  llvm::MachineInstr      *chainSetupEnd   = nullptr;
+
+  // symbols of the library referencing the gadgets in this module (see
+  // BinaryAutopsy::getModuleSymbols())
+  std::vector<const Symbol *> anchorSymbols;
+  // versioned symbols whose .symver directive has been emitted
+  std::set<const Symbol *>    versionedSymbolsUsed;
+
+  // anchor symbols defined in a section of the static archive
+  struct SectionAnchors {
+    uint64_t                    end;
+    std::vector<const Symbol *> symbols;
+  };
+  // sections of the static archive, by start address (see pickSectionAnchor())
+  std::map<uint64_t, SectionAnchors> sectionAnchors;
+  // gadgets of the static archive without any address in a section defining
+  // an anchor symbol: the instructions using them are left native
+  std::set<const Microgadget *>      unreachableGadgets;
+
+  // presets selected by function annotations
+  std::map<const llvm::Function *, std::string> functionPresets;
 
   struct ROPChainStatEntry;
   std::map<unsigned, ROPChainStatEntry> instr_stat;
   size_t                                total_chain_elems         = 0;
   size_t                                module_total_instructions = 0;
   size_t                                processed_instructions    = 0;
+  size_t                                hidden_instructions       = 0;
   // for progress report
   size_t                                total_func_count          = 0;
   size_t                                curr_func_count           = 0;
 
+  // compile-time budget: estimated compile time of the functions processed
+  // so far (in seconds, see estimatedCost())
+  double      moduleEstimate    = 0;
+  // degradation of the remaining functions (never decreases)
+  Degradation moduleDegradation = Degradation::NONE;
+  // functions which have been degraded
+  std::vector<std::pair<std::string, Degradation>> degradedFunctions;
+
+  // Returns the degradation level of a function of instrCount instructions,
+  // obfuscated with param, such that its estimated compile time fits in the
+  // budgets. It only depends on the functions processed before.
+  Degradation chooseDegradation(size_t                      instrCount,
+                                const ObfuscationParameter &param);
+
+  // Registers kept saved from a chain to the next chains of the same block
+  // (see insertROPChain()), in slots reserved above the stack pointer while
+  // the native instructions in between run. Slots are stack offsets from the
+  // stack pointer between the chains.
+  struct SavedRegsLink {
+    // registers which the chain may keep saved
+    std::set<unsigned int>      keepable;
+    // registers kept saved by the previous chains, and their slots
+    std::map<unsigned int, int> inherited;
+    // registers kept saved by this chain, and their slots
+    std::map<unsigned int, int> kept;
+    // size of the reserved slots, released by the first chain keeping none
+    int                         reservedSize = 0;
+  };
+
   // Randomly reduces the number of specific type(s) of chain elements to the
   // specified percentage. The indices of the chain elements are saved into
   // outVector.
@@ -64,11 +149,51 @@ private:
                                        std::vector<ChainElem::Type> elemTypes,
                                        std::vector<unsigned>       &outVector);
 
-  void insertROPChain(ROPChain                   &chain,
-                      llvm::MachineBasicBlock    &MBB,
-                      llvm::MachineInstr         &MI,
-                      int                         chainID,
-                      const ObfuscationParameter &param);
+  // Runs the job on the worker threads, or right away if opaque_threads is 1.
+  // Jobs are waited for with opaqueThreads->wait().
+  void runOnWorkers(std::function<void()> job);
+
+  // Generates an opaque construct on the worker threads, using a seed drawn
+  // from the random engine of the caller: the result does not depend on the
+  // scheduling of the threads. out is set once opaqueThreads has finished.
+  void spawnOpaqueConstruct(
+      std::shared_ptr<OpaqueConstruct>                 &out,
+      std::function<std::shared_ptr<OpaqueConstruct>()> create);
+
+  // Returns the section of the static archive containing address, if it
+  // defines an anchor symbol (nullptr otherwise).
+  const SectionAnchors *findSectionAnchors(uint64_t address) const;
+
+  // Picks a random address of the gadget among the ones in a section of the
+  // static archive, and a random anchor symbol of that section. The gadget
+  // must not be one of the unreachableGadgets.
+  const Symbol *pickSectionAnchor(const Microgadget &gadget,
+                                  uint64_t          &address) const;
+
+  // Converts the chain to the push instructions emitted in place of MI.
+  // Their opaque constructs are generated asynchronously.
+  std::unique_ptr<LoweredChain>
+  lowerROPChain(ROPChain                   &chain,
+                llvm::MachineBasicBlock    &MBB,
+                llvm::MachineInstr         &MI,
+                int                         chainID,
+                const ObfuscationParameter &param);
+
+  // Returns the block where the code building the chains of MF is placed,
+  // according to chain_setup_placement: nullptr if it is inline, otherwise a
+  // block appended to the function (whose code is moved to .text.unlikely
+  // with the "cold" placement).
+  llvm::MachineBasicBlock *getChainSetupBlock(llvm::MachineFunction &MF);
+
+  // Emits the lowered chain in place of MI, once its opaque constructs are
+  // generated. hiddenInstrs are native instructions preceding the chain,
+  // which are moved into the code pushing the chain; the ones which cannot be
+  // moved are removed from the list.
+  void insertROPChain(LoweredChain                      &lowered,
+                      llvm::MachineBasicBlock           &MBB,
+                      llvm::MachineInstr                &MI,
+                      std::vector<llvm::MachineInstr *> &hiddenInstrs,
+                      SavedRegsLink                     &savedRegsLink);
 };
 
 } // namespace ropf
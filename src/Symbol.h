@@ -22,11 +22,9 @@ struct Symbol {
   // a gadget in memory we'll use this as base address.
   uint64_t Address;
 
-  mutable bool isUsed;
-
   // Constructor
   Symbol(std::string label, std::string version, uint64_t address)
-      : Label(label), Version(version), Address(address), isUsed(false) {}
+      : Label(label), Version(version), Address(address) {}
 
   // SymVerDirective - it is just an inline asm directive we need to place to
   // force the static linker to pick the right symbol version during the
@@ -1,26 +1,65 @@
 #include "Utils.h"
+#include <map>
 #include <string>
 #include <system_error>
+#include <vector>
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Path.h"
 
-std::string findLibraryPath(const std::string &libfile) {
-  for (auto &dir : SYSTEM_LIB_FOLDERS) {
-    // searching for libc in regular files only
+namespace {
+
+// LibraryIndex - file name -> paths of the files with that name, in the
+// order of the system library folders
+typedef std::map<std::string, std::vector<std::string>> LibraryIndex;
+
+template <size_t N>
+LibraryIndex buildLibraryIndex(const std::string (&folders)[N]) {
+  LibraryIndex index;
+
+  for (auto &dir : folders) {
     std::error_code ec;
 
+    // only the directory entries are read here: file types are checked on
+    // lookup, for the candidates of the requested library only
     for (auto dir_it  = llvm::sys::fs::directory_iterator(dir, ec),
               dir_end = llvm::sys::fs::directory_iterator();
          !ec && dir_it != dir_end;
          dir_it.increment(ec)) {
-      auto st = dir_it->status();
-      if (st && st->type() == llvm::sys::fs::file_type::regular_file &&
-          llvm::sys::path::filename(dir_it->path()) == libfile) {
-        std::string libraryPath = dir_it->path();
-        return libraryPath;
-      }
+      index[llvm::sys::path::filename(dir_it->path()).str()].push_back(
+          dir_it->path());
+    }
+  }
+
+  return index;
+}
+
+std::string lookupLibrary(const LibraryIndex &index,
+                          const std::string  &libfile) {
+  auto it = index.find(libfile);
+
+  if (it == index.end()) {
+    return "";
+  }
+
+  // searching for libc in regular files only
+  for (auto &path : it->second) {
+    if (llvm::sys::fs::is_regular_file(path)) {
+      return path;
     }
   }
 
   return "";
 }
+
+} // namespace
+
+std::string findLibraryPath(const std::string &libfile, bool is64Bit) {
+  // the system library folders are listed only once, on the first lookup
+  if (is64Bit) {
+    static const LibraryIndex index64 = buildLibraryIndex(SYSTEM_LIB64_FOLDERS);
+    return lookupLibrary(index64, libfile);
+  }
+
+  static const LibraryIndex index32 = buildLibraryIndex(SYSTEM_LIB_FOLDERS);
+  return lookupLibrary(index32, libfile);
+}
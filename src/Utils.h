@@ -14,7 +14,17 @@ const std::string SYSTEM_LIB_FOLDERS[] = {
     "/usr/lib",
 };
 
-std::string findLibraryPath(const std::string &libfile);
+const std::string SYSTEM_LIB64_FOLDERS[] = {
+    "/lib/x86_64-linux-gnu",
+    "/usr/lib/x86_64-linux-gnu",
+    "/lib64",
+    "/usr/lib64",
+    "/usr/local/lib",
+    "/lib",
+    "/usr/lib",
+};
+
+std::string findLibraryPath(const std::string &libfile, bool is64Bit = false);
 
 namespace ropf {
 template <typename T,
@@ -2,6 +2,7 @@
 #define X86ASSEMBLEHELPER_H
 
 #include "Debug.h"
+#include "MCTargetDesc/X86BaseInfo.h"
 #include "X86TargetMachine.h"
 #include "llvm/CodeGen/MachineInstrBuilder.h"
 #include "llvm/MC/MCContext.h"
@@ -29,9 +30,11 @@ public:
   struct ImmGlobal {
     const llvm::GlobalValue *global;
     int64_t                  offset;
+    // X86II::MO_* relocation modifier, e.g. @GOTOFF
+    unsigned int             flags = 0;
 
     void add(llvm::MachineInstrBuilder &builder) const {
-      builder.addGlobalAddress(global, offset);
+      builder.addGlobalAddress(global, offset, flags);
     }
   };
 
@@ -62,6 +65,24 @@ public:
     }
   };
 
+  // absolute memory operand, i.e. [global + offset], or relative to a base
+  // register, e.g. [reg + global@GOT] or [rip + global@GOTPCREL]
+  struct MemGlobal {
+    const llvm::GlobalValue *global;
+    int64_t                  offset;
+    llvm_reg_t               reg   = llvm::X86::NoRegister;
+    // X86II::MO_* relocation modifier
+    unsigned int             flags = 0;
+
+    void add(llvm::MachineInstrBuilder &builder) const {
+      builder.addReg(reg)
+          .addImm(1)
+          .addReg(llvm::X86::NoRegister)
+          .addGlobalAddress(global, offset, flags)
+          .addReg(llvm::X86::NoRegister);
+    }
+  };
+
   X86AssembleHelper(llvm::MachineBasicBlock          &block,
                     llvm::MachineBasicBlock::iterator position)
       : block(block), position(position), ctx(block.getParent()->getContext()),
@@ -80,6 +101,21 @@ public:
           llvm_reg_t segment = llvm::X86::NoRegister) const {
     return {r, scale, idx, ofs, segment};
   }
+  MemGlobal mem(const llvm::GlobalValue *global, int64_t offset = 0) const {
+    return {global, offset};
+  }
+  MemGlobal mem(llvm_reg_t               r,
+                const llvm::GlobalValue *global,
+                int64_t                  offset = 0,
+                unsigned int             flags  = 0) const {
+    return {global, offset, r, flags};
+  }
+  MemGlobal mem(llvm_reg_t   r,
+                Label        label,
+                int64_t      offset = 0,
+                unsigned int flags  = 0) const {
+    return mem(r, _createGV(label.symbol->getName()), offset, flags);
+  }
   Label label() const { return label(_newLabelName()); }
   Label label(const std::string label) const {
     return {ctx.getOrCreateSymbol(label)};
@@ -87,6 +123,27 @@ public:
   ImmGlobal addOffset(Label label, int64_t offset) const {
     return imm(_createGV(label.symbol->getName()), offset);
   }
+  // offset from the GOT (x86-32 position-independent code)
+  ImmGlobal gotoff(const llvm::GlobalValue *global, int64_t offset = 0) const {
+    return {global, offset, llvm::X86II::MO_GOTOFF};
+  }
+  ImmGlobal gotoff(Label label, int64_t offset = 0) const {
+    return gotoff(_createGV(label.symbol->getName()), offset);
+  }
+  // loads the GOT address into r (x86-32 position-independent code):
+  //   call next
+  // next:
+  //   pop r
+  //   lea r, [r + _GLOBAL_OFFSET_TABLE_ + 1]
+  // The assembler resolves _GLOBAL_OFFSET_TABLE_ relative to the field,
+  // i.e. to next + 1 + (field offset).
+  void loadGOT(Reg r) {
+    Label next = label();
+    call(next);
+    putLabel(next);
+    pop(r);
+    lea(r, mem(r.reg, _createGV("_GLOBAL_OFFSET_TABLE_"), 1));
+  }
   ImmGlobal createData(const void *data, size_t size) {
     return createData(_newLabelName(), data, size);
   }
@@ -102,12 +159,15 @@ public:
   void mov(Mem m, Reg r) const { _instr(llvm::X86::MOV32mr, m, r); }
   void mov(Mem m, Imm i) const { _instr(llvm::X86::MOV32mi, m, i); }
   void mov(Mem m, ImmGlobal i) const { _instr(llvm::X86::MOV32mi, m, i); }
+  void mov(Reg r, MemGlobal m) const { _instr(llvm::X86::MOV32rm, r, m); }
+  void mov(MemGlobal m, Reg r) const { _instr(llvm::X86::MOV32mr, m, r); }
   void mov8(Reg r1, Reg r2) const { _instr(llvm::X86::MOV8rr, r1, r2); }
   void add(Reg r1, Reg r2) const { _instrd(llvm::X86::ADD32rr, r1, r2); }
   void add(Reg r, Imm i) const { _instrd(llvm::X86::ADD32ri, r, i); }
   void add(Reg r, ImmGlobal i) const { _instrd(llvm::X86::ADD32ri, r, i); }
   void add(Reg r, Label i) const { _instrd(llvm::X86::ADD32ri, r, i); }
   void add(Reg r, Mem m) const { _instrd(llvm::X86::ADD32rm, r, m); }
+  void add(Reg r, MemGlobal m) const { _instrd(llvm::X86::ADD32rm, r, m); }
   void add(Mem m, Reg r) const { _instr(llvm::X86::ADD32mr, m, r); }
   void add(Mem m, Imm i) const { _instr(llvm::X86::ADD32mi, m, i); }
   void add(Mem m, ImmGlobal i) const { _instr(llvm::X86::ADD32mi, m, i); }
@@ -149,6 +209,8 @@ public:
   void push(Imm i) const { _instr(llvm::X86::PUSHi32, i); }
   void push(ImmGlobal i) const { _instr(llvm::X86::PUSHi32, i); }
   void push(Label i) const { _instr(llvm::X86::PUSHi32, i); }
+  void push(Mem m) const { _instr(llvm::X86::PUSH32rmm, m); }
+  void push(MemGlobal m) const { _instr(llvm::X86::PUSH32rmm, m); }
   void pop(Reg r) const { _instr(llvm::X86::POP32r, r); }
   void pushf() const { _instr(llvm::X86::PUSHF32); }
   void popf() const { _instr(llvm::X86::POPF32); }
@@ -157,6 +219,19 @@ public:
   void call(Label l) const { _instr(llvm::X86::CALLpcrel32, l); }
   void jmp(Label l) const { _instr(llvm::X86::JMP_1, l); }
 
+  // x86-64
+  void mov64(Reg r, Imm i) const { _instr(llvm::X86::MOV64ri, r, i); }
+  void mov64(Reg r, ImmGlobal i) const { _instr(llvm::X86::MOV64ri, r, i); }
+  void mov64(Reg r, Label i) const { _instr(llvm::X86::MOV64ri, r, i); }
+  void mov64(Reg r, MemGlobal m) const { _instr(llvm::X86::MOV64rm, r, m); }
+  void mov64(Mem m, Reg r) const { _instr(llvm::X86::MOV64mr, m, r); }
+  void push64(Reg r) const { _instr(llvm::X86::PUSH64r, r); }
+  void push64(Imm i) const { _instr(llvm::X86::PUSH64i32, i); }
+  void pop64(Reg r) const { _instr(llvm::X86::POP64r, r); }
+  void pushf64() const { _instr(llvm::X86::PUSHF64); }
+  void popf64() const { _instr(llvm::X86::POPF64); }
+  void ret64() const { _instr(llvm::X86::RETQ); }
+
 #if LLVM_VERSION_MAJOR >= 9
   void cmove(Reg r1, Reg r2) const {
     _instrd(llvm::X86::CMOV32rr, r1, r2, imm(llvm::X86::COND_E));
@@ -194,6 +269,21 @@ public:
         BuildMI(block, position, nullptr, TII->get(llvm::X86::LEA32r), r.reg);
     m.add(builder);
   }
+  void lea(Reg r, MemGlobal m) const {
+    auto builder =
+        BuildMI(block, position, nullptr, TII->get(llvm::X86::LEA32r), r.reg);
+    m.add(builder);
+  }
+  void lea64(Reg r, Mem m) const {
+    auto builder =
+        BuildMI(block, position, nullptr, TII->get(llvm::X86::LEA64r), r.reg);
+    m.add(builder);
+  }
+  void lea64(Reg r, MemGlobal m) const {
+    auto builder =
+        BuildMI(block, position, nullptr, TII->get(llvm::X86::LEA64r), r.reg);
+    m.add(builder);
+  }
   // Don't use this function unless really necessary;
   // LLVM will create assembly parser for each inline assembly code,
   // which will heavily slow down the build process.
@@ -206,11 +296,18 @@ public:
         .addImm(0);
   }
   void putLabel(Label label) { _instr(llvm::TargetOpcode::GC_LABEL, label); }
+  // moves an existing instruction of the same function to this position
+  void moveInstr(llvm::MachineInstr &MI) const {
+    block.splice(position, MI.getParent(), MI.getIterator());
+  }
 
   // To deal with C++ exception in EHStreamer::computeCallSiteTable
   void dummyCall(const llvm::GlobalValue *callee) const {
     _instr(llvm::X86::TCRETURNdi, imm(callee, 0));
   }
+  void dummyCall64(const llvm::GlobalValue *callee) const {
+    _instr(llvm::X86::TCRETURNdi64, imm(callee, 0));
+  }
 
   void debug_generated() const {
     llvm::MachineBasicBlock::iterator position0 = position;
@@ -318,6 +415,10 @@ struct StackState {
   std::map<int, Value>        saved_values;
   int                         stack_offset;
   bool                        stack_mangled;
+  // base of the position-independent addresses: the register holding the
+  // GOT address on x86-32, RIP on x86-64 (NoRegister if addresses are
+  // relocated in the code)
+  unsigned int                pic_base = llvm::X86::NoRegister;
 
   void addReg(unsigned int reg, int offset) {
     regs_location.emplace(reg, offset);
@@ -6,16 +6,17 @@
 //
 
 #include "Debug.h"
+#include "OpaqueBenchmark.h"
 #include "ROPfuscatorConfig.h"
 #include "ROPfuscatorCore.h"
 #include "llvm/CodeGen/MachineFunctionPass.h"
+#include "llvm/CodeGen/MachineOptimizationRemarkEmitter.h"
 #include "llvm/Pass.h"
 #include "llvm/PassSupport.h"
 #include "llvm/Support/CommandLine.h"
 #include "../../X86Subtarget.h"
 #include <memory>
 
-#define X86_ROPFUSCATOR_PASS_NAME "x86-ropfuscator"
 #define X86_ROPFUSCATOR_PASS_DESC "Obfuscate machine code through ROP chains"
 
 namespace llvm {
@@ -50,6 +51,12 @@ cl::opt<std::string> RopfuscatorGadgetLibrary(
     cl::Optional,
     cl::ValueRequired);
 
+cl::opt<bool> RopfuscatorOpaqueBench(
+    "ropfuscator-opaque-bench",
+    cl::desc("Replace " OPAQUE_BENCH_FUNCTION_PREFIX
+             "* functions with opaque construct benchmarks"),
+    cl::Hidden);
+
 // ----------------------------------------------------------------
 
 class X86ROPfuscator : public MachineFunctionPass {
@@ -64,13 +71,31 @@ public:
 
   StringRef getPassName() const override { return X86_ROPFUSCATOR_PASS_NAME; }
 
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    // optimization remarks (-Rpass=x86-ropfuscator, ...)
+    AU.addRequired<MachineOptimizationRemarkEmitterPass>();
+    MachineFunctionPass::getAnalysisUsage(AU);
+  }
+
   bool runOnMachineFunction(MachineFunction &MF) override {
-    if (!MF.getSubtarget<X86Subtarget>().is32Bit()) {
+    const X86Subtarget &subtarget = MF.getSubtarget<X86Subtarget>();
+
+    // x86-32 and x86-64 (but not x32) are supported
+    if (!subtarget.is32Bit() &&
+        !(subtarget.is64Bit() && !subtarget.isTarget64BitILP32())) {
       return false;
     }
 
+    if (RopfuscatorOpaqueBench) {
+      // benchmark mode: only the benchmark functions are touched
+      // (opaque constructs are x86-32 only)
+      return subtarget.is32Bit() && emitOpaqueBenchmark(MF);
+    }
+
     if (ropfuscator) {
-      ropfuscator->obfuscateFunction(MF);
+      ropfuscator->obfuscateFunction(
+          MF,
+          &getAnalysis<MachineOptimizationRemarkEmitterPass>().getORE());
       return true;
     }
 
@@ -108,6 +133,16 @@ public:
 
     ropfuscator = new ROPfuscatorCore(module, config);
 
+    // ROP chains are pushed below the stack pointer: on x86-64 they would
+    // overwrite the red zone
+    if (Triple(module.getTargetTriple()).getArch() == Triple::x86_64) {
+      for (auto &f : module.getFunctionList()) {
+        if (!f.isDeclaration()) {
+          f.addFnAttr(Attribute::NoRedZone);
+        }
+      }
+    }
+
     return true;
   }
 
@@ -133,8 +168,14 @@ using ropf::X86ROPfuscator;
 
 FunctionPass *llvm::createX86ROPfuscatorPass() { return new X86ROPfuscator(); }
 
-INITIALIZE_PASS(X86ROPfuscator,
-                X86_ROPFUSCATOR_PASS_NAME,
-                X86_ROPFUSCATOR_PASS_DESC,
-                false,
-                false)
+INITIALIZE_PASS_BEGIN(X86ROPfuscator,
+                      X86_ROPFUSCATOR_PASS_NAME,
+                      X86_ROPFUSCATOR_PASS_DESC,
+                      false,
+                      false)
+INITIALIZE_PASS_DEPENDENCY(MachineOptimizationRemarkEmitterPass)
+INITIALIZE_PASS_END(X86ROPfuscator,
+                    X86_ROPFUSCATOR_PASS_NAME,
+                    X86_ROPFUSCATOR_PASS_DESC,
+                    false,
+                    false)
@@ -32,7 +32,8 @@
 
 namespace ropf {
 
-#define N_REGS 100
+// N_REGS - upper bound of the register numbers (X86::NUM_TARGET_REGS)
+#define N_REGS 320
 
 typedef std::vector<std::pair<int, int>> XchgPath;
 
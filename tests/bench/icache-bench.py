@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+# Measures the instruction cache misses of the testcases (tests/src) with each
+# chain setup placement (inline, outlined, cold; see chain_setup_placement).
+# Each testcase is built with a ROPfuscator-enabled clang and the same seed
+# for every placement, so that the chains are the same, and run under
+# "perf stat"; the "misses" column is the mean of L1-icache-load-misses over
+# the runs, "per 1k" divides it by the retired instructions.
+#
+# usage: icache-bench.py [--cc clang] [--perf perf] [--cflags FLAGS]
+#                        [--repeat N] [testcase.c ...]
+
+import argparse
+import glob
+import os
+import shlex
+import subprocess
+import sys
+import tempfile
+
+PLACEMENTS = ["inline", "outlined", "cold"]
+EVENTS = ["L1-icache-load-misses", "instructions"]
+TESTCASES = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                         os.pardir, "src", "testcase*.c")
+
+
+def write_config(path: str, placement: str):
+    with open(path, "w") as f:
+        f.write("[general]\n"
+                "obfuscation_enabled = true\n"
+                "rng_seed = 0123456789\n"
+                f"chain_setup_placement = \"{placement}\"\n"
+                "\n"
+                "[functions.default]\n"
+                "obfuscation_enabled = true\n"
+                "opaque_predicates_enabled = true\n")
+
+
+def build(cc: str, cflags: list, config: str, source: str, output: str):
+    subprocess.run([cc, "-m32", *cflags, "-mllvm",
+                    f"-ropfuscator-config={config}", source, "-o", output],
+                   check=True, stdout=subprocess.DEVNULL)
+
+
+def perf_stat(perf: str, repeat: int, binary: str) -> dict:
+    """returns {event: mean count}, or None if an event is not supported"""
+    result = subprocess.run([perf, "stat", "-x", ",", "-r", str(repeat),
+                             "-e", ",".join(EVENTS), binary],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                            text=True)
+    if result.returncode != 0:
+        raise RuntimeError(f"{binary} failed ({result.returncode}):\n"
+                           f"{result.stderr}")
+    counts = {}
+
+    # CSV output: value,unit,event,...
+    for line in result.stderr.splitlines():
+        fields = line.split(",")
+        if len(fields) >= 3 and fields[2] in EVENTS:
+            if not fields[0].replace(".", "").isdigit():
+                return None
+            counts[fields[2]] = float(fields[0])
+
+    return counts if len(counts) == len(EVENTS) else None
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--cc", default=os.environ.get("CC", "clang"))
+    parser.add_argument("--perf", default="perf")
+    parser.add_argument("--cflags", default="-O2")
+    parser.add_argument("--repeat", type=int, default=10)
+    parser.add_argument("sources", nargs="*")
+    args = parser.parse_args()
+
+    sources = args.sources or sorted(glob.glob(TESTCASES))
+    cflags = shlex.split(args.cflags)
+
+    print(f"{'testcase':<12}\t{'placement':<9}\t{'misses':>12}\t{'per 1k':>8}")
+
+    with tempfile.TemporaryDirectory() as tmpdir:
+        for source in sources:
+            name = os.path.splitext(os.path.basename(source))[0]
+
+            for placement in PLACEMENTS:
+                config = os.path.join(tmpdir, f"{placement}.toml")
+                binary = os.path.join(tmpdir, f"{name}-{placement}")
+                write_config(config, placement)
+                build(args.cc, cflags, config, source, binary)
+
+                counts = perf_stat(args.perf, args.repeat, binary)
+                if counts is None:
+                    print(f"[-] {args.perf} cannot count {', '.join(EVENTS)} "
+                          "on this machine", file=sys.stderr)
+                    return 1
+
+                misses = counts["L1-icache-load-misses"]
+                per_k = 1000 * misses / max(counts["instructions"], 1)
+                print(f"{name:<12}\t{placement:<9}\t{misses:>12.0f}\t"
+                      f"{per_k:>8.3f}")
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,126 @@
+/* Runtime microbenchmark for opaque constructs.
+ * This program must be compiled with `-mllvm -ropfuscator-opaque-bench`:
+ * a single opaque construct is then emitted right before the return of each
+ * ropf_opaque_bench__* function below, overwriting its return value in EAX.
+ * Each construct is timed with rdtsc over a loop of calls: the average
+ * number of TSC cycles per call (minus the cost of a call to the baseline
+ * function) is reported, and every computed value is checked.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <x86intrin.h>
+
+/* keep in sync with src/OpaqueBenchmark.h */
+#define OPAQUE_BENCH_VALUE         0x5eed1e55u
+#define OPAQUE_BENCH_BRANCH_VALUE2 0xa112e5eeu
+
+#define ITERATIONS 1000000
+#define ROUNDS     5
+
+#define BENCH_FUNCTION(kind, a, b)                                             \
+  uint32_t ropf_opaque_bench__##kind##__##a##__##b(void) { return 0; }
+
+#define BENCH_ENTRY(kind, a, b, is_branch)                                     \
+  { #kind "/" #a "/" #b, ropf_opaque_bench__##kind##__##a##__##b, is_branch }
+
+BENCH_FUNCTION(const, mov, const)
+BENCH_FUNCTION(const, mov, addreg)
+BENCH_FUNCTION(const, mov, rdtsc)
+BENCH_FUNCTION(const, r3sat32, const)
+BENCH_FUNCTION(const, r3sat32, addreg)
+BENCH_FUNCTION(const, r3sat32, rdtsc)
+BENCH_FUNCTION(const, multcomp, const)
+BENCH_FUNCTION(const, multcomp, addreg)
+BENCH_FUNCTION(const, multcomp, rdtsc)
+BENCH_FUNCTION(branch, addreg, mov)
+BENCH_FUNCTION(branch, rdtsc, mov)
+BENCH_FUNCTION(branch, negativestack, mov)
+
+/* not touched by ROPfuscator: measures the call overhead
+ * (same body as the benchmark functions, so that sizes can be compared) */
+uint32_t ropf_opaque_bench_baseline(void) { return 0; }
+
+struct bench {
+  const char *name;
+  uint32_t (*fn)(void);
+  int is_branch;
+};
+
+static const struct bench benches[] = {
+    BENCH_ENTRY(const, mov, const, 0),
+    BENCH_ENTRY(const, mov, addreg, 0),
+    BENCH_ENTRY(const, mov, rdtsc, 0),
+    BENCH_ENTRY(const, r3sat32, const, 0),
+    BENCH_ENTRY(const, r3sat32, addreg, 0),
+    BENCH_ENTRY(const, r3sat32, rdtsc, 0),
+    BENCH_ENTRY(const, multcomp, const, 0),
+    BENCH_ENTRY(const, multcomp, addreg, 0),
+    BENCH_ENTRY(const, multcomp, rdtsc, 0),
+    BENCH_ENTRY(branch, addreg, mov, 1),
+    BENCH_ENTRY(branch, rdtsc, mov, 1),
+    BENCH_ENTRY(branch, negativestack, mov, 1),
+};
+
+/* rdtsc is not serializing: the fences keep the timed loop between the two
+ * reads of the time stamp counter */
+static uint64_t timestamp(void) {
+  uint64_t tsc;
+
+  _mm_lfence();
+  tsc = __rdtsc();
+  _mm_lfence();
+  return tsc;
+}
+
+/* returns the minimum (over ROUNDS) average cycles per call,
+ * and counts the calls which returned an unexpected value */
+static double measure(const struct bench *b, unsigned long *errors) {
+  uint32_t (*volatile fn)(void) = b->fn;
+  double best = -1;
+
+  for (int round = 0; round < ROUNDS; round++) {
+    uint64_t start = timestamp();
+
+    for (int i = 0; i < ITERATIONS; i++) {
+      uint32_t value = fn();
+
+      if (value != OPAQUE_BENCH_VALUE &&
+          !(b->is_branch && value == OPAQUE_BENCH_BRANCH_VALUE2)) {
+        (*errors)++;
+      }
+    }
+
+    double cycles = (double)(timestamp() - start) / ITERATIONS;
+
+    if (best < 0 || cycles < best) {
+      best = cycles;
+    }
+  }
+
+  return best;
+}
+
+int main() {
+  const struct bench baseline = {"baseline", ropf_opaque_bench_baseline, 0};
+  unsigned long errors = 0, total_errors = 0;
+  double overhead = measure(&baseline, &errors);
+  int nbenches = sizeof(benches) / sizeof(benches[0]);
+
+  printf("%-28s\t%10s\t%s\n", "construct", "cycles", "check");
+
+  for (int i = 0; i < nbenches; i++) {
+    double cycles;
+
+    errors = 0;
+    cycles = measure(&benches[i], &errors) - overhead;
+    total_errors += errors;
+
+    printf("%-28s\t%10.2f\t%s\n",
+           benches[i].name,
+           cycles,
+           errors ? "WRONG VALUE" : "ok");
+  }
+
+  return total_errors ? 1 : 0;
+}
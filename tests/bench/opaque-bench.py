@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+# Builds and runs the opaque construct microbenchmark (opaque-bench.c) with a
+# ROPfuscator-enabled clang. The "cycles" column is measured at run time by
+# the harness (TSC cycles per call, timed with rdtsc over a loop of calls);
+# the "bytes" and "instrs" columns are the static size of each construct,
+# read from the binary with nm and objdump.
+#
+# usage: opaque-bench.py [--cc clang] [--objdump objdump] [--nm nm]
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+BENCH_PREFIX = "ropf_opaque_bench__"
+BASELINE = "ropf_opaque_bench_baseline"
+SOURCE = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                      "opaque-bench.c")
+
+
+def build(cc: str, output: str):
+    subprocess.run([cc, "-m32", "-O0", "-mllvm", "-ropfuscator-opaque-bench",
+                    SOURCE, "-o", output], check=True)
+
+
+def function_sizes(nm: str, binary: str) -> dict:
+    """returns {function name: size in bytes}"""
+    sizes = {}
+    out = subprocess.run([nm, "-S", binary], check=True,
+                         capture_output=True, text=True).stdout
+
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) == 4 and fields[3].startswith("ropf_opaque_bench"):
+            sizes[fields[3]] = int(fields[1], 16)
+
+    return sizes
+
+
+def function_instructions(objdump: str, binary: str) -> dict:
+    """returns {function name: number of instructions}"""
+    counts = {}
+    current = None
+    out = subprocess.run([objdump, "-d", "--no-show-raw-insn", binary],
+                         check=True, capture_output=True, text=True).stdout
+
+    for line in out.splitlines():
+        header = re.match(r"^[0-9a-f]+ <(.*)>:$", line)
+        if header:
+            current = header.group(1)
+            counts[current] = 0
+        elif current and re.match(r"^\s+[0-9a-f]+:\s+\S", line):
+            counts[current] += 1
+        elif not line.strip():
+            current = None
+
+    return counts
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--cc", default=os.environ.get("CC", "clang"))
+    parser.add_argument("--objdump", default="objdump")
+    parser.add_argument("--nm", default="nm")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmpdir:
+        binary = os.path.join(tmpdir, "opaque-bench")
+        build(args.cc, binary)
+
+        sizes = function_sizes(args.nm, binary)
+        instructions = function_instructions(args.objdump, binary)
+        result = subprocess.run([binary], capture_output=True, text=True)
+
+    base_size = sizes.get(BASELINE, 0)
+    base_instr = instructions.get(BASELINE, 0)
+
+    print(f"{'construct':<28}\t{'cycles':>10}\t{'bytes':>6}\t{'instrs':>6}\tcheck")
+
+    lines = result.stdout.splitlines()
+    if not lines or lines[0].split("\t")[1].strip() != "cycles":
+        print("[-] unexpected benchmark output:", result.stdout,
+              file=sys.stderr)
+        return 1
+
+    for line in lines[1:]:
+        name, cycles, check = line.split("\t")
+        symbol = BENCH_PREFIX + "__".join(name.strip().split("/"))
+        # sizes are relative to the empty (baseline) function
+        size = sizes.get(symbol, 0) - base_size
+        instr = instructions.get(symbol, 0) - base_instr
+        print(f"{name}\t{cycles}\t{size:>6}\t{instr:>6}\t{check}")
+
+    return result.returncode
+
+
+if __name__ == "__main__":
+    sys.exit(main())
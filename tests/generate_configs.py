@@ -3,6 +3,10 @@ from enum import Enum
 
 BOOL_VALUES = [True, False]
 PERCENTAGE_VALUES = [0, 33, 66, 100]
+# 0: unlimited
+MAX_CHAIN_LENGTH_VALUES = [0, 8]
+# 0: instruction hiding disabled
+STEGANO_PERCENTAGE_VALUES = [0, 50, 100]
 
 class OpaquePredicateAlgorithm(Enum):
     MOV = "mov"
@@ -14,6 +18,11 @@ class OpaquePredicateInputAlgorithm(Enum):
     ADDREG = "addreg"
     RDTSC = "rdtsc"
 
+class ChainSetupPlacement(Enum):
+    INLINE = "inline"
+    OUTLINED = "outlined"
+    COLD = "cold"
+
 def get_config(
         obfuscation_enabled: bool, 
         search_segment_for_gadget: bool,
@@ -58,9 +67,98 @@ def get_config(
     contextual_opaque_predicates_enabled = {contextual_opaque_predicates_enabled}
     """
 
+# chain encoding and emission options, with the lowering of cmov/setcc, imul
+# and indirect calls exercised by the testcases: every combination is tested
+# with opaque predicates enabled, on top of the default obfuscation, and each
+# chain is checked against the instruction it replaces (verify_chains)
+def get_feature_config(
+        position_independent_chains: bool,
+        chain_setup_placement: ChainSetupPlacement,
+        max_chain_length: int,
+        bundle_chains: bool,
+        opaque_stegano_percentage: int
+        ):
+
+    return f"""
+    [general]
+    obfuscation_enabled = true
+    rng_seed = 0123456789
+    verify_chains = true
+    position_independent_chains = {str(position_independent_chains).lower()}
+    chain_setup_placement = "{chain_setup_placement.value}"
+    max_chain_length = {max_chain_length}
+    bundle_chains = {str(bundle_chains).lower()}
+
+    [functions.default]
+    obfuscation_enabled = true
+    opaque_predicates_enabled = true
+    opaque_gadget_addresses_enabled = true
+    opaque_immediate_operands_enabled = true
+    opaque_branch_targets_enabled = true
+    opaque_stegano_enabled = {str(opaque_stegano_percentage > 0).lower()}
+    opaque_stegano_percentage = {opaque_stegano_percentage}
+    """
+
+# compile-time budget: the heaviest opaque constructs with a budget of one
+# second, which the estimate of large functions (e.g. testcase012) exceeds
+def get_budget_config():
+
+    return f"""
+    [general]
+    obfuscation_enabled = true
+    rng_seed = 0123456789
+    module_time_budget = 2
+    function_time_budget = 1
+
+    [functions.default]
+    obfuscation_enabled = true
+    opaque_predicates_enabled = true
+    opaque_gadget_addresses_enabled = true
+    gadget_addresses_obfuscation_percentage = 100
+    opaque_immediate_operands_enabled = true
+    opaque_immediate_operands_percentage = 100
+    opaque_branch_targets_enabled = true
+    opaque_branch_targets_percentage = 100
+    opaque_predicates_algorithm = "r3sat32"
+    opaque_predicates_input_algorithm = "addreg"
+    """
+
+# static archive: used only with the archives of ROPFUSCATOR_STATIC_LIBRARIES
+# (e.g. libc.a, linked with -static). Every gadget address is opaque, hence
+# referenced through a random anchor of its section, and each chain is checked
+# against the instruction it replaces (verify_chains)
+def get_static_archive_config():
+
+    return f"""
+    [general]
+    obfuscation_enabled = true
+    rng_seed = 0123456789
+    verify_chains = true
+
+    [functions.default]
+    obfuscation_enabled = true
+    opaque_predicates_enabled = true
+    opaque_gadget_addresses_enabled = true
+    gadget_addresses_obfuscation_percentage = 100
+    opaque_immediate_operands_enabled = true
+    opaque_branch_targets_enabled = true
+    """
+
 def main():
     config_number = 0
 
+    with open("config_budget.toml", "w") as f:
+        f.write(get_budget_config())
+
+    with open("config_static_archive.toml", "w") as f:
+        f.write(get_static_archive_config())
+
+    for feature_number, feature_set in enumerate(itertools.product(
+            BOOL_VALUES, ChainSetupPlacement, MAX_CHAIN_LENGTH_VALUES,
+            BOOL_VALUES, STEGANO_PERCENTAGE_VALUES)):
+        with open(f"config_feature_{feature_number}.toml", "w") as f:
+            f.write(get_feature_config(*feature_set))
+
     for bool_set in itertools.product(BOOL_VALUES, repeat=12):
         obfuscation_enabled,\
         search_segment_for_gadget, \
@@ -0,0 +1,40 @@
+/*
+ * Large function, obfuscated with a compile-time budget (see
+ * config_budget.toml): its estimated compile time exceeds the budget, hence
+ * it is degraded
+ */
+#include <stdio.h>
+
+#define STEP(i)                                                                \
+  x = x * 31 + (i);                                                            \
+  if (x & 1) {                                                                 \
+    y += x ^ (i);                                                              \
+  } else {                                                                     \
+    y -= x >> 3;                                                               \
+  }
+#define STEP4(i)    STEP(i) STEP(i + 1) STEP(i + 2) STEP(i + 3)
+#define STEP16(i)   STEP4(i) STEP4(i + 4) STEP4(i + 8) STEP4(i + 12)
+#define STEP64(i)   STEP16(i) STEP16(i + 16) STEP16(i + 32) STEP16(i + 48)
+#define STEP256(i)  STEP64(i) STEP64(i + 64) STEP64(i + 128) STEP64(i + 192)
+#define STEP1024(i) STEP256(i) STEP256(i + 256) STEP256(i + 512) STEP256(i + 768)
+
+unsigned int large(unsigned int x) {
+  unsigned int y = 0;
+
+  STEP1024(0)
+  STEP1024(1024)
+  STEP1024(2048)
+  STEP1024(3072)
+
+  return x ^ y;
+}
+
+int main() {
+  unsigned int i;
+
+  for (i = 0; i < 8; i++) {
+    printf("large(%u) = %u\n", i, large(i));
+  }
+
+  return 0;
+}
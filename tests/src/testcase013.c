@@ -0,0 +1,40 @@
+/* This program is for testing the lowering of imul.
+ * Products are computed with imul gadgets, with "mul" gadgets (which
+ * clobber edx) or with shift/add sequences. The other factors are kept
+ * live across the multiplications, so that a clobbered register changes
+ * the result.
+ * Example:
+ *      imull   %ecx, %eax
+ *      imull   $37, %edx, %esi
+ *      imull   gm, %edi
+ */
+
+#include <stdio.h>
+
+volatile int gm = 12345;
+
+unsigned int product(unsigned int a, unsigned int b, unsigned int c,
+                     unsigned int d) {
+  unsigned int p = a * b;
+  unsigned int q = c * d;
+  unsigned int r = p * q;
+
+  // multiplications by constants (imul or shift/add)
+  unsigned int s = a * 37 + b * 3 + c * 1000003 + d * -7;
+
+  // multiplication by a memory operand
+  unsigned int t = d * gm;
+
+  return a + b + c + d + p + q + r + s + t;
+}
+
+int main() {
+  unsigned int i;
+
+  for (i = 0; i < 16; i++) {
+    printf("%u\n", product(i, i + 0x10001, i * 7 + 3, 0xfffffff0 - i));
+  }
+  printf("%d\n", gm * -3);
+
+  return 0;
+}
@@ -0,0 +1,62 @@
+/* This program is for testing the lowering of cmov and setcc.
+ * Equality and unsigned comparisons (e, ne, b, ae) are selected with cmov
+ * gadgets, and their results are merged into the low byte of the
+ * destination register.
+ * Example:
+ *      cmpl    %ecx, %eax
+ *      cmovel  %edx, %esi
+ *      setb    %al
+ */
+
+#include <stdio.h>
+
+volatile unsigned int gv = 0x7fffffff;
+
+unsigned int select_eq(unsigned int a, unsigned int b, unsigned int x,
+                       unsigned int y) {
+  return a == b ? x : y;
+}
+
+unsigned int select_below(unsigned int a, unsigned int b, unsigned int x,
+                          unsigned int y) {
+  return a < b ? x : y;
+}
+
+unsigned int flags(unsigned int a, unsigned int b) {
+  unsigned int eq    = a == b;
+  unsigned int ne    = a != b;
+  unsigned int below = a < b;
+  unsigned int above = a >= b;
+
+  // the upper bytes of the destinations must be preserved
+  return (eq << 24) | (ne << 16) | (below << 8) | above;
+}
+
+unsigned int count_below(const unsigned int *values, int n, unsigned int max) {
+  unsigned int count = 0;
+  int          i;
+
+  for (i = 0; i < n; i++) {
+    count += values[i] < max;
+  }
+  return count;
+}
+
+int main() {
+  unsigned int values[] = {0, 1, 2, 0x7ffffffe, 0x7fffffff, 0x80000000,
+                           0xfffffffe, 0xffffffff};
+  int          n        = sizeof(values) / sizeof(values[0]);
+  int          i, j;
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < n; j++) {
+      printf("%08x %08x %08x\n",
+             select_eq(values[i], values[j], i, j + 100),
+             select_below(values[i], values[j], values[i] ^ j, gv),
+             flags(values[i], values[j]));
+    }
+    printf("%u\n", count_below(values, n, values[i]));
+  }
+
+  return 0;
+}
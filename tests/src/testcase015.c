@@ -0,0 +1,65 @@
+/* This program is for testing indirect calls.
+ * Functions are called through a register, through a table in memory and
+ * through a structure member, so that both "call *%reg" and "call *mem"
+ * are lowered.
+ * Example:
+ *      calll   *%eax
+ *      calll   *ops(,%esi,4)
+ *      calll   *4(%ebx)
+ */
+
+#include <stdio.h>
+
+typedef unsigned int (*binop)(unsigned int, unsigned int);
+
+static unsigned int add(unsigned int a, unsigned int b) { return a + b; }
+static unsigned int sub(unsigned int a, unsigned int b) { return a - b; }
+static unsigned int mul(unsigned int a, unsigned int b) { return a * b; }
+static unsigned int mix(unsigned int a, unsigned int b) {
+  return (a << 3) ^ b;
+}
+
+binop ops[] = {add, sub, mul, mix};
+
+struct calculator {
+  const char *name;
+  binop       op;
+};
+
+struct calculator calculators[] = {
+    {"add", add}, {"sub", sub}, {"mul", mul}, {"mix", mix}};
+
+volatile int selector = 2;
+
+unsigned int apply(binop op, unsigned int a, unsigned int b) {
+  return op(a, b);
+}
+
+unsigned int fold(int n, unsigned int seed) {
+  unsigned int acc = seed;
+  int          i;
+
+  for (i = 0; i < n; i++) {
+    acc = ops[i % 4](acc, i + 1);
+  }
+  return acc;
+}
+
+unsigned int run(struct calculator *calc, unsigned int a, unsigned int b) {
+  return calc->op(a, b) + calc->op(b, a);
+}
+
+int main() {
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    printf("%s %u %u %u\n",
+           calculators[i].name,
+           apply(ops[i], i * 7, 3),
+           run(&calculators[i], i + 11, -i),
+           fold(10 + i, i));
+  }
+  printf("%u\n", ops[selector](selector, 40));
+
+  return 0;
+}
@@ -0,0 +1,393 @@
+// ==============================================================================
+//   CHAIN FUZZER
+//   part of the ROPfuscator project
+// ==============================================================================
+// This tool checks the ROP chains outside of the compiler pass: random
+// instructions are built, lowered to chains by ROPEngine, and executed by the
+// ChainInterpreter on random register states against the original
+// instruction. Every mismatch is reported together with the instruction and
+// the scratch registers which were available.
+// The interpreter models an x86-32 machine: with an x86-64 triple, the
+// chains are built but not executed.
+//
+// usage: ropf-chain-fuzz -library=/lib/i386-linux-gnu/libc.so.6
+//                        [-triple=T] [-iterations=N] [-seed=N] [-trials=N]
+//
+
+#include "BinAutopsy.h"
+#include "ChainInterpreter.h"
+#include "Debug.h"
+#include "MathUtil.h"
+#include "ROPEngine.h"
+#include "ROPfuscatorConfig.h"
+#include "X86.h"
+#include "X86InstrInfo.h"
+#include "X86Subtarget.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/CodeGen/MachineFunction.h"
+#include "llvm/CodeGen/MachineInstrBuilder.h"
+#include "llvm/CodeGen/MachineModuleInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetLoweringObjectFile.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+using namespace ropf;
+
+namespace {
+
+// ----------------------------------------------------------------
+//  COMMAND LINE ARGUMENTS
+// ----------------------------------------------------------------
+cl::opt<std::string>
+    LibraryPath("library",
+                cl::desc("Library where the gadgets are extracted"),
+                cl::value_desc("path"),
+                cl::Required);
+
+cl::opt<std::string>
+    TripleName("triple",
+               cl::desc("Target triple, i386 or x86_64 "
+                        "(default: i386-unknown-linux-gnu)"),
+               cl::init("i386-unknown-linux-gnu"));
+
+cl::opt<unsigned int>
+    Iterations("iterations",
+               cl::desc("Number of random instructions (default: 10000)"),
+               cl::init(10000));
+
+cl::opt<unsigned int> Seed("seed",
+                           cl::desc("Seed of the random instructions"),
+                           cl::init(0));
+
+cl::opt<unsigned int>
+    Trials("trials",
+           cl::desc("Random states checked for each chain (default: 8)"),
+           cl::init(8));
+
+// general purpose registers (the stack pointer is not handled by the chains)
+const std::vector<unsigned int> GPRegs32 = {
+    X86::EAX, X86::EBX, X86::ECX, X86::EDX, X86::ESI, X86::EDI, X86::EBP};
+const std::vector<unsigned int> GPRegs64 = {
+    X86::RAX, X86::RBX, X86::RCX, X86::RDX, X86::RSI, X86::RDI, X86::RBP};
+
+// opcodes which are built by buildRandomInstr()
+const std::vector<unsigned int> Opcodes32 = {
+    X86::ADD32rr,   X86::SUB32rr,   X86::AND32rr,   X86::XOR32rr,
+    X86::ADD32ri,   X86::ADD32ri8,  X86::SUB32ri,   X86::SUB32ri8,
+    X86::AND32ri,   X86::AND32ri8,  X86::INC32r,    X86::DEC32r,
+    X86::IMUL32rr,  X86::IMUL32rri, X86::IMUL32rm,  X86::MOV32rr,
+    X86::MOV32ri,   X86::MOV32rm,   X86::MOV32mr,   X86::MOV32mi,
+    X86::LEA32r,    X86::CMP32rr,   X86::CMP32ri,   X86::CMP32ri8,
+    X86::CMP32rm,   X86::ADD32rm,   X86::SUB32rm,   X86::AND32rm,
+    X86::XOR32rm};
+const std::vector<unsigned int> Opcodes64 = {
+    X86::ADD64rr,     X86::SUB64rr,     X86::AND64rr,     X86::XOR64rr,
+    X86::ADD64ri32,   X86::ADD64ri8,    X86::SUB64ri32,   X86::SUB64ri8,
+    X86::AND64ri32,   X86::AND64ri8,    X86::INC64r,      X86::DEC64r,
+    X86::IMUL64rr,    X86::IMUL64rri32, X86::IMUL64rm,    X86::MOV64rr,
+    X86::MOV64ri32,   X86::MOV64rm,     X86::MOV64mr,     X86::MOV64mi32,
+    X86::LEA64r,      X86::CMP64rr,     X86::CMP64ri32,   X86::CMP64ri8,
+    X86::CMP64rm,     X86::ADD64rm,     X86::SUB64rm,     X86::AND64rm,
+    X86::XOR64rm};
+
+// registers and opcodes of the target
+const std::vector<unsigned int> *GPRegs  = &GPRegs32;
+const std::vector<unsigned int> *Opcodes = &Opcodes32;
+
+template <typename T> const T &pick(const std::vector<T> &items) {
+  return items[math::Random::range32(0, items.size() - 1)];
+}
+
+// randomImm - returns a random immediate, which fits in 8 bits if imm8 is set
+int64_t randomImm(bool imm8) {
+  if (imm8) {
+    return static_cast<int8_t>(math::Random::rand());
+  }
+  return static_cast<int32_t>(math::Random::rand());
+}
+
+// addMemory - appends a [base + disp] memory reference
+void addMemory(MachineInstrBuilder &MIB) {
+  MIB.addReg(pick(*GPRegs))
+      .addImm(1)
+      .addReg(0)
+      .addImm(randomImm(math::Random::bit()))
+      .addReg(0);
+}
+
+// buildRandomInstr - appends an instruction with random operands to MBB
+MachineInstr *buildRandomInstr(MachineBasicBlock  &MBB,
+                               const X86InstrInfo &TII) {
+  unsigned int        opcode = pick(*Opcodes);
+  unsigned int        dst    = pick(*GPRegs);
+  unsigned int        src    = pick(*GPRegs);
+  bool                imm8   = false;
+  MachineInstrBuilder MIB;
+
+  switch (opcode) {
+  case X86::ADD32ri8:
+  case X86::SUB32ri8:
+  case X86::AND32ri8:
+  case X86::CMP32ri8:
+  case X86::ADD64ri8:
+  case X86::SUB64ri8:
+  case X86::AND64ri8:
+  case X86::CMP64ri8:
+    imm8 = true;
+    break;
+  }
+
+  switch (opcode) {
+  case X86::ADD32rr:
+  case X86::SUB32rr:
+  case X86::AND32rr:
+  case X86::XOR32rr:
+  case X86::IMUL32rr:
+  case X86::ADD64rr:
+  case X86::SUB64rr:
+  case X86::AND64rr:
+  case X86::XOR64rr:
+  case X86::IMUL64rr:
+    MIB = BuildMI(MBB, MBB.end(), DebugLoc(), TII.get(opcode), dst)
+              .addReg(dst)
+              .addReg(src);
+    break;
+  case X86::ADD32ri:
+  case X86::ADD32ri8:
+  case X86::SUB32ri:
+  case X86::SUB32ri8:
+  case X86::AND32ri:
+  case X86::AND32ri8:
+  case X86::ADD64ri32:
+  case X86::ADD64ri8:
+  case X86::SUB64ri32:
+  case X86::SUB64ri8:
+  case X86::AND64ri32:
+  case X86::AND64ri8:
+    MIB = BuildMI(MBB, MBB.end(), DebugLoc(), TII.get(opcode), dst)
+              .addReg(dst)
+              .addImm(randomImm(imm8));
+    break;
+  case X86::INC32r:
+  case X86::DEC32r:
+  case X86::INC64r:
+  case X86::DEC64r:
+    MIB = BuildMI(MBB, MBB.end(), DebugLoc(), TII.get(opcode), dst)
+              .addReg(dst);
+    break;
+  case X86::IMUL32rri:
+  case X86::IMUL64rri32:
+    MIB = BuildMI(MBB, MBB.end(), DebugLoc(), TII.get(opcode), dst)
+              .addReg(src)
+              .addImm(randomImm(false));
+    break;
+  case X86::IMUL32rm:
+  case X86::ADD32rm:
+  case X86::SUB32rm:
+  case X86::AND32rm:
+  case X86::XOR32rm:
+  case X86::IMUL64rm:
+  case X86::ADD64rm:
+  case X86::SUB64rm:
+  case X86::AND64rm:
+  case X86::XOR64rm:
+    MIB = BuildMI(MBB, MBB.end(), DebugLoc(), TII.get(opcode), dst)
+              .addReg(dst);
+    addMemory(MIB);
+    break;
+  case X86::MOV32rr:
+  case X86::MOV64rr:
+    MIB = BuildMI(MBB, MBB.end(), DebugLoc(), TII.get(opcode), dst)
+              .addReg(src);
+    break;
+  case X86::MOV32ri:
+  case X86::MOV64ri32:
+    MIB = BuildMI(MBB, MBB.end(), DebugLoc(), TII.get(opcode), dst)
+              .addImm(randomImm(false));
+    break;
+  case X86::MOV32rm:
+  case X86::LEA32r:
+  case X86::MOV64rm:
+  case X86::LEA64r:
+    MIB = BuildMI(MBB, MBB.end(), DebugLoc(), TII.get(opcode), dst);
+    addMemory(MIB);
+    break;
+  case X86::MOV32mr:
+  case X86::MOV64mr:
+    MIB = BuildMI(MBB, MBB.end(), DebugLoc(), TII.get(opcode));
+    addMemory(MIB);
+    MIB.addReg(src);
+    break;
+  case X86::MOV32mi:
+  case X86::MOV64mi32:
+    MIB = BuildMI(MBB, MBB.end(), DebugLoc(), TII.get(opcode));
+    addMemory(MIB);
+    MIB.addImm(randomImm(false));
+    break;
+  case X86::CMP32rr:
+  case X86::CMP64rr:
+    MIB = BuildMI(MBB, MBB.end(), DebugLoc(), TII.get(opcode))
+              .addReg(dst)
+              .addReg(src);
+    break;
+  case X86::CMP32ri:
+  case X86::CMP32ri8:
+  case X86::CMP64ri32:
+  case X86::CMP64ri8:
+    MIB = BuildMI(MBB, MBB.end(), DebugLoc(), TII.get(opcode))
+              .addReg(dst)
+              .addImm(randomImm(imm8));
+    break;
+  case X86::CMP32rm:
+  case X86::CMP64rm:
+    MIB = BuildMI(MBB, MBB.end(), DebugLoc(), TII.get(opcode)).addReg(dst);
+    addMemory(MIB);
+    break;
+  }
+
+  // the flags are checked by the interpreter only if they are live
+  MachineInstr   *MI    = MIB.getInstr();
+  MachineOperand *flags = MI->findRegisterDefOperand(X86::EFLAGS);
+  if (flags && !MI->isCompare() && math::Random::bit()) {
+    flags->setIsDead();
+  }
+
+  return MI;
+}
+
+// randomScratchRegs - returns a random subset of the registers which are not
+// referenced by MI
+std::vector<unsigned int> randomScratchRegs(const MachineInstr        &MI,
+                                            const TargetRegisterInfo *TRI) {
+  std::vector<unsigned int> scratchRegs;
+
+  for (unsigned int reg : *GPRegs) {
+    if (!MI.readsRegister(reg, TRI) && !MI.modifiesRegister(reg, TRI) &&
+        math::Random::bit()) {
+      scratchRegs.push_back(reg);
+    }
+  }
+
+  return scratchRegs;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+
+  LLVMInitializeX86TargetInfo();
+  LLVMInitializeX86Target();
+  LLVMInitializeX86TargetMC();
+  LLVMInitializeX86Disassembler();
+
+  cl::ParseCommandLineOptions(argc, argv, "ROPfuscator chain fuzzer\n");
+
+  std::string   error;
+  Triple        triple(Triple::normalize(TripleName));
+  const Target *target = TargetRegistry::lookupTarget(triple.str(), error);
+  if (!target) {
+    dbg_fmt("[!] Error: {}\n", error);
+    return 1;
+  }
+  if (triple.getArch() != Triple::x86 && triple.getArch() != Triple::x86_64) {
+    dbg_fmt("[!] Error: unsupported triple {}\n", triple.str());
+    return 1;
+  }
+
+  // the interpreter models an x86-32 machine: x86-64 chains are only built
+  bool is64Bit = triple.getArch() == Triple::x86_64;
+  if (is64Bit) {
+    GPRegs  = &GPRegs64;
+    Opcodes = &Opcodes64;
+  }
+
+  std::unique_ptr<LLVMTargetMachine> TM(static_cast<LLVMTargetMachine *>(
+      target->createTargetMachine(triple.str(),
+                                  is64Bit ? "x86-64" : "i686",
+                                  "",
+                                  TargetOptions(),
+                                  Reloc::PIC_)));
+
+  LLVMContext context;
+  Module      module("ropf-chain-fuzz", context);
+  module.setTargetTriple(triple.str());
+  module.setDataLayout(TM->createDataLayout());
+
+  Function *F = Function::Create(
+      FunctionType::get(Type::getVoidTy(context), false),
+      GlobalValue::ExternalLinkage,
+      "fuzz",
+      &module);
+
+  MachineModuleInfo MMI(TM.get());
+  TM->getObjFileLowering()->Initialize(MMI.getContext(), *TM);
+
+  MachineFunction   &MF  = MMI.getOrCreateMachineFunction(*F);
+  MachineBasicBlock *MBB = MF.CreateMachineBasicBlock();
+  MF.push_back(MBB);
+
+  const X86Subtarget       &STI = MF.getSubtarget<X86Subtarget>();
+  const X86InstrInfo       &TII = *STI.getInstrInfo();
+  const TargetRegisterInfo *TRI = STI.getRegisterInfo();
+
+  GlobalConfig config;
+  config.libraryPath = LibraryPath;
+
+  std::shared_ptr<const BinaryAutopsy> BA = BinaryAutopsy::acquire(config, MF);
+  math::Random::ScopedSeed             seed(Seed);
+  ChainInterpreter                     interpreter(Trials);
+  int                                  lastEspId  = 0;
+  size_t                               lowered    = 0;
+  size_t                               mismatches = 0;
+
+  for (unsigned int i = 0; i < Iterations; i++) {
+    MachineInstr             *MI          = buildRandomInstr(*MBB, TII);
+    std::vector<unsigned int> scratchRegs = randomScratchRegs(*MI, TRI);
+    std::vector<unsigned int> engineRegs  = scratchRegs;
+    ROPChain                  chain;
+    ROPEngine                 engine(*BA, lastEspId);
+
+    if (engine.ropify(*MI, engineRegs, false, chain) == ROPChainStatus::OK) {
+      lowered++;
+
+      std::string mismatch;
+      if (!is64Bit && !interpreter.verify(*MI, chain, scratchRegs, mismatch)) {
+        mismatches++;
+        dbg_fmt("[!] {}: chain does not match ({})\n", *MI, mismatch);
+        dbg_fmt("    scratch registers:");
+        for (unsigned int reg : scratchRegs) {
+          dbg_fmt(" {}", TRI->getName(reg));
+        }
+        dbg_fmt("\n");
+      }
+    }
+
+    MI->eraseFromParent();
+  }
+
+  dbg_fmt("[*] Instructions: {}, lowered: {}, verified: {}, skipped: {}, "
+          "mismatches: {}, gadgets executed: {}\n",
+          Iterations,
+          lowered,
+          interpreter.verifiedCount,
+          interpreter.skippedCount,
+          mismatches,
+          interpreter.executedGadgets);
+
+  BinaryAutopsy::release(BA, config);
+
+  return mismatches ? 1 : 0;
+}